@@ -0,0 +1,680 @@
+#pragma once
+#include "Journal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <numeric>
+
+namespace RM
+{
+//Столбцовый архив закрытого файла журнала.
+//Файл: Magic, Version, длина и CRC-32C словарей, словари инструментов и инвесторов (число строк, строки с длиной uint16), блоки.
+//Блок до BlockSize объектов: SBlockHeader, тело - столбцы по порядку:
+//тип объекта (TRecord); время, номер инструмента и цена котировок и сделок; инвестор, количество, сторона и длина номера сделок;
+//id меток снимка; номера сделок подряд.
+//Целый столбец - минимум блока, шаг (НОД смещений) и смещения от минимума в шагах одной ширины 1, 2, 4 или 8 байт,
+//поэтому разбор столбца - цикл без ветвлений. Время - первое значение и такой столбец разностей соседних.
+//Цена и количество - целые после умножения на 10^k с наименьшим k, при котором деление возвращает то же число, иначе double как есть.
+//Пустые столбцы не пишутся. Значения - в порядке байт машины.
+namespace Archive
+{
+static const uint32_t Magic = 0x414d5231; //RMA1
+static const uint16_t Version = 1;
+static const size_t BlockSize = 4096;
+
+static const uint8_t MaxScale = 9;
+static const uint8_t RawReals = 0xff;
+
+struct SBlockHeader
+{
+	uint32_t m_size;
+	uint32_t m_crc;
+	uint32_t m_count;
+	uint32_t m_quotes;
+	uint32_t m_trades;
+	uint32_t m_marks;
+	int64_t m_first; //Время самой ранней и самой поздней котировки или сделки, (max, min) - их нет
+	int64_t m_last;
+};
+
+inline
+double Pow10(uint8_t scale)
+{
+	static const double _vals[MaxScale + 1] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+	return _vals[scale];
+}
+
+//Разбор столбцов - циклы без зависимостей между элементами: они векторизуются, на x86 версия для AVX2 выбирается при запуске
+#if defined(__x86_64__) || defined(__i386__)
+#define RM_ARCHIVE_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define RM_ARCHIVE_CLONES
+#endif
+
+template <typename T> inline
+void WidenInts(const char *src, size_t n, int64_t base, uint64_t step, int64_t *dst)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		T val;
+		std::memcpy(&val, src + i * sizeof(T), sizeof(T));
+		dst[i] = int64_t(uint64_t(base) + val * step);
+	}
+}
+
+RM_ARCHIVE_CLONES
+static void DecodeInts(const char *src, uint8_t width, size_t n, int64_t base, uint64_t step, int64_t *dst)
+{
+	switch (width)
+	{
+	case 1: return WidenInts<uint8_t>(src, n, base, step, dst);
+	case 2: return WidenInts<uint16_t>(src, n, base, step, dst);
+	case 4: return WidenInts<uint32_t>(src, n, base, step, dst);
+	default: return WidenInts<uint64_t>(src, n, base, step, dst);
+	}
+}
+
+RM_ARCHIVE_CLONES
+static void DecodeReals(const int64_t *src, size_t n, double div, double *dst)
+{
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = double(src[i]) / div;
+}
+
+//Объекты копятся в столбцах текущего блока; Finish() возвращает весь файл
+class CWriter
+{
+public:
+	void Put(const SQuote &quote)
+	{
+		PutQuote(Journal::TRecord::Quote, quote);
+		Next();
+	}
+
+	void Put(const STrade &trade)
+	{
+		PutQuote(Journal::TRecord::Trade, trade);
+		m_users.push_back(GetID(m_user_ids, m_dict.m_users, trade.m_user_id));
+		m_qtys.push_back(trade.m_qty);
+		m_sides.push_back(static_cast<char>(trade.m_side));
+		m_lens.push_back(std::min<size_t>(trade.m_trade_id.size(), 0xffff));
+		m_strs.append(trade.m_trade_id, 0, m_lens.back());
+		Next();
+	}
+
+	void Put(const Journal::SSnapshotMark &mark)
+	{
+		m_types.push_back(char(Journal::TRecord::Snapshot));
+		m_marks.push_back(int64_t(mark.m_id));
+		Next();
+	}
+
+	std::string Finish()
+	{
+		PutBlock();
+
+		std::string dict;
+		m_buf = &dict;
+		PutDict(m_dict.m_symbols);
+		PutDict(m_dict.m_users);
+
+		std::string res;
+		m_buf = &res;
+		Write(Magic);
+		Write(Version);
+		Write(uint32_t(dict.size()));
+		Write(TS::CCrc32c::Calc(dict.data(), dict.size()));
+		res += dict;
+		res += m_blocks;
+		return res;
+	}
+
+protected:
+	template <typename T>
+	void PutQuote(Journal::TRecord type, const T &obj)
+	{
+		m_types.push_back(char(type));
+		m_times.push_back(Journal::ToNanoseconds(obj.m_time));
+		m_symbols.push_back(GetID(m_symbol_ids, m_dict.m_symbols, obj.m_symbol));
+		m_prices.push_back(obj.m_price);
+	}
+
+	void Next()
+	{
+		if (m_types.size() >= BlockSize)
+			PutBlock();
+	}
+
+	void PutBlock()
+	{
+		if (m_types.empty())
+			return;
+
+		m_buf = &m_blocks;
+		const size_t pos = m_blocks.size();
+		m_blocks.resize(pos + sizeof(SBlockHeader));
+		m_blocks += m_types;
+		PutDeltas(m_times);
+		PutInts(m_symbols);
+		PutReals(m_prices);
+		PutInts(m_users);
+		PutReals(m_qtys);
+		PutInts(m_sides);
+		PutInts(m_lens);
+		PutInts(m_marks);
+		m_blocks += m_strs;
+
+		SBlockHeader hdr;
+		hdr.m_size = uint32_t(m_blocks.size() - pos - sizeof(hdr));
+		hdr.m_crc = TS::CCrc32c::Calc(m_blocks.data() + pos + sizeof(hdr), hdr.m_size);
+		hdr.m_count = uint32_t(m_types.size());
+		hdr.m_trades = uint32_t(m_users.size());
+		hdr.m_quotes = uint32_t(m_times.size()) - hdr.m_trades;
+		hdr.m_marks = uint32_t(m_marks.size());
+		hdr.m_first = m_times.empty()? std::numeric_limits<int64_t>::max(): *std::min_element(m_times.begin(), m_times.end());
+		hdr.m_last = m_times.empty()? std::numeric_limits<int64_t>::min(): *std::max_element(m_times.begin(), m_times.end());
+		std::memcpy(&m_blocks[pos], &hdr, sizeof(hdr));
+
+		m_types.clear();
+		m_times.clear();
+		m_symbols.clear();
+		m_prices.clear();
+		m_users.clear();
+		m_qtys.clear();
+		m_sides.clear();
+		m_lens.clear();
+		m_marks.clear();
+		m_strs.clear();
+	}
+
+	template <typename T>
+	void Write(const T &val)
+	{
+		m_buf->append(reinterpret_cast<const char *>(&val), sizeof(val));
+	}
+
+	void PutDict(const std::vector<std::string> &dict)
+	{
+		Write(uint32_t(dict.size()));
+		for (auto &item: dict)
+		{
+			Write(uint16_t(item.size()));
+			m_buf->append(item);
+		}
+	}
+
+	void PutInts(const std::vector<int64_t> &vals)
+	{
+		if (vals.empty())
+			return;
+
+		const int64_t base = *std::min_element(vals.begin(), vals.end());
+		uint64_t step = 0;
+		for (auto val: vals)
+			step = std::gcd(step, uint64_t(val) - uint64_t(base));
+		step = std::max<uint64_t>(step, 1);
+
+		const uint64_t max = (uint64_t(*std::max_element(vals.begin(), vals.end())) - uint64_t(base)) / step;
+		const uint8_t width = max <= 0xff? 1: max <= 0xffff? 2: max <= 0xffffffff? 4: 8;
+		Write(base);
+		Write(step);
+		Write(width);
+		for (auto val: vals)
+		{
+			const uint64_t offset = (uint64_t(val) - uint64_t(base)) / step;
+			switch (width)
+			{
+			case 1: Write(uint8_t(offset)); break;
+			case 2: Write(uint16_t(offset)); break;
+			case 4: Write(uint32_t(offset)); break;
+			default: Write(offset); break;
+			}
+		}
+	}
+
+	void PutDeltas(const std::vector<int64_t> &vals)
+	{
+		if (vals.empty())
+			return;
+
+		Write(vals[0]);
+		m_deltas.clear();
+		for (size_t i = 1; i < vals.size(); ++i)
+			m_deltas.push_back(int64_t(uint64_t(vals[i]) - uint64_t(vals[i - 1])));
+		PutInts(m_deltas);
+	}
+
+	void PutReals(const std::vector<double> &vals)
+	{
+		if (vals.empty())
+			return;
+
+		for (uint8_t scale = 0; scale <= MaxScale; ++scale)
+		{
+			const double mul = Pow10(scale);
+			m_scaled.clear();
+			for (auto val: vals)
+			{
+				//NaN, бесконечность и значения вне int64 не приводятся к целому
+				const double scaled = std::nearbyint(val * mul);
+				if (!(std::fabs(scaled) < 1e15))
+					break;
+
+				const double res = double(int64_t(scaled)) / mul;
+				if (std::memcmp(&res, &val, sizeof(val)) != 0)
+					break;
+				m_scaled.push_back(int64_t(scaled));
+			}
+
+			if (m_scaled.size() == vals.size())
+			{
+				Write(scale);
+				PutInts(m_scaled);
+				return;
+			}
+		}
+
+		Write(RawReals);
+		for (auto val: vals)
+			Write(val);
+	}
+
+	static int64_t GetID(std::unordered_map<std::string, uint32_t> &ids, std::vector<std::string> &dict, const std::string &val)
+	{
+		auto res = ids.emplace(val, uint32_t(dict.size()));
+		if (res.second)
+			dict.push_back(val.substr(0, 0xffff));
+		return res.first->second;
+	}
+
+	Journal::CReader::SDict m_dict;
+	std::unordered_map<std::string, uint32_t> m_symbol_ids;
+	std::unordered_map<std::string, uint32_t> m_user_ids;
+
+	std::string m_types;
+	std::vector<int64_t> m_times;
+	std::vector<int64_t> m_symbols;
+	std::vector<double> m_prices;
+	std::vector<int64_t> m_users;
+	std::vector<double> m_qtys;
+	std::vector<int64_t> m_sides;
+	std::vector<int64_t> m_lens;
+	std::vector<int64_t> m_marks;
+	std::string m_strs;
+	std::vector<int64_t> m_deltas;
+	std::vector<int64_t> m_scaled;
+
+	std::string m_blocks;
+	std::string *m_buf = nullptr;
+};
+
+//Разбор архива из памяти; тот же порядок объектов и интерфейс, что у Journal::CReader.
+//Чтение останавливается на первом повреждённом блоке, GetSize() - длина корректной части.
+class CReader
+{
+public:
+	typedef Journal::CReader::SDict SDict;
+
+	CReader(const char *data, size_t size)
+	: m_data(data)
+	, m_size(size)
+	{
+		m_cur = data;
+		m_end = data + size;
+		uint32_t magic, dict_size, dict_crc;
+		uint16_t version;
+		if (!Read(magic) || !Read(version) || !Read(dict_size) || !Read(dict_crc) || magic != Magic || version != Version ||
+			size_t(m_end - m_cur) < dict_size || TS::CCrc32c::Calc(m_cur, dict_size) != dict_crc)
+			return;
+
+		auto dict = std::make_shared<SDict>();
+		m_end = m_cur + dict_size;
+		if (!ReadDict(dict->m_symbols) || !ReadDict(dict->m_users) || m_cur != m_end)
+			return;
+
+		m_dict = dict;
+		m_pos = m_cur - data;
+	}
+
+	//Блоки [begin, end) архива data
+	CReader(const char *data, size_t begin, size_t end, const std::shared_ptr<const SDict> &dict)
+	: m_data(data)
+	, m_size(end)
+	, m_pos(begin)
+	, m_dict(dict)
+	{
+	}
+
+	//Деление на части из целых блоков примерно по step байт по заголовкам блоков, с их временем.
+	//Последняя часть доходит до конца данных: повреждённый блок найдётся при её разборе.
+	std::vector<CReader> Split(size_t step) const
+	{
+		std::vector<CReader> res;
+		if (!m_dict)
+		{
+			res.push_back(*this);
+			return res;
+		}
+
+		size_t begin = m_pos, pos = m_pos;
+		int64_t first = std::numeric_limits<int64_t>::max(), last = std::numeric_limits<int64_t>::min();
+		SBlockHeader hdr;
+		while (GetBlock(pos, hdr))
+		{
+			if (pos - begin >= step)
+			{
+				res.emplace_back(m_data, begin, pos, m_dict);
+				res.back().SetTimeRange(first, last);
+				begin = pos;
+				first = std::numeric_limits<int64_t>::max();
+				last = std::numeric_limits<int64_t>::min();
+			}
+
+			first = std::min(first, hdr.m_first);
+			last = std::max(last, hdr.m_last);
+			pos += sizeof(hdr) + hdr.m_size;
+		}
+
+		res.emplace_back(m_data, begin, m_size, m_dict);
+		res.back().SetTimeRange(first, last);
+		return res;
+	}
+
+	//Время самой ранней и самой поздней котировки или сделки части Split, (max, min) - их в части нет
+	std::pair<TDateTime, TDateTime> GetTimeRange() const
+	{
+		return {m_first, m_last};
+	}
+
+	//func вызывается для SQuote, STrade и SSnapshotMark; возвращает число котировок и сделок
+	template <typename TFunc>
+	size_t ForEach(TFunc &&func)
+	{
+		return Decode([](const SBlockHeader &) {return true;}, func);
+	}
+
+	//Котировки и сделки со временем в [from, to]: блоки вне интервала не разбираются; возвращает их число
+	template <typename TFunc>
+	size_t Scan(const TDateTime &from, const TDateTime &to, TFunc &&func)
+	{
+		const auto first = Journal::ToNanoseconds(from), last = Journal::ToNanoseconds(to);
+		size_t n = 0;
+		Decode([first, last](const SBlockHeader &hdr)
+		{
+			return hdr.m_last >= first && hdr.m_first <= last;
+		},
+		[&n, &from, &to, &func](auto &obj)
+		{
+			if (InRange(obj, from, to))
+			{
+				func(obj);
+				++n;
+			}
+		});
+		return n;
+	}
+
+	//Проверка заголовков и CRC блоков без разбора; результат - IsComplete()
+	void Verify()
+	{
+		SBlockHeader hdr;
+		while (m_dict && GetBlock(m_pos, hdr) && TS::CCrc32c::Calc(m_data + m_pos + sizeof(hdr), hdr.m_size) == hdr.m_crc)
+			m_pos += sizeof(hdr) + hdr.m_size;
+	}
+
+	size_t GetSize() const
+	{
+		return m_pos;
+	}
+
+	bool IsComplete() const
+	{
+		return m_dict && m_pos == m_size;
+	}
+
+protected:
+	template <typename TFilter, typename TFunc>
+	size_t Decode(TFilter &&filter, TFunc &&func)
+	{
+		size_t n = 0;
+		SBlockHeader hdr;
+		while (m_dict && GetBlock(m_pos, hdr))
+		{
+			const char *body = m_data + m_pos + sizeof(hdr);
+			if (filter(hdr))
+			{
+				if (TS::CCrc32c::Calc(body, hdr.m_size) != hdr.m_crc || !DecodeBlock(hdr, body, func))
+					break;
+				n += hdr.m_quotes + hdr.m_trades;
+			}
+			m_pos += sizeof(hdr) + hdr.m_size;
+		}
+		return n;
+	}
+
+	bool GetBlock(size_t pos, SBlockHeader &hdr) const
+	{
+		if (pos + sizeof(hdr) > m_size)
+			return false;
+
+		std::memcpy(&hdr, m_data + pos, sizeof(hdr));
+		return hdr.m_count && hdr.m_count <= BlockSize && hdr.m_size <= m_size - pos - sizeof(hdr) &&
+			uint64_t(hdr.m_quotes) + hdr.m_trades + hdr.m_marks == hdr.m_count;
+	}
+
+	template <typename TFunc>
+	bool DecodeBlock(const SBlockHeader &hdr, const char *body, TFunc &&func)
+	{
+		m_cur = body;
+		m_end = body + hdr.m_size;
+		const char *types = m_cur;
+		const size_t n = hdr.m_quotes + hdr.m_trades;
+		if (!Skip(hdr.m_count) || !GetDeltas(n, m_times) || !GetInts(n, m_symbols) || !GetReals(n, m_prices) ||
+			!GetInts(hdr.m_trades, m_users) || !GetReals(hdr.m_trades, m_qtys) || !GetInts(hdr.m_trades, m_sides) ||
+			!GetInts(hdr.m_trades, m_lens) || !GetInts(hdr.m_marks, m_marks))
+			return false;
+
+		size_t i = 0, trade = 0, mark = 0;
+		for (size_t k = 0; k < hdr.m_count; ++k)
+		{
+			switch (Journal::TRecord(types[k]))
+			{
+			case Journal::TRecord::Quote:
+			{
+				SQuote quote;
+				if (i >= n || !GetQuote(i++, quote))
+					return false;
+
+				func(quote);
+				break;
+			}
+			case Journal::TRecord::Trade:
+			{
+				STrade trade_;
+				if (i >= n || trade >= hdr.m_trades || !GetQuote(i++, trade_) || !GetDict(m_dict->m_users, m_users[trade], trade_.m_user_id) ||
+					uint64_t(m_lens[trade]) > size_t(m_end - m_cur))
+					return false;
+
+				trade_.m_qty = m_qtys[trade];
+				trade_.m_side = TSide(char(m_sides[trade]));
+				trade_.m_trade_id.assign(m_cur, m_lens[trade]);
+				m_cur += m_lens[trade++];
+				func(trade_);
+				break;
+			}
+			case Journal::TRecord::Snapshot:
+			{
+				if (mark >= hdr.m_marks)
+					return false;
+
+				Journal::SSnapshotMark obj{uint64_t(m_marks[mark++])};
+				func(obj);
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+		return i == n && trade == hdr.m_trades && mark == hdr.m_marks && m_cur == m_end;
+	}
+
+	template <typename T>
+	bool GetQuote(size_t i, T &obj)
+	{
+		obj.m_time = Journal::FromNanoseconds(m_times[i]);
+		obj.m_price = m_prices[i];
+		return GetDict(m_dict->m_symbols, m_symbols[i], obj.m_symbol);
+	}
+
+	template <typename T>
+	static bool InRange(const T &obj, const TDateTime &from, const TDateTime &to)
+	{
+		return !(obj.m_time < from) && !(to < obj.m_time);
+	}
+
+	static bool InRange(const Journal::SSnapshotMark &, const TDateTime &, const TDateTime &)
+	{
+		return false;
+	}
+
+	template <typename T>
+	bool Read(T &dst)
+	{
+		if (size_t(m_end - m_cur) < sizeof(T))
+			return false;
+
+		std::memcpy(&dst, m_cur, sizeof(T));
+		m_cur += sizeof(T);
+		return true;
+	}
+
+	bool Skip(size_t size)
+	{
+		if (size_t(m_end - m_cur) < size)
+			return false;
+
+		m_cur += size;
+		return true;
+	}
+
+	bool GetInts(size_t n, std::vector<int64_t> &dst)
+	{
+		dst.resize(n);
+		if (!n)
+			return true;
+
+		int64_t base;
+		uint64_t step;
+		uint8_t width;
+		if (!Read(base) || !Read(step) || !Read(width) || (width != 1 && width != 2 && width != 4 && width != 8) ||
+			size_t(m_end - m_cur) / width < n)
+			return false;
+
+		DecodeInts(m_cur, width, n, base, step, dst.data());
+		m_cur += n * width;
+		return true;
+	}
+
+	//Разности разбираются как целый столбец, сложение с предыдущим - отдельным проходом
+	bool GetDeltas(size_t n, std::vector<int64_t> &dst)
+	{
+		int64_t first;
+		if (n && (!Read(first) || !GetInts(n - 1, m_scaled)))
+			return false;
+
+		dst.resize(n);
+		if (!n)
+			return true;
+
+		dst[0] = first;
+		for (size_t i = 1; i < n; ++i)
+			dst[i] = int64_t(uint64_t(dst[i - 1]) + uint64_t(m_scaled[i - 1]));
+		return true;
+	}
+
+	bool GetReals(size_t n, std::vector<double> &dst)
+	{
+		dst.resize(n);
+		if (!n)
+			return true;
+
+		uint8_t scale;
+		if (!Read(scale))
+			return false;
+
+		if (scale == RawReals)
+		{
+			if (size_t(m_end - m_cur) / sizeof(double) < n)
+				return false;
+
+			std::memcpy(dst.data(), m_cur, n * sizeof(double));
+			m_cur += n * sizeof(double);
+			return true;
+		}
+
+		if (scale > MaxScale || !GetInts(n, m_scaled))
+			return false;
+
+		DecodeReals(m_scaled.data(), n, Pow10(scale), dst.data());
+		return true;
+	}
+
+	bool ReadDict(std::vector<std::string> &dict)
+	{
+		uint32_t n;
+		if (!Read(n))
+			return false;
+
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			uint16_t size;
+			if (!Read(size) || size_t(m_end - m_cur) < size)
+				return false;
+
+			dict.emplace_back(m_cur, size);
+			m_cur += size;
+		}
+		return true;
+	}
+
+	static bool GetDict(const std::vector<std::string> &dict, int64_t id, std::string &dst)
+	{
+		if (id < 0 || uint64_t(id) >= dict.size())
+			return false;
+
+		dst = dict[id];
+		return true;
+	}
+
+	void SetTimeRange(int64_t first, int64_t last)
+	{
+		m_first = first != std::numeric_limits<int64_t>::max()? Journal::FromNanoseconds(first): TDateTime::max();
+		m_last = last != std::numeric_limits<int64_t>::min()? Journal::FromNanoseconds(last): TDateTime::min();
+	}
+
+	const char *m_data;
+	size_t m_size;
+	size_t m_pos = 0;
+
+	const char *m_cur = nullptr;
+	const char *m_end = nullptr;
+
+	std::shared_ptr<const SDict> m_dict;
+	TDateTime m_first = TDateTime::min();
+	TDateTime m_last = TDateTime::max();
+
+	//Столбцы разбираемого блока: память остаётся для следующего
+	std::vector<int64_t> m_times;
+	std::vector<int64_t> m_symbols;
+	std::vector<double> m_prices;
+	std::vector<int64_t> m_users;
+	std::vector<double> m_qtys;
+	std::vector<int64_t> m_sides;
+	std::vector<int64_t> m_lens;
+	std::vector<int64_t> m_marks;
+	std::vector<int64_t> m_scaled;
+};
+
+}
+}
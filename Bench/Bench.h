@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include "Common.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+//Замеры, которые можно запустить по имени: rm_bench <имя> [параметры]
+#define RM_BENCHES \
+	TS_ITEM(concurrent_map) \
+	TS_ITEM(moving_min_max) \
+
+#define TS_ITEM(name) int Bench_##name(int argc, char *argv[]);
+RM_BENCHES
+#undef TS_ITEM
+
+namespace Bench
+{
+typedef std::chrono::steady_clock TClock;
+
+inline
+size_t GetArg(int argc, char *argv[], int i, size_t def)
+{
+	return i < argc? std::stoull(argv[i]): def;
+}
+
+//func(i) в threads потоках одновременно; возвращает время от общего старта до завершения последнего
+template <typename TFunc>
+TClock::duration RunThreads(size_t threads, TFunc &&func)
+{
+	std::atomic<bool> start{false};
+	std::vector<std::thread> items;
+	for (size_t i = 0; i < threads; ++i)
+	{
+		items.emplace_back([&start, &func, i]()
+		{
+			while (!start.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			func(i);
+		});
+	}
+
+	const auto tm = TClock::now();
+	start.store(true, std::memory_order_release);
+	for (auto &item: items)
+		item.join();
+	return TClock::now() - tm;
+}
+
+inline
+double ToNs(TClock::duration dt, size_t n)
+{
+	return std::chrono::duration<double, std::nano>(dt).count() / std::max<size_t>(n, 1);
+}
+
+}
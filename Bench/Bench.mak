@@ -0,0 +1,10 @@
+#Замеры производительности: make -f Bench.mak, запуск build_bin/Release/rm_bench <имя> [параметры]
+PROJECT_NAME = Bench
+TARGET = executable
+TARGET_NAME = rm_bench
+
+INCLUDE = ..
+
+include ../mk/Common.mak
+SOLUTION_DIR := ..
+include $(BUILD_MAK)
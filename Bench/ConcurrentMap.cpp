@@ -0,0 +1,67 @@
+#include "Bench.h"
+#include "Common/ConcurrentMap.h"
+#include "Common/SyncObjs.h"
+
+#include <memory>
+#include <random>
+#include <shared_mutex>
+#include <unordered_map>
+
+//Поиск со вставкой по ключу, как CRiskManager::GetInvestor на каждую заявку:
+//прежний unordered_map под shared_mutex (Sys::Locked::Emplace) против TS::CConcurrentMap.
+//Параметры: число ключей, операций на поток, наибольшее число потоков (1, 2, 4... до него).
+namespace
+{
+struct SValue
+{
+	std::atomic<uint64_t> m_cnt{0};
+};
+
+typedef Sys::CLockedObject<std::unordered_map<std::string, std::unique_ptr<SValue>>, std::shared_mutex> TLockedMap;
+typedef TS::CConcurrentMap<std::string, SValue> TConcurrentMap;
+
+SValue &Get(TLockedMap &items, const std::string &key)
+{
+	auto res = Sys::Locked::Emplace(key, items, []()
+	{
+		return std::make_unique<SValue>();
+	});
+	return *res.first->second;
+}
+
+SValue &Get(TConcurrentMap &items, const std::string &key)
+{
+	return *items.insert_or_get(key).first;
+}
+
+template <typename TMap>
+double Run(const std::vector<std::string> &keys, size_t n, size_t threads)
+{
+	TMap items;
+	const auto dt = Bench::RunThreads(threads, [&items, &keys, n](size_t i)
+	{
+		std::minstd_rand rnd(i + 1);
+		for (size_t j = 0; j < n; ++j)
+			Get(items, keys[rnd() % keys.size()]).m_cnt.fetch_add(1, std::memory_order_relaxed);
+	});
+	return Bench::ToNs(dt, n);
+}
+
+}
+
+int Bench_concurrent_map(int argc, char *argv[])
+{
+	const size_t nkeys = Bench::GetArg(argc, argv, 1, 10000);
+	const size_t n = Bench::GetArg(argc, argv, 2, 2000000);
+	const size_t max_threads = Bench::GetArg(argc, argv, 3, std::max(std::thread::hardware_concurrency(), 1u));
+
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < nkeys; ++i)
+		keys.push_back(TS::FormatStr<0>("user", i));
+
+	std::cout << "keys " << nkeys << ", ops per thread " << n << ", ns per op (wall time / ops per thread)\n";
+	std::cout << "threads\tlocked\tconcurrent\n";
+	for (size_t threads = 1; threads <= max_threads; threads *= 2)
+		std::cout << threads << '\t' << Run<TLockedMap>(keys, n, threads) << '\t' << Run<TConcurrentMap>(keys, n, threads) << std::endl;
+	return 0;
+}
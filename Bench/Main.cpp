@@ -0,0 +1,17 @@
+#include "Bench.h"
+
+#include <cstring>
+
+int main(int argc, char *argv[])
+{
+#define TS_ITEM(name) if (argc > 1 && !std::strcmp(argv[1], #name)) return Bench_##name(argc - 1, argv + 1);
+	RM_BENCHES
+#undef TS_ITEM
+
+	std::cerr << "usage: " << argv[0] << " <bench> [args]\nbenches:";
+#define TS_ITEM(name) std::cerr << ' ' << #name;
+	RM_BENCHES
+#undef TS_ITEM
+	std::cerr << std::endl;
+	return 1;
+}
@@ -0,0 +1,121 @@
+#include "Bench.h"
+#include "Common/FramedQueue.h"
+
+#include <cmath>
+#include <map>
+#include <random>
+
+//Минимум и максимум по окну: прежняя агрегация на std::map со счётчиками против монотонных деков (TS::CMovingMinMax).
+//Шаг - PutValue, затем GetMax и GetMin на время шага; котировки в среднем через 100ms, цены с повторами.
+//Параметры: число шагов, доля поздних вставок в процентах (вставка в случайное место окна).
+namespace
+{
+typedef std::chrono::system_clock::time_point TTimestamp;
+
+template <typename TValue>
+struct CMapMinMaxAggregate
+{
+	template <typename TItems>
+	void Put(const TItems &items, const TTimestamp &tm, const TValue &val)
+	{
+		++m_items[val];
+	}
+
+	void Erase(const TTimestamp &tm, const TValue &val)
+	{
+		auto it = m_items.find(val);
+		if (it != m_items.end() && --it->second == 0)
+			m_items.erase(it);
+	}
+
+	TValue GetMin() const
+	{
+		return m_items.empty()? TValue(): m_items.begin()->first;
+	}
+
+	TValue GetMax() const
+	{
+		return m_items.empty()? TValue(): m_items.rbegin()->first;
+	}
+
+	std::map<TValue, size_t> m_items;
+};
+
+typedef TS::CFramedWindow<double, CMapMinMaxAggregate<double>, TTimestamp> TMapMinMax;
+typedef TS::CMovingMinMax<double, TTimestamp> TDequeMinMax;
+
+struct SStep
+{
+	TTimestamp m_put;
+	TTimestamp m_now;
+	double m_val;
+};
+
+std::vector<SStep> MakeSteps(size_t n, size_t late, std::chrono::seconds frame)
+{
+	std::minstd_rand rnd(1);
+	std::vector<SStep> res;
+	res.reserve(n);
+
+	TTimestamp now{std::chrono::hours(24 * 365)};
+	double price = 100;
+	for (size_t i = 0; i < n; ++i)
+	{
+		price = std::max(1.0, price + (int(rnd() % 21) - 10) * 0.01);
+		const double val = std::round(price * 100) / 100;
+		if (rnd() % 100 < late)
+		{
+			const auto dt = std::chrono::milliseconds(rnd() % std::chrono::milliseconds(frame).count());
+			res.push_back({now - dt, now, val});
+			continue;
+		}
+
+		now += std::chrono::milliseconds(50 + rnd() % 101);
+		res.push_back({now, now, val});
+	}
+	return res;
+}
+
+//ns на шаг и контрольная сумма результатов
+template <typename TWindow>
+std::pair<double, double> Run(const std::vector<SStep> &steps, std::chrono::seconds frame, std::vector<std::pair<double, double>> &res)
+{
+	TWindow window(frame);
+	res.resize(steps.size());
+
+	double check = 0;
+	const auto tm = Bench::TClock::now();
+	for (size_t i = 0; i < steps.size(); ++i)
+	{
+		auto &step = steps[i];
+		window.PutValue(step.m_put, step.m_val);
+		res[i] = {window.GetMax(step.m_now), window.GetMin(step.m_now)};
+		check += res[i].first - res[i].second;
+	}
+	return {Bench::ToNs(Bench::TClock::now() - tm, steps.size()), check};
+}
+
+}
+
+int Bench_moving_min_max(int argc, char *argv[])
+{
+	const size_t n = Bench::GetArg(argc, argv, 1, 2000000);
+	const size_t late = Bench::GetArg(argc, argv, 2, 1);
+
+	std::cout << "steps " << n << ", late " << late << "%, ns per step (PutValue, GetMax, GetMin)\n";
+	std::cout << "window\tmap\tdeque\tmismatches\n";
+	for (auto frame: {std::chrono::seconds(60), std::chrono::seconds(3600), std::chrono::seconds(24 * 3600)})
+	{
+		const auto steps = MakeSteps(n, late, frame);
+		std::vector<std::pair<double, double>> res1, res2;
+		const auto map = Run<TMapMinMax>(steps, frame, res1);
+		const auto deque = Run<TDequeMinMax>(steps, frame, res2);
+
+		size_t diff = 0;
+		for (size_t i = 0; i < steps.size(); ++i)
+			diff += res1[i] != res2[i];
+
+		std::cout << frame.count() << "s\t" << map.first << '\t' << deque.first << '\t' << diff << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,245 @@
+#pragma once
+#include "SyncObjs.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <tuple>
+#include <functional>
+
+namespace TS
+{
+template <typename T>
+struct CHash
+: public std::hash<T>
+{
+};
+
+template <typename T1, typename T2>
+struct CHash<std::pair<T1, T2>>
+{
+	template <typename T1_, typename T2_>
+	size_t operator()(const std::pair<T1_, T2_> &val) const
+	{
+		const size_t h = CHash<T1>()(val.first);
+		return h ^ (CHash<T2>()(val.second) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2));
+	}
+};
+
+template <typename T1, typename T2> inline
+bool IsEqualKey(const T1 &val1, const T2 &val2)
+{
+	return val1 == val2;
+}
+
+template <typename T1, typename T2, typename T1_, typename T2_> inline
+bool IsEqualKey(const std::pair<T1, T2> &val1, const std::pair<T1_, T2_> &val2)
+{
+	return val1.first == val2.first && val1.second == val2.second;
+}
+
+//Хэш-таблица с открытой адресацией для справочников, которые только растут (инвесторы, инструменты).
+//find() не блокирует: слоты - атомарные указатели на узлы, таблицы при росте не освобождаются до разрушения карты.
+//Вставки блокируют только свой сегмент. Адреса значений не меняются.
+template <typename _TKey, typename _TValue, typename THash = CHash<_TKey>, size_t Stripes = 64>
+class CConcurrentMap
+{
+public:
+	typedef _TKey TKey;
+	typedef _TValue TValue;
+	typedef std::pair<const TKey, TValue> value_type;
+
+	static_assert((Stripes & (Stripes - 1)) == 0, "Stripes must be power of 2");
+
+	CConcurrentMap(size_t capacity = 0)
+	{
+		for (auto &seg: m_segs)
+			seg.Grow(capacity / Stripes);
+	}
+
+	TS_COPYABLE(CConcurrentMap, delete);
+	TS_MOVABLE(CConcurrentMap, delete);
+
+	~CConcurrentMap()
+	{
+		for (auto &seg: m_segs)
+			seg.Clear();
+	}
+
+	template <typename TKey2>
+	TValue *find(const TKey2 &key) const
+	{
+		const size_t hash = THash()(key);
+		auto *node = GetSegment(hash).Find(hash, key);
+		return node? &node->m_item.second: nullptr;
+	}
+
+	template <typename TKey2, typename... TT>
+	std::pair<TValue *, bool> insert_or_get(TKey2 &&key, TT&&... args)
+	{
+		const size_t hash = THash()(key);
+		auto &seg = GetSegment(hash);
+		auto *node = seg.Find(hash, key);
+		if (node)
+			return {&node->m_item.second, false};
+
+		return seg.Insert(hash, std::forward<TKey2>(key), std::forward<TT>(args)...);
+	}
+
+	//Не блокирует; элементы, вставленные во время обхода, могут быть пропущены
+	template <typename TFunc, typename... TT>
+	void ForEachItem(TFunc &&func, TT&&... args) const
+	{
+		for (auto &seg: m_segs)
+		{
+			const auto *table = seg.m_table.load(std::memory_order_acquire);
+			for (size_t i = 0; i <= table->m_mask; ++i)
+			{
+				auto *node = table->m_slots[i].load(std::memory_order_acquire);
+				if (node)
+					func(node->m_item.first, node->m_item.second, args...);
+			}
+		}
+	}
+
+	size_t size() const
+	{
+		size_t res = 0;
+		for (auto &seg: m_segs)
+			res += seg.m_size.load(std::memory_order_relaxed);
+		return res;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+protected:
+	struct CNode
+	{
+		template <typename TKey2, typename... TT>
+		CNode(size_t hash, TKey2 &&key, TT&&... args)
+		: m_hash(hash)
+		, m_item(std::piecewise_construct, std::forward_as_tuple(std::forward<TKey2>(key)), std::forward_as_tuple(std::forward<TT>(args)...))
+		{
+		}
+
+		const size_t m_hash;
+		value_type m_item;
+	};
+
+	struct CTable
+	{
+		CTable(size_t sz)
+		: m_mask(sz - 1)
+		, m_slots(new std::atomic<CNode *>[sz])
+		{
+			for (size_t i = 0; i < sz; ++i)
+				m_slots[i].store(nullptr, std::memory_order_relaxed);
+		}
+
+		void Put(CNode *node)
+		{
+			size_t i = (node->m_hash / Stripes) & m_mask;
+			while (m_slots[i].load(std::memory_order_relaxed))
+				i = (i + 1) & m_mask;
+
+			m_slots[i].store(node, std::memory_order_release);
+		}
+
+		const size_t m_mask;
+		std::unique_ptr<std::atomic<CNode *>[]> m_slots;
+	};
+
+	struct alignas(64) CSegment
+	{
+		template <typename TKey2>
+		CNode *Find(size_t hash, const TKey2 &key) const
+		{
+			const auto *table = m_table.load(std::memory_order_acquire);
+			for (size_t i = (hash / Stripes) & table->m_mask;; i = (i + 1) & table->m_mask)
+			{
+				auto *node = table->m_slots[i].load(std::memory_order_acquire);
+				if (!node)
+					return nullptr;
+
+				if (node->m_hash == hash && IsEqualKey(node->m_item.first, key))
+					return node;
+			}
+		}
+
+		template <typename TKey2, typename... TT>
+		std::pair<TValue *, bool> Insert(size_t hash, TKey2 &&key, TT&&... args)
+		{
+			SYS_LOCK(m_mx);
+			auto *node = Find(hash, key);
+			if (node)
+				return {&node->m_item.second, false};
+
+			auto sp = std::make_unique<CNode>(hash, std::forward<TKey2>(key), std::forward<TT>(args)...);
+			const size_t n = m_size.load(std::memory_order_relaxed) + 1;
+			auto *table = m_table.load(std::memory_order_relaxed);
+			if (n * 2 > table->m_mask + 1)
+				table = Grow(n * 2);
+
+			node = sp.release();
+			table->Put(node);
+			m_size.store(n, std::memory_order_relaxed);
+			return {&node->m_item.second, true};
+		}
+
+		//Старая таблица остаётся в m_tables, т.к. её могут читать find() в других потоках
+		CTable *Grow(size_t sz)
+		{
+			size_t n = 8;
+			while (n < sz * 2)
+				n <<= 1;
+
+			auto *prev = m_table.load(std::memory_order_relaxed);
+			m_tables.emplace_back(std::make_unique<CTable>(n));
+			auto *table = m_tables.back().get();
+			if (prev)
+			{
+				for (size_t i = 0; i <= prev->m_mask; ++i)
+				{
+					auto *node = prev->m_slots[i].load(std::memory_order_relaxed);
+					if (node)
+						table->Put(node);
+				}
+			}
+
+			m_table.store(table, std::memory_order_release);
+			return table;
+		}
+
+		void Clear()
+		{
+			auto *table = m_table.load(std::memory_order_relaxed);
+			for (size_t i = 0; table && i <= table->m_mask; ++i)
+				delete table->m_slots[i].exchange(nullptr, std::memory_order_relaxed);
+
+			m_size = 0;
+		}
+
+		std::atomic<CTable *> m_table{nullptr};
+		std::atomic<size_t> m_size{0};
+
+		std::mutex m_mx;
+		std::vector<std::unique_ptr<CTable>> m_tables;
+	};
+
+	CSegment &GetSegment(size_t hash)
+	{
+		return m_segs[hash & (Stripes - 1)];
+	}
+
+	const CSegment &GetSegment(size_t hash) const
+	{
+		return m_segs[hash & (Stripes - 1)];
+	}
+
+	CSegment m_segs[Stripes];
+};
+
+}
@@ -1,10 +1,24 @@
 #pragma once
+#include <fstream>
+#include <stdexcept>
+#include <string>
 
 namespace TS
 {
 class CConfigFile
 {
 public:
+	CConfigFile() = default;
+
+	//Файл настроек; если он не читается - исключение, прежние настройки при перезагрузке остаются
+	explicit CConfigFile(const std::string &file)
+	{
+		std::ifstream in(file);
+		in.peek(); //Каталог открывается, но не читается
+		if (!in.is_open() || in.bad())
+			throw std::runtime_error("Can't read config file " + file);
+	}
+
 	template <typename T>
 	void ReadValue(const char *name, T &val, bool use_parent = false) const
 	{
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <nmmintrin.h>
+
+namespace TS
+{
+//CRC-32C (Castagnoli): командой crc32 (SSE4.2), если её поддерживает процессор, иначе по таблице
+class CCrc32c
+{
+public:
+	static uint32_t Calc(const void *data, size_t size, uint32_t crc = 0)
+	{
+		static const bool _hw = []()
+		{
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("sse4.2") != 0;
+		}();
+
+		return ~(_hw? CalcHW(data, size, ~crc): CalcSW(data, size, ~crc));
+	}
+
+protected:
+	static const uint32_t Poly = 0x82f63b78;
+
+	static uint32_t CalcSW(const void *data, size_t size, uint32_t crc)
+	{
+		static const auto &_table = GetTable();
+		const auto *p = static_cast<const uint8_t *>(data);
+		for (size_t i = 0; i < size; ++i)
+			crc = _table.m_items[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+
+	__attribute__((target("sse4.2")))
+	static uint32_t CalcHW(const void *data, size_t size, uint32_t crc)
+	{
+		const auto *p = static_cast<const uint8_t *>(data);
+		uint64_t crc64 = crc;
+		for (; size >= 8; size -= 8, p += 8)
+		{
+			uint64_t val;
+			std::memcpy(&val, p, sizeof(val));
+			crc64 = _mm_crc32_u64(crc64, val);
+		}
+
+		crc = uint32_t(crc64);
+		for (; size; --size, ++p)
+			crc = _mm_crc32_u8(crc, *p);
+		return crc;
+	}
+
+	struct CTable
+	{
+		uint32_t m_items[256];
+	};
+
+	static const CTable &GetTable()
+	{
+		static const CTable _table = []()
+		{
+			CTable res;
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t crc = i;
+				for (size_t j = 0; j < 8; ++j)
+					crc = (crc >> 1) ^ (crc & 1? Poly: 0);
+				res.m_items[i] = crc;
+			}
+			return res;
+		}();
+		return _table;
+	}
+};
+
+}
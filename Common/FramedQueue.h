@@ -3,19 +3,62 @@
 #include <deque>
 #include <algorithm>
 #include <map>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <stdexcept>
 
 namespace TS
 {
-template <typename _TValue, typename _TTimestamp = std::chrono::system_clock::time_point>
-class CFramedQueue
+//Политика агрегации окна: Put вызывается после добавления значения (items его уже содержит),
+//Erase - для каждого значения, выходящего из окна, от старых к новым. Вызовы встраиваются, виртуальных функций нет.
+struct CNoAggregate
+{
+	template <typename TItems, typename TTimestamp, typename TValue>
+	void Put(const TItems &items, const TTimestamp &tm, const TValue &val)
+	{
+	}
+
+	template <typename TTimestamp, typename TValue>
+	void Erase(const TTimestamp &tm, const TValue &val)
+	{
+	}
+};
+
+//Сумма окна; TSum - любой сумматор с += TValue и -= TValue (CRemoveFile удаляет файлы по -=)
+template <typename TSum>
+struct CSumAggregate
+{
+	template <typename TItems, typename TTimestamp, typename TValue>
+	void Put(const TItems &items, const TTimestamp &tm, const TValue &val)
+	{
+		m_sum += val;
+	}
+
+	template <typename TTimestamp, typename TValue>
+	void Erase(const TTimestamp &tm, const TValue &val)
+	{
+		m_sum -= val;
+	}
+
+	TSum m_sum{TSum()};
+};
+
+//Окно значений за frame с агрегацией TAggregate и блокировкой TMutex:
+//std::shared_mutex - общий доступ, Sys::CSpinSharedMutex - короткие секции, Sys::CNullMutex - доступ упорядочен владельцем.
+//GetAverage/GetSum и GetMin/GetMax доступны для соответствующих агрегаций.
+template <typename _TValue, typename _TAggregate = CNoAggregate, typename _TTimestamp = std::chrono::system_clock::time_point, typename _TMutex = std::shared_mutex>
+class CFramedWindow
 {
 public:
 	typedef _TValue TValue;
+	typedef _TAggregate TAggregate;
 	typedef _TTimestamp TTimestamp;
+	typedef _TMutex TMutex;
 	typedef decltype(TTimestamp() - TTimestamp()) TFrame;
 
 
-	CFramedQueue(const TFrame &frame, size_t rem = 1)
+	CFramedWindow(const TFrame &frame, size_t rem = 1)
 	: m_frame(frame)
 	, m_rem(rem)
 	{
@@ -24,7 +67,11 @@ public:
 	bool PutValue(const TTimestamp &tm, const TValue &val)
 	{
 		SYS_LOCK_GUARD(m_mx, lock);
-		return _PutValue(tm, val, lock);
+		if (!_PutValue(tm, val, lock))
+			return false;
+
+		m_agg.Put(m_items, tm, val);
+		return true;
 	}
 
 	template <typename TFunc, typename... TT>
@@ -54,27 +101,106 @@ public:
 		return m_items.size();
 	}
 
+	TValue GetAverage(const TTimestamp &tm)
+	{
+		SYS_SHARED_LOCK(m_mx, lock);
+		_EraseExpired(tm, lock);
+		return !m_items.empty()? m_agg.m_sum / m_items.size(): 0;
+	}
+
+	TValue GetAverage() const
+	{
+		SYS_LOCK_READ(m_mx);
+		return !m_items.empty()? m_agg.m_sum / m_items.size(): 0;
+	}
+
+	auto GetSum(const TTimestamp &tm)
+	{
+		SYS_SHARED_LOCK(m_mx, lock);
+		_EraseExpired(tm, lock);
+		return m_agg.m_sum;
+	}
+
+	TValue GetMin(const TTimestamp &tm)
+	{
+		SYS_SHARED_LOCK(m_mx, lock);
+		_EraseExpired(tm, lock);
+		return m_agg.GetMin();
+	}
+
+	TValue GetMax(const TTimestamp &tm)
+	{
+		SYS_SHARED_LOCK(m_mx, lock);
+		_EraseExpired(tm, lock);
+		return m_agg.GetMax();
+	}
+
+	TValue GetMin() const
+	{
+		SYS_LOCK_READ(m_mx);
+		return m_agg.GetMin();
+	}
+
+	TValue GetMax() const
+	{
+		SYS_LOCK_READ(m_mx);
+		return m_agg.GetMax();
+	}
+
 	const TFrame &GetFrame() const
 	{
 		return m_frame;
 	}
 
+	//До этого времени (включительно) запросы с истечением не удаляют значения
+	TTimestamp GetValidTo() const
+	{
+		SYS_LOCK_READ(m_mx);
+		return m_items.size() > m_rem? m_items.front().first + m_frame: TTimestamp::max();
+	}
+
 	void Clear()
 	{
 		SYS_LOCK_WRITE(m_mx);
 		while (!m_items.empty())
 		{
 			auto &item = m_items.front();
-			EraseItem(item.first, item.second);
+			m_agg.Erase(item.first, item.second);
 			m_items.pop_front();
 		}
 	}
 
-protected:
-	virtual void EraseItem(const TTimestamp &tm, const TValue &val)
+	//Сохранение значений окна (TValue копируется как есть) через TWriter::WriteList/Write;
+	//загрузка добавляет их через PutValue, агрегат пересчитывается
+	template <typename TWriter>
+	void Save(TWriter &out) const
 	{
+		SYS_LOCK_READ(m_mx);
+		out.WriteList([this, &out]()
+		{
+			for (auto &item: m_items)
+			{
+				out.Write(item.first);
+				out.Write(item.second);
+			}
+			return m_items.size();
+		});
+	}
+
+	template <typename TReader>
+	void Load(TReader &in)
+	{
+		in.ReadList([this, &in]()
+		{
+			TTimestamp tm;
+			TValue val;
+			in.Read(tm);
+			in.Read(val);
+			PutValue(tm, val);
+		});
 	}
 
+protected:
 	bool _PutValue(const TTimestamp &tm, const TValue &val, auto &&lock)
 	{
 		if (m_items.empty())
@@ -114,9 +240,10 @@ protected:
 		return false;
 	}
 
+	//Блокировка повышается, только если есть что удалять: после фоновой очистки чтение не пишет
 	bool _EraseExpired(const TTimestamp &tm, auto &&lock)
 	{
-		if (m_items.empty() || tm <= m_items.front().first)
+		if (m_items.size() <= m_rem || !(m_items.front().first + m_frame < tm))
 			return false;
 
 		lock.upgrade();
@@ -127,7 +254,7 @@ protected:
 			auto &item = m_items.front();
 			if (item.first + m_frame < tm)
 			{
-				EraseItem(item.first, item.second);
+				m_agg.Erase(item.first, item.second);
 				m_items.pop_front();
 				res = true;
 			}
@@ -137,130 +264,506 @@ protected:
 		return res;
 	}
 
-	mutable std::shared_mutex m_mx;
+	mutable TMutex m_mx;
 	const TFrame m_frame;
 	const size_t m_rem;
 
 	std::deque<std::pair<TTimestamp, TValue>> m_items;
+	TAggregate m_agg;
 };
 
-
-template<typename TValue, typename TSum = TValue, typename... TT>
-class CMovingSum
-: public CFramedQueue<TValue, TT...>
+template <typename TValue, typename TTimestamp = std::chrono::system_clock::time_point, typename TMutex = std::shared_mutex>
+using CFramedQueue = CFramedWindow<TValue, CNoAggregate, TTimestamp, TMutex>;
+
+template <typename TValue, typename TSum = TValue, typename TTimestamp = std::chrono::system_clock::time_point, typename TMutex = std::shared_mutex>
+using CMovingSum = CFramedWindow<TValue, CSumAggregate<TSum>, TTimestamp, TMutex>;
+
+//Скользящая сумма по корзинам ширины bucket: кольцо из frame / bucket + 2 предагрегированных корзин (сумма и количество),
+//память O(frame / bucket) независимо от потока значений, добавление и устаревание - O(1).
+//TSum должен поддерживать += TValue, -= TSum (как CPositionYield).
+//Погрешность на краю окна: корзина удаляется целиком, когда устарело её последнее возможное значение,
+//поэтому сумма охватывает все значения точного окна (tm - frame, tm] и, возможно, значения не старше frame + bucket.
+//Для средней отклонение от точной не больше доли значений одной корзины, умноженной на размах значений.
+//Самая новая корзина не удаляется (аналог rem = 1 у CFramedQueue).
+template <typename _TValue, typename _TSum = _TValue, typename _TTimestamp = std::chrono::system_clock::time_point, typename _TMutex = std::shared_mutex>
+class CBucketedSum
 {
 public:
-	typedef CFramedQueue<TValue, TT...> TBase;
-	using typename TBase::TTimestamp;
-	using TBase::CFramedQueue;
+	typedef _TValue TValue;
+	typedef _TSum TSum;
+	typedef _TTimestamp TTimestamp;
+	typedef _TMutex TMutex;
+	typedef decltype(TTimestamp() - TTimestamp()) TFrame;
+	typedef typename TFrame::rep TBucketNo;
 
+	CBucketedSum(const TFrame &frame, const TFrame &bucket)
+	: m_frame(frame)
+	, m_bucket(bucket)
+	, m_buckets(frame / bucket + 2)
+	{
+	}
 
 	bool PutValue(const TTimestamp &tm, const TValue &val)
 	{
-		SYS_LOCK_GUARD(m_mx, lock);
-		if (!TBase::_PutValue(tm, val, lock))
-			return false;
+		SYS_LOCK_WRITE(m_mx);
+		const auto n = GetBucketNo(tm);
+		const auto size = TBucketNo(m_buckets.size());
+		if (!m_cnt)
+			m_head = m_tail = n;
+		else if (m_head < n)
+		{
+			//Корзины, на место которых встанут новые, уже вне окна
+			const auto tail = n - size + 1;
+			while (m_tail < tail && m_tail <= m_head)
+				EraseBucket(m_tail++);
+
+			m_tail = std::max(m_tail, tail);
+			m_head = n;
+		}
+		else if (n < m_tail)
+		{
+			if (m_head - n >= size)
+				return false;
+
+			m_tail = n;
+		}
+
+		auto &bucket = GetBucket(n);
+		bucket.m_sum += val;
+		++bucket.m_cnt;
 
 		m_sum += val;
+		++m_cnt;
 		return true;
 	}
 
 	TValue GetAverage(const TTimestamp &tm)
 	{
 		SYS_SHARED_LOCK(m_mx, lock);
-		TBase::_EraseExpired(tm, lock);
-		return !m_items.empty()? m_sum / m_items.size(): 0;
+		_EraseExpired(tm, lock);
+		return m_cnt? m_sum / m_cnt: 0;
 	}
 
 	TValue GetAverage() const
 	{
 		SYS_LOCK_READ(m_mx);
-		return !m_items.empty()? m_sum / m_items.size(): 0;
+		return m_cnt? m_sum / m_cnt: 0;
 	}
 
 	TSum GetSum(const TTimestamp &tm)
 	{
 		SYS_SHARED_LOCK(m_mx, lock);
-		TBase::_EraseExpired(tm, lock);
+		_EraseExpired(tm, lock);
 		return m_sum;
 	}
+
+	size_t GetSize(const TTimestamp &tm)
+	{
+		SYS_SHARED_LOCK(m_mx, lock);
+		_EraseExpired(tm, lock);
+		return m_cnt;
+	}
+
+	bool EraseExpired(const TTimestamp &tm)
+	{
+		SYS_SHARED_LOCK(m_mx, lock);
+		return _EraseExpired(tm, lock);
+	}
+
+	const TFrame &GetFrame() const
+	{
+		return m_frame;
+	}
+
+	TTimestamp GetValidTo() const
+	{
+		SYS_LOCK_READ(m_mx);
+		return m_cnt && m_tail < m_head? TTimestamp((m_tail + 1) * m_bucket) + m_frame - TFrame(1): TTimestamp::max();
+	}
+
+	void Clear()
+	{
+		SYS_LOCK_WRITE(m_mx);
+		std::fill(m_buckets.begin(), m_buckets.end(), CBucket());
+		m_sum = TSum();
+		m_cnt = 0;
+	}
+
+	//Корзины сохраняются как есть, загружать можно только в окно с теми же frame и bucket
+	template <typename TWriter>
+	void Save(TWriter &out) const
+	{
+		SYS_LOCK_READ(m_mx);
+		out.Write(m_head);
+		out.Write(m_tail);
+		out.Write(m_sum);
+		out.Write(m_cnt);
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			for (auto i = m_tail; m_cnt && i <= m_head; ++i)
+			{
+				const auto &bucket = GetBucket(i);
+				if (!bucket.m_cnt)
+					continue;
+
+				out.Write(i);
+				out.Write(bucket.m_sum);
+				out.Write(bucket.m_cnt);
+				++n;
+			}
+			return n;
+		});
+	}
+
+	template <typename TReader>
+	void Load(TReader &in)
+	{
+		SYS_LOCK_WRITE(m_mx);
+		std::fill(m_buckets.begin(), m_buckets.end(), CBucket());
+		in.Read(m_head);
+		in.Read(m_tail);
+		in.Read(m_sum);
+		in.Read(m_cnt);
+		in.ReadList([this, &in]()
+		{
+			TBucketNo n;
+			in.Read(n);
+			auto &bucket = GetBucket(n);
+			in.Read(bucket.m_sum);
+			in.Read(bucket.m_cnt);
+		});
+	}
+
 protected:
-	using TBase::m_items;
-	using TBase::m_mx;
+	struct CBucket
+	{
+		TSum m_sum{TSum()};
+		size_t m_cnt = 0;
+	};
 
-	virtual void EraseItem(const TTimestamp &tm, const TValue &val) override
+	TBucketNo GetBucketNo(const TTimestamp &tm) const
 	{
-		m_sum -= val;
+		return tm.time_since_epoch() / m_bucket;
+	}
+
+	CBucket &GetBucket(TBucketNo n)
+	{
+		const auto size = TBucketNo(m_buckets.size());
+		return m_buckets[(n % size + size) % size];
+	}
+
+	const CBucket &GetBucket(TBucketNo n) const
+	{
+		const auto size = TBucketNo(m_buckets.size());
+		return m_buckets[(n % size + size) % size];
+	}
+
+	//Все значения корзины n старше frame относительно tm
+	bool IsExpired(TBucketNo n, const TTimestamp &tm) const
+	{
+		return TTimestamp((n + 1) * m_bucket) + m_frame <= tm;
+	}
+
+	void EraseBucket(TBucketNo n)
+	{
+		auto &bucket = GetBucket(n);
+		m_sum -= bucket.m_sum;
+		m_cnt -= bucket.m_cnt;
+		bucket = CBucket();
 	}
 
+	bool _EraseExpired(const TTimestamp &tm, auto &&lock)
+	{
+		if (!m_cnt || m_head <= m_tail || !IsExpired(m_tail, tm))
+			return false;
+
+		lock.upgrade();
+
+		bool res = false;
+		while (m_tail < m_head && IsExpired(m_tail, tm))
+		{
+			EraseBucket(m_tail++);
+			res = true;
+		}
+		return res;
+	}
+
+	mutable TMutex m_mx;
+	const TFrame m_frame;
+	const TFrame m_bucket;
+
+	std::vector<CBucket> m_buckets;
+	TBucketNo m_head = 0; //Номер самой новой корзины
+	TBucketNo m_tail = 0; //Номер самой старой не удалённой корзины
+
 	TSum m_sum{TSum()};
+	size_t m_cnt = 0;
 };
 
-template<typename TValue, typename... TT>
-class CMovingMinMax
-: public CFramedQueue<TValue, TT...>
+//Точная (bucket == 0) или агрегированная по корзинам скользящая сумма; выбирается настройками правила
+template <typename TValue, typename TSum = TValue, typename TTimestamp = std::chrono::system_clock::time_point, typename TMutex = std::shared_mutex>
+class CMovingSumEx
 {
-protected:
-
 public:
-	typedef CFramedQueue<TValue, TT...> TBase;
-	using typename TBase::TTimestamp;
-	using TBase::CFramedQueue;
+	typedef CMovingSum<TValue, TSum, TTimestamp, TMutex> TExact;
+	typedef CBucketedSum<TValue, TSum, TTimestamp, TMutex> TBucketed;
+	typedef typename TExact::TFrame TFrame;
+
+	template <typename TFrame_, typename TBucket = TFrame>
+	CMovingSumEx(const TFrame_ &frame, const TBucket &bucket = TBucket())
+	{
+		if (bucket.count() > 0)
+			m_bucketed = std::make_unique<TBucketed>(frame, bucket);
+		else
+			m_exact = std::make_unique<TExact>(frame);
+	}
 
 	bool PutValue(const TTimestamp &tm, const TValue &val)
 	{
-		SYS_LOCK_GUARD(m_mx, lock);
-		if (!TBase::_PutValue(tm, val, lock))
-			return false;
+		return m_bucketed? m_bucketed->PutValue(tm, val): m_exact->PutValue(tm, val);
+	}
 
-		auto it = m_items2.find(val);
-		if (it == m_items2.end())
-			m_items2.emplace(val, 1);
+	TValue GetAverage(const TTimestamp &tm)
+	{
+		return m_bucketed? m_bucketed->GetAverage(tm): m_exact->GetAverage(tm);
+	}
+
+	TValue GetAverage() const
+	{
+		return m_bucketed? m_bucketed->GetAverage(): m_exact->GetAverage();
+	}
+
+	TSum GetSum(const TTimestamp &tm)
+	{
+		return m_bucketed? m_bucketed->GetSum(tm): m_exact->GetSum(tm);
+	}
+
+	bool EraseExpired(const TTimestamp &tm)
+	{
+		return m_bucketed? m_bucketed->EraseExpired(tm): m_exact->EraseExpired(tm);
+	}
+
+	const TFrame &GetFrame() const
+	{
+		return m_bucketed? m_bucketed->GetFrame(): m_exact->GetFrame();
+	}
+
+	TTimestamp GetValidTo() const
+	{
+		return m_bucketed? m_bucketed->GetValidTo(): m_exact->GetValidTo();
+	}
+
+	void Clear()
+	{
+		if (m_bucketed)
+			m_bucketed->Clear();
 		else
-			++it->second;
+			m_exact->Clear();
+	}
 
-		return true;
+	template <typename TWriter>
+	void Save(TWriter &out) const
+	{
+		out.Write(bool(m_bucketed));
+		if (m_bucketed)
+			m_bucketed->Save(out);
+		else
+			m_exact->Save(out);
 	}
 
-	TValue GetMin(const TTimestamp &tm)
+	template <typename TReader>
+	void Load(TReader &in)
 	{
-		SYS_SHARED_LOCK(m_mx, lock);
-		TBase::_EraseExpired(tm, lock);
-		return m_items2.empty()? TValue(): m_items2.begin()->first;
+		bool bucketed;
+		in.Read(bucketed);
+		if (bucketed != bool(m_bucketed))
+			throw std::runtime_error("CMovingSumEx::Load: window type mismatch");
+
+		if (m_bucketed)
+			m_bucketed->Load(in);
+		else
+			m_exact->Load(in);
 	}
 
-	TValue GetMax(const TTimestamp &tm)
+protected:
+	std::unique_ptr<TExact> m_exact;
+	std::unique_ptr<TBucketed> m_bucketed;
+};
+
+//Дек на кольцевом буфере: непрерывная память, без выделения на каждый элемент, ёмкость только растёт
+template <typename T>
+class CRingDeque
+{
+public:
+	bool empty() const
 	{
-		SYS_SHARED_LOCK(m_mx, lock);
-		TBase::_EraseExpired(tm, lock);
-		return m_items2.empty()? TValue(): m_items2.rbegin()->first;
+		return m_size == 0;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	T &front()
+	{
+		return m_items[m_head];
+	}
+
+	T &back()
+	{
+		return m_items[(m_head + m_size - 1) & (m_items.size() - 1)];
+	}
+
+	const T &front() const
+	{
+		return m_items[m_head];
+	}
+
+	void push_back(const T &val)
+	{
+		if (m_size == m_items.size())
+			Grow();
+
+		m_items[(m_head + m_size) & (m_items.size() - 1)] = val;
+		++m_size;
+	}
+
+	void pop_back()
+	{
+		--m_size;
+	}
+
+	void pop_front()
+	{
+		m_head = (m_head + 1) & (m_items.size() - 1);
+		--m_size;
+	}
+
+	void clear()
+	{
+		m_head = 0;
+		m_size = 0;
+	}
+
+protected:
+	void Grow()
+	{
+		std::vector<T> items(std::max<size_t>(16, m_items.size() * 2));
+		for (size_t i = 0; i < m_size; ++i)
+			items[i] = m_items[(m_head + i) & (m_items.size() - 1)];
+
+		m_items.swap(items);
+		m_head = 0;
+	}
+
+	std::vector<T> m_items;
+	size_t m_head = 0;
+	size_t m_size = 0;
+};
+
+//Минимум и максимум по окну на монотонных деках: амортизированно O(1) на добавление и удаление.
+//В деке максимумов значения не возрастают, минимумов - не убывают; равные значения сохраняются,
+//поэтому при выходе значения из окна удаляется голова дека, совпавшая по (время, значение).
+//Вставка не в конец окна (допускается CFramedWindow::_PutValue) снимает с деков только элементы позже вставленного;
+//вставка в начало окна перед значениями с тем же временем перестраивает деки за O(n).
+template <typename TValue, typename TTimestamp>
+struct CMinMaxAggregate
+{
+	typedef std::pair<TTimestamp, TValue> TItem;
+
+	template <typename TItems>
+	void Put(const TItems &items, const TTimestamp &tm, const TValue &val)
+	{
+		//Значение встало в начало окна перед значением с тем же временем
+		const bool rebuild = items.size() > 1 && tm < items.back().first &&
+			!(items[0].first < tm) && !(tm < items[0].first) &&
+			!(items[1].first < tm) && !(tm < items[1].first);
+
+		if (rebuild)
+			Rebuild(items);
+		else
+			Insert(tm, val);
+	}
+
+	void Erase(const TTimestamp &tm, const TValue &val)
+	{
+		PopFront(m_max, tm, val);
+		PopFront(m_min, tm, val);
 	}
 
 	TValue GetMin() const
 	{
-		SYS_LOCK_READ(m_mx);
-		return m_items2.empty()? TValue(): m_items2.begin()->first;
+		return m_min.empty()? TValue(): m_min.front().second;
 	}
 
 	TValue GetMax() const
 	{
-		SYS_LOCK_READ(m_mx);
-		return m_items2.empty()? TValue(): m_items2.rbegin()->first;
+		return m_max.empty()? TValue(): m_max.front().second;
 	}
 
 protected:
-	using TBase::m_items;
-	using TBase::m_mx;
+	void Insert(const TTimestamp &tm, const TValue &val)
+	{
+		Insert(m_max, tm, val, [](const TValue &val1, const TValue &val2)
+		{
+			return val1 < val2;
+		});
 
-	virtual void EraseItem(const TTimestamp &tm, const TValue &val) override
+		Insert(m_min, tm, val, [](const TValue &val1, const TValue &val2)
+		{
+			return val2 < val1;
+		});
+	}
+
+	//less(val1, val2) - val1 вытесняется из дека значением val2
+	template <typename TLess>
+	void Insert(CRingDeque<TItem> &items, const TTimestamp &tm, const TValue &val, TLess &&less)
 	{
-		auto it = m_items2.find(val);
-		if (it != m_items2.end() && --it->second == 0)
-			m_items2.erase(it);
+		while (!items.empty() && tm < items.back().first)
+		{
+			m_tail.emplace_back(items.back());
+			items.pop_back();
+		}
+
+		if (m_tail.empty() || !less(val, m_tail.back().second))
+		{
+			while (!items.empty() && less(items.back().second, val))
+				items.pop_back();
+
+			items.push_back(TItem(tm, val));
+		}
+
+		for (; !m_tail.empty(); m_tail.pop_back())
+			items.push_back(m_tail.back());
+	}
+
+	template <typename TItems>
+	void Rebuild(const TItems &items)
+	{
+		m_max.clear();
+		m_min.clear();
+		for (auto &item: items)
+			Insert(item.first, item.second);
+	}
+
+	static void PopFront(CRingDeque<TItem> &items, const TTimestamp &tm, const TValue &val)
+	{
+		if (items.empty())
+			return;
+
+		auto &item = items.front();
+		if (!(item.first < tm) && !(tm < item.first) && !(item.second < val) && !(val < item.second))
+			items.pop_front();
 	}
 
-	std::map<TValue, size_t> m_items2;
+	CRingDeque<TItem> m_max;
+	CRingDeque<TItem> m_min;
+	std::vector<TItem> m_tail;
 };
 
+template <typename TValue, typename TTimestamp = std::chrono::system_clock::time_point, typename TMutex = std::shared_mutex>
+using CMovingMinMax = CFramedWindow<TValue, CMinMaxAggregate<TValue, TTimestamp>, TTimestamp, TMutex>;
 
 }
@@ -0,0 +1,223 @@
+#pragma once
+#include "Common.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+//0 - замеры задержек не компилируются, TS_LATENCY_SCOPE ничего не делает
+#ifndef TS_LATENCY_STATS
+#define TS_LATENCY_STATS 1
+#endif
+
+#define TS_LATENCY_SCOPE(stats) TS::CLatencyStats::CScope CONCAT(latency_, __COUNTER__)(stats);
+
+namespace TS
+{
+//Лог-линейная гистограмма (как HDR): на каждую степень двойки 2^SubBits интервалов, относительная погрешность < 1/2^SubBits
+struct CHistogramData
+{
+	static const size_t SubBits = 5;
+	static const size_t SubCount = size_t(1) << SubBits;
+	static const size_t MaxBits = 42; //~73 минуты в наносекундах
+	static const size_t Size = (MaxBits - SubBits + 1) * SubCount;
+
+	static size_t GetIndex(uint64_t val)
+	{
+		if (val < SubCount)
+			return size_t(val);
+
+		const size_t msb = 63 - __builtin_clzll(val);
+		if (msb >= MaxBits)
+			return Size - 1;
+
+		const size_t shift = msb - SubBits;
+		return ((shift + 1) << SubBits) + size_t(val >> shift) - SubCount;
+	}
+
+	//Верхняя граница интервала
+	static uint64_t GetValue(size_t idx)
+	{
+		if (idx < SubCount)
+			return idx;
+
+		const size_t shift = (idx >> SubBits) - 1;
+		return ((uint64_t(idx & (SubCount - 1)) + SubCount + 1) << shift) - 1;
+	}
+
+	CHistogramData &operator +=(const CHistogramData &src)
+	{
+		for (size_t i = 0; i < Size; ++i)
+			m_counts[i] += src.m_counts[i];
+
+		m_cnt += src.m_cnt;
+		m_sum += src.m_sum;
+		m_max = std::max(m_max, src.m_max);
+		return *this;
+	}
+
+	uint64_t GetPercentile(double pct) const
+	{
+		if (!m_cnt)
+			return 0;
+
+		const uint64_t n = std::max<uint64_t>(1, uint64_t(m_cnt * pct / 100.0 + 0.5));
+		uint64_t cnt = 0;
+		for (size_t i = 0; i < Size; ++i)
+		{
+			cnt += m_counts[i];
+			if (cnt >= n)
+				return std::min(GetValue(i), m_max);
+		}
+		return m_max;
+	}
+
+	uint64_t m_counts[Size] = {0};
+	uint64_t m_cnt = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_max = 0;
+};
+
+//Гистограмма одного потока: пишет только владелец, поэтому без RMW-операций, читать можно из любого потока
+class CHistogram
+{
+public:
+	void Put(uint64_t val)
+	{
+		Inc(m_counts[CHistogramData::GetIndex(val)], 1);
+		Inc(m_cnt, 1);
+		Inc(m_sum, val);
+		if (val > m_max.load(std::memory_order_relaxed))
+			m_max.store(val, std::memory_order_relaxed);
+	}
+
+	void MergeTo(CHistogramData &dst) const
+	{
+		for (size_t i = 0; i < CHistogramData::Size; ++i)
+			dst.m_counts[i] += m_counts[i].load(std::memory_order_relaxed);
+
+		dst.m_cnt += m_cnt.load(std::memory_order_relaxed);
+		dst.m_sum += m_sum.load(std::memory_order_relaxed);
+		dst.m_max = std::max(dst.m_max, m_max.load(std::memory_order_relaxed));
+	}
+
+protected:
+	static void Inc(std::atomic<uint64_t> &val, uint64_t n)
+	{
+		val.store(val.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> m_counts[CHistogramData::Size] = {};
+	std::atomic<uint64_t> m_cnt{0};
+	std::atomic<uint64_t> m_sum{0};
+	std::atomic<uint64_t> m_max{0};
+};
+
+//Замеры задержек этапа обработки: по гистограмме на поток, объединяются при запросе.
+//Номер потока берётся по модулю MaxThreads; при совпадении номеров двух живых потоков возможна потеря единичных отсчётов.
+class CLatencyStats
+{
+public:
+	static const size_t MaxThreads = 256;
+	//Допустимые затраты на один замер, нс: два чтения steady_clock (~20 нс с vDSO/TSC, до 50 нс в виртуалке) и запись в гистограмму
+	static constexpr size_t OverheadBudget = 150;
+	typedef std::chrono::steady_clock TClock;
+
+	class CScope
+	{
+	public:
+#if TS_LATENCY_STATS
+		CScope(CLatencyStats &stats)
+		: m_stats(stats)
+		, m_tm(TClock::now())
+		{
+		}
+
+		~CScope()
+		{
+			m_stats.Put(TClock::now() - m_tm);
+		}
+
+	protected:
+		CLatencyStats &m_stats;
+		const TClock::time_point m_tm;
+#else
+		CScope(CLatencyStats &)
+		{
+		}
+#endif
+	};
+
+	CLatencyStats()
+	{
+		for (auto &item: m_shards)
+			item.store(nullptr, std::memory_order_relaxed);
+	}
+
+	TS_COPYABLE(CLatencyStats, delete);
+	TS_MOVABLE(CLatencyStats, delete);
+
+	~CLatencyStats()
+	{
+		for (auto &item: m_shards)
+			delete item.load(std::memory_order_relaxed);
+	}
+
+	template <typename Rep, typename Period>
+	void Put(std::chrono::duration<Rep, Period> dt)
+	{
+		GetShard().Put(std::chrono::duration_cast<std::chrono::nanoseconds>(dt).count());
+	}
+
+	CHistogramData GetData() const
+	{
+		CHistogramData res;
+		for (auto &item: m_shards)
+		{
+			auto *p = item.load(std::memory_order_acquire);
+			if (p)
+				p->MergeTo(res);
+		}
+		return res;
+	}
+
+	//Затраты на один замер, нс
+	static double MeasureOverhead(size_t n = 100000)
+	{
+		CLatencyStats stats;
+		const auto tm = TClock::now();
+		for (size_t i = 0; i < n; ++i)
+		{
+			TS_LATENCY_SCOPE(stats);
+		}
+
+		return std::chrono::duration<double, std::nano>(TClock::now() - tm).count() / n;
+	}
+
+protected:
+	static size_t GetThreadIndex()
+	{
+		static std::atomic<size_t> _cnt{0};
+		static thread_local const size_t _idx = _cnt++ % MaxThreads;
+		return _idx;
+	}
+
+	CHistogram &GetShard()
+	{
+		auto &item = m_shards[GetThreadIndex()];
+		auto *p = item.load(std::memory_order_acquire);
+		if (p)
+			return *p;
+
+		auto sp = std::make_unique<CHistogram>();
+		if (item.compare_exchange_strong(p, sp.get(), std::memory_order_acq_rel))
+			return *sp.release();
+
+		return *p;
+	}
+
+	std::atomic<CHistogram *> m_shards[MaxThreads];
+};
+
+}
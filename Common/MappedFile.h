@@ -0,0 +1,162 @@
+#pragma once
+#include "Common.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace TS
+{
+//Файл, отображённый в память только для чтения; пустой или не открытый файл - data() == nullptr, size() == 0
+class CMappedFile
+{
+public:
+	explicit CMappedFile(const std::string &name)
+	{
+		const int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				m_data = static_cast<const char *>(data);
+				m_size = st.st_size;
+				::madvise(data, m_size, MADV_WILLNEED);
+			}
+		}
+		::close(fd);
+	}
+
+	~CMappedFile()
+	{
+		if (m_data)
+			::munmap(const_cast<char *>(m_data), m_size);
+	}
+
+	TS_COPYABLE(CMappedFile, delete);
+	TS_MOVABLE(CMappedFile, delete);
+
+	const char *data() const
+	{
+		return m_data;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+protected:
+	const char *m_data = nullptr;
+	size_t m_size = 0;
+};
+
+//Файл, дописываемый через отображение в память с позиции pos. Место выделяется fallocate шагами по step байт,
+//поэтому запись не меняет размер файла и не обновляет его метаданные; хвост за позицией записи - нули.
+//Close() обрезает файл до записанного.
+class CMappedWriter
+{
+public:
+	CMappedWriter(const std::string &name, size_t pos, size_t step)
+	: m_fd(::open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666))
+	, m_pos(pos)
+	, m_step(std::max<size_t>(step, ::sysconf(_SC_PAGESIZE)))
+	{
+		if (m_fd >= 0 && (::ftruncate(m_fd, m_pos) != 0 || !Reserve(m_pos + 1)))
+		{
+			::close(m_fd);
+			m_fd = -1;
+		}
+	}
+
+	~CMappedWriter()
+	{
+		Close();
+	}
+
+	TS_COPYABLE(CMappedWriter, delete);
+	TS_MOVABLE(CMappedWriter, delete);
+
+	//false - файл не открыт или место не выделено, см. errno
+	bool IsOpen() const
+	{
+		return m_data != nullptr;
+	}
+
+	int fd() const
+	{
+		return m_fd;
+	}
+
+	//Записано байт
+	size_t size() const
+	{
+		return m_pos;
+	}
+
+	//false - не удалось выделить или отобразить место, см. errno
+	bool Write(const char *data, size_t size)
+	{
+		if (!IsOpen() || !Reserve(m_pos + size))
+			return false;
+
+		std::memcpy(m_data + m_pos, data, size);
+		m_pos += size;
+		return true;
+	}
+
+	//false - ошибка, см. errno
+	bool Close()
+	{
+		if (m_data)
+			::munmap(m_data, m_capacity);
+		m_data = nullptr;
+
+		bool res = true;
+		if (m_fd >= 0)
+		{
+			res = ::ftruncate(m_fd, m_pos) == 0;
+			::close(m_fd);
+		}
+		m_fd = -1;
+		return res;
+	}
+
+protected:
+	bool Reserve(size_t size)
+	{
+		if (size <= m_capacity)
+			return true;
+
+		const size_t capacity = (size + m_step - 1) / m_step * m_step;
+		if (::fallocate(m_fd, 0, 0, capacity) != 0 && (errno != EOPNOTSUPP || ::ftruncate(m_fd, capacity) != 0))
+			return false;
+
+		void *data = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+
+		if (m_data)
+			::munmap(m_data, m_capacity);
+		m_data = static_cast<char *>(data);
+		m_capacity = capacity;
+		return true;
+	}
+
+	int m_fd;
+	size_t m_pos;
+	const size_t m_step;
+	char *m_data = nullptr;
+	size_t m_capacity = 0;
+};
+
+}
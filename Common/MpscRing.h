@@ -0,0 +1,142 @@
+#pragma once
+#include "Errors.h"
+
+#include <atomic>
+#include <memory>
+
+namespace TS
+{
+//Ограниченное кольцо многих производителей и одного потребителя.
+//Производитель занимает ячейку CAS-ом хвоста и заполняет её на месте, номер m_seq ячейки публикует запись;
+//потребитель забирает готовые записи подряд и возвращает ячейки производителям следующего круга.
+//Park/NeedWake - засыпание потребителя без потери пробуждения: производитель будит его, только если тот ждёт.
+template <typename T>
+class CMpscRing
+{
+public:
+	explicit CMpscRing(size_t size)
+	: m_mask(GetSize(size) - 1)
+	, m_slots(new CSlot[m_mask + 1])
+	{
+		for (size_t i = 0; i <= m_mask; ++i)
+			m_slots[i].m_seq.store(i, std::memory_order_relaxed);
+	}
+
+	TS_COPYABLE(CMpscRing, delete);
+	TS_MOVABLE(CMpscRing, delete);
+
+	//fill(T &) заполняет занятую ячейку. Возвращает номер записи с 1 - после Drain этой записи потребителем
+	//число забранных записей станет не меньше номера; 0 - кольцо полно, fill не вызывался
+	template <typename TFunc>
+	size_t TryPush(TFunc &&fill)
+	{
+		auto pos = m_tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			auto &slot = m_slots[pos & m_mask];
+			const auto seq = slot.m_seq.load(std::memory_order_acquire);
+			if (seq == pos)
+			{
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					fill(slot.m_val);
+					slot.m_seq.store(pos + 1, std::memory_order_release);
+					return pos + 1;
+				}
+			}
+			else if (seq < pos)
+				return 0;
+			else
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	//Только потребитель: func(const T &) для готовых записей по порядку, не больше max
+	template <typename TFunc>
+	size_t Drain(TFunc &&func, size_t max = size_t(-1))
+	{
+		size_t n = 0;
+		for (; n < max; ++n, ++m_head)
+		{
+			auto &slot = m_slots[m_head & m_mask];
+			if (slot.m_seq.load(std::memory_order_acquire) != m_head + 1)
+				break;
+
+			TS_NOEXCEPT(func(static_cast<const T &>(slot.m_val)));
+			slot.m_seq.store(m_head + m_mask + 1, std::memory_order_release);
+		}
+		return n;
+	}
+
+	//Только потребитель
+	bool empty() const
+	{
+		return m_slots[m_head & m_mask].m_seq.load(std::memory_order_acquire) != m_head + 1;
+	}
+
+	//Только потребитель: число забранных записей
+	size_t GetHead() const
+	{
+		return m_head;
+	}
+
+	//Число занятых производителями ячеек за всё время; записи до него могут быть ещё не заполнены
+	size_t GetTail() const
+	{
+		return m_tail.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	//Потребитель перед ожиданием: true - кольцо пусто и производитель разбудит (NeedWake), false - есть записи
+	bool Park()
+	{
+		m_parked.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!empty())
+		{
+			m_parked.store(false, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	void Unpark()
+	{
+		m_parked.store(false, std::memory_order_relaxed);
+	}
+
+	//Производитель после TryPush: true - потребитель ждёт и его нужно разбудить (true получает один из производителей)
+	bool NeedWake()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return m_parked.load(std::memory_order_relaxed) && m_parked.exchange(false, std::memory_order_relaxed);
+	}
+
+protected:
+	static size_t GetSize(size_t size)
+	{
+		size_t res = 2;
+		while (res < size)
+			res <<= 1;
+		return res;
+	}
+
+	struct alignas(64) CSlot
+	{
+		std::atomic<size_t> m_seq;
+		T m_val;
+	};
+
+	const size_t m_mask;
+	const std::unique_ptr<CSlot[]> m_slots;
+
+	alignas(64) std::atomic<size_t> m_tail{0};
+	alignas(64) size_t m_head = 0;
+	std::atomic<bool> m_parked{false};
+};
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "SyncObjs.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace TS
+{
+//Значение, которое читается без блокировок и заменяется целиком (read-copy-update).
+//Прежние версии не освобождаются до разрушения объекта: читатель может держать ссылку сколько угодно,
+//а замены редки (перезагрузка настроек), поэтому память на старые версии не в счёт.
+template <typename T>
+class CRcuValue
+{
+public:
+	template <typename... TT>
+	explicit CRcuValue(TT&&... args)
+	{
+		Publish(std::make_unique<const T>(std::forward<TT>(args)...));
+	}
+
+	TS_COPYABLE(CRcuValue, delete);
+	TS_MOVABLE(CRcuValue, delete);
+
+	const T &operator *() const
+	{
+		return *m_val.load(std::memory_order_acquire);
+	}
+
+	const T *operator ->() const
+	{
+		return get();
+	}
+
+	const T *get() const
+	{
+		return m_val.load(std::memory_order_acquire);
+	}
+
+	const T &Publish(T &&val)
+	{
+		return Publish(std::make_unique<const T>(std::move(val)));
+	}
+
+	const T &Publish(std::unique_ptr<const T> &&sp)
+	{
+		SYS_LOCK(m_versions);
+		m_versions.emplace_back(std::move(sp));
+
+		const auto *p = m_versions.back().get();
+		m_val.store(p, std::memory_order_release);
+		return *p;
+	}
+
+protected:
+	std::atomic<const T *> m_val{nullptr};
+	Sys::CLockedObject<std::vector<std::unique_ptr<const T>>, std::mutex> m_versions;
+};
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+namespace TS
+{
+//Небольшое тривиально копируемое значение под seqlock: чтение без блокировок и без записи в общую память.
+//Запись не блокирует читателей, но сами писатели должны быть упорядочены снаружи.
+template <typename T>
+class CSeqLock
+{
+public:
+	static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+	CSeqLock(const T &val = T())
+	{
+		Store(val);
+	}
+
+	void Store(const T &val)
+	{
+		uint64_t words[Words] = {0};
+		std::memcpy(words, &val, sizeof(T));
+
+		//Нечётный счётчик остаётся от писателя, прерванного посреди записи (значение в разделяемой памяти): продолжаем с чётного
+		const auto seq = (m_seq.load(std::memory_order_relaxed) + 1) & ~uint64_t(1);
+		m_seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (size_t i = 0; i < Words; ++i)
+			m_words[i].store(words[i], std::memory_order_relaxed);
+
+		m_seq.store(seq + 2, std::memory_order_release);
+	}
+
+	//Одна попытка; false, если значение в этот момент записывается
+	bool TryLoad(T &dst) const
+	{
+		const auto seq = m_seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			return false;
+
+		uint64_t words[Words];
+		for (size_t i = 0; i < Words; ++i)
+			words[i] = m_words[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_seq.load(std::memory_order_relaxed) != seq)
+			return false;
+
+		std::memcpy(&dst, words, sizeof(T));
+		return true;
+	}
+
+	T Load() const
+	{
+		T res;
+		while (!TryLoad(res))
+			;
+		return res;
+	}
+
+protected:
+	static const size_t Words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+	std::atomic<uint64_t> m_seq{0};
+	std::atomic<uint64_t> m_words[Words];
+};
+
+}
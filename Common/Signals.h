@@ -49,4 +49,13 @@ void WaitStop()
 	signals.Wait();
 }
 
+//SIGHUP вызывает reload, ожидание остановки продолжается
+template <typename TFunc>
+void WaitStop(TFunc &&reload)
+{
+	CWaitSignals signals(SIGINT, SIGTERM, SIGHUP, SIGTSTP);
+	while (signals.Wait() == SIGHUP)
+		reload();
+}
+
 extern void CatchSegmentationsFault();
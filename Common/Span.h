@@ -0,0 +1,86 @@
+#pragma once
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace TS
+{
+//Подмножество std::span из C++20
+template <typename T>
+class span
+{
+public:
+	typedef T element_type;
+	typedef std::remove_cv_t<T> value_type;
+	typedef T *iterator;
+	typedef T &reference;
+
+	constexpr span() noexcept
+	{
+	}
+
+	constexpr span(T *data, size_t sz) noexcept
+	: m_data(data)
+	, m_sz(sz)
+	{
+	}
+
+	template <size_t sz>
+	constexpr span(T (&data)[sz]) noexcept
+	: span(data, sz)
+	{
+	}
+
+	template <typename TCont> requires std::is_convertible<decltype(std::declval<TCont &>().data()), T *>::value
+	constexpr span(TCont &cont) noexcept
+	: span(cont.data(), cont.size())
+	{
+	}
+
+	template <typename T_> requires std::is_convertible<T_ *, T *>::value
+	constexpr span(const span<T_> &src) noexcept
+	: span(src.data(), src.size())
+	{
+	}
+
+	constexpr T *data() const noexcept
+	{
+		return m_data;
+	}
+
+	constexpr size_t size() const noexcept
+	{
+		return m_sz;
+	}
+
+	constexpr bool empty() const noexcept
+	{
+		return m_sz == 0;
+	}
+
+	constexpr T &operator [](size_t i) const noexcept
+	{
+		return m_data[i];
+	}
+
+	constexpr iterator begin() const noexcept
+	{
+		return m_data;
+	}
+
+	constexpr iterator end() const noexcept
+	{
+		return m_data + m_sz;
+	}
+
+	constexpr span subspan(size_t offset, size_t sz) const noexcept
+	{
+		return span(m_data + offset, sz);
+	}
+
+protected:
+	T *m_data = nullptr;
+	size_t m_sz = 0;
+};
+
+}
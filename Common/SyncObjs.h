@@ -266,6 +266,32 @@ protected:
 	mutable volatile std::atomic<TLockCounter> m_cnt{0};
 };
 
+//Пустая блокировка для объектов, доступ к которым уже упорядочен владельцем
+class CNullMutex
+{
+public:
+	void lock() const noexcept
+	{
+	}
+
+	void unlock() const noexcept
+	{
+	}
+
+	void lock_shared() const noexcept
+	{
+	}
+
+	void unlock_shared() const noexcept
+	{
+	}
+
+	bool upgrade_lock() const noexcept
+	{
+		return true;
+	}
+};
+
 
 class CBarrierLock
 {
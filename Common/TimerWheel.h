@@ -0,0 +1,305 @@
+#pragma once
+#include "SyncObjs.h"
+#include "Errors.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+
+namespace TS
+{
+//Иерархическое колесо таймеров: Levels уровней по Slots ячеек, ячейка уровня l покрывает Slots^l тактов.
+//Постановка и снятие таймера - O(1), продвижение - O(1) на такт, пустые участки пропускаются целиком.
+//Время внешнее (время данных, а не часы): его сдвигает Advance, обработчики получают это время.
+//Таймер срабатывает, когда время ушло за такт его срока, т.е. не раньше срока и не позже чем на такт после.
+//Advance вызывается из одного потока; обработчик выполняется вне блокировки колеса.
+template <typename _TTimestamp = std::chrono::system_clock::time_point>
+class CTimerWheel
+{
+public:
+	typedef _TTimestamp TTimestamp;
+	typedef typename TTimestamp::duration TDuration;
+	typedef typename TDuration::rep TTicks;
+	//Возвращает следующий срок или TTimestamp::max(), если таймер больше не нужен
+	typedef std::function<TTimestamp (const TTimestamp &now)> THandler;
+
+	static const size_t SlotBits = 6;
+	static const size_t Slots = size_t(1) << SlotBits;
+	static const size_t Levels = 4;
+
+	class CTimer;
+
+	CTimerWheel(TDuration tick)
+	: m_tick(std::max<TTicks>(1, tick.count()))
+	{
+	}
+
+	TS_COPYABLE(CTimerWheel, delete);
+	TS_MOVABLE(CTimerWheel, delete);
+
+	//Срабатывают таймеры со сроком раньше такта now; возвращает число вызванных обработчиков
+	size_t Advance(const TTimestamp &now)
+	{
+		const auto target = GetTick(now.time_since_epoch().count());
+		SYS_UNIQUE_LOCK(m_mx, lock);
+		size_t res = 0;
+		while (m_cur < target)
+		{
+			if (!m_size)
+			{
+				m_cur = target;
+				Cascade(Levels);
+				break;
+			}
+
+			size_t level = 0;
+			while (!m_counts[level])
+				++level;
+
+			if (level)
+			{
+				//Нижние уровни пусты: переход сразу к границе ячейки уровня level
+				const uint64_t mask = (uint64_t(1) << (SlotBits * level)) - 1;
+				m_cur = std::min(target, (m_cur | mask) + 1);
+			}
+			else
+			{
+				auto &slot = m_slots[0][m_cur & (Slots - 1)];
+				++m_cur;
+				res += Fire(slot, now, lock);
+			}
+
+			size_t n = 0;
+			while (n < Levels && !(m_cur & ((uint64_t(1) << (SlotBits * (n + 1))) - 1)))
+				++n;
+			Cascade(n);
+		}
+		return res;
+	}
+
+	size_t GetSize() const
+	{
+		SYS_LOCK(m_mx);
+		return m_size + m_overflow_size;
+	}
+
+protected:
+	struct CLink
+	{
+		CLink()
+		{
+			m_prev = m_next = this;
+		}
+
+		bool empty() const
+		{
+			return m_next == this;
+		}
+
+		void PushBack(CLink &link)
+		{
+			link.m_prev = m_prev;
+			link.m_next = this;
+			m_prev->m_next = &link;
+			m_prev = &link;
+		}
+
+		void Unlink()
+		{
+			m_prev->m_next = m_next;
+			m_next->m_prev = m_prev;
+			m_prev = m_next = this;
+		}
+
+		CLink *m_prev;
+		CLink *m_next;
+	};
+
+	static const size_t NoLevel = size_t(-1);
+	static const size_t FireLevel = Levels + 1;
+
+	uint64_t GetTick(TTicks ticks) const
+	{
+		return ticks > 0? uint64_t(ticks / m_tick): 0;
+	}
+
+	void Link(CTimer &timer, TTicks deadline)
+	{
+		if (!(deadline < timer.m_deadline.load(std::memory_order_relaxed)))
+			return;
+
+		Unlink(timer);
+		timer.m_deadline.store(deadline, std::memory_order_relaxed);
+		_Link(timer);
+	}
+
+	void _Link(CTimer &timer)
+	{
+		const auto tick = std::max(m_cur, GetTick(timer.m_deadline.load(std::memory_order_relaxed)));
+		const auto diff = tick ^ m_cur;
+
+		size_t level = 0;
+		while (level < Levels && (diff >> (SlotBits * (level + 1))))
+			++level;
+
+		timer.m_level = level;
+		if (level == Levels)
+		{
+			m_overflow.PushBack(timer);
+			++m_overflow_size;
+			return;
+		}
+
+		m_slots[level][(tick >> (SlotBits * level)) & (Slots - 1)].PushBack(timer);
+		++m_counts[level];
+		++m_size;
+	}
+
+	//Снятие с колеса без изменения срока
+	void Detach(CTimer &timer)
+	{
+		if (timer.m_level == NoLevel)
+			return;
+
+		if (timer.m_level < Levels)
+		{
+			--m_counts[timer.m_level];
+			--m_size;
+		}
+		else if (timer.m_level == Levels)
+			--m_overflow_size;
+
+		timer.CLink::Unlink();
+		timer.m_level = NoLevel;
+	}
+
+	void Unlink(CTimer &timer)
+	{
+		Detach(timer);
+		timer.m_deadline.store(TTimestamp::max().time_since_epoch().count(), std::memory_order_relaxed);
+	}
+
+	//Перенос в нижние уровни ячеек уровней 1..n, в которые вошло текущее время (n == Levels - ещё и переполнения)
+	void Cascade(size_t n)
+	{
+		for (size_t level = n; level > 0; --level)
+		{
+			auto &src = level == Levels? m_overflow: m_slots[level][(m_cur >> (SlotBits * level)) & (Slots - 1)];
+			CLink tmp;
+			while (!src.empty())
+			{
+				auto &timer = static_cast<CTimer &>(*src.m_next);
+				Detach(timer);
+				tmp.PushBack(timer);
+			}
+
+			while (!tmp.empty())
+			{
+				auto &timer = static_cast<CTimer &>(*tmp.m_next);
+				timer.CLink::Unlink();
+				_Link(timer);
+			}
+		}
+	}
+
+	//Таймеры ячейки переносятся в m_fire и вызываются по одному; разрушение таймера ждёт конца его вызова
+	size_t Fire(CLink &slot, const TTimestamp &now, auto &lock)
+	{
+		size_t res = 0;
+		while (!slot.empty())
+		{
+			auto &timer = static_cast<CTimer &>(*slot.m_next);
+			Detach(timer);
+			timer.m_level = FireLevel;
+			m_fire.PushBack(timer);
+		}
+
+		while (!m_fire.empty())
+		{
+			auto &timer = static_cast<CTimer &>(*m_fire.m_next);
+			Unlink(timer);
+			m_running = &timer;
+
+			lock.unlock();
+			TTimestamp next = TTimestamp::max();
+			TS_NOEXCEPT(next = timer.m_handler(now));
+			lock.lock();
+
+			m_running = nullptr;
+			m_cv.notify_all();
+			++res;
+
+			if (next != TTimestamp::max())
+				Link(timer, next.time_since_epoch().count());
+		}
+		return res;
+	}
+
+	void Cancel(CTimer &timer)
+	{
+		SYS_UNIQUE_LOCK(m_mx, lock);
+		while (m_running == &timer)
+			m_cv.wait(lock);
+
+		Unlink(timer);
+	}
+
+	mutable std::mutex m_mx;
+	std::condition_variable m_cv;
+	const TTicks m_tick;
+	uint64_t m_cur = 0; //Следующий необработанный такт
+
+	CLink m_slots[Levels][Slots];
+	size_t m_counts[Levels] = {0};
+	size_t m_size = 0;
+
+	CLink m_overflow; //Сроки дальше Slots^Levels тактов
+	size_t m_overflow_size = 0;
+
+	CLink m_fire;
+	const CTimer *m_running = nullptr;
+};
+
+//Таймер принадлежит владельцу состояния и снимается с колеса в деструкторе.
+//Schedule оставляет более ранний из сроков; повторная постановка с тем же или более поздним сроком не блокирует.
+//Обработчик не должен разрушать свой таймер.
+template <typename TTimestamp>
+class CTimerWheel<TTimestamp>::CTimer
+: protected CTimerWheel<TTimestamp>::CLink
+{
+friend class CTimerWheel<TTimestamp>;
+public:
+	template <typename TFunc>
+	CTimer(CTimerWheel &wheel, TFunc &&handler)
+	: m_wheel(wheel)
+	, m_handler(std::forward<TFunc>(handler))
+	{
+	}
+
+	TS_COPYABLE(CTimer, delete);
+	TS_MOVABLE(CTimer, delete);
+
+	~CTimer()
+	{
+		m_wheel.Cancel(*this);
+	}
+
+	void Schedule(const TTimestamp &tm)
+	{
+		const auto deadline = tm.time_since_epoch().count();
+		if (!(deadline < m_deadline.load(std::memory_order_relaxed)))
+			return;
+
+		SYS_LOCK(m_wheel.m_mx);
+		m_wheel.Link(*this, deadline);
+	}
+
+protected:
+	CTimerWheel &m_wheel;
+	const THandler m_handler;
+	std::atomic<TTicks> m_deadline{TTimestamp::max().time_since_epoch().count()};
+	size_t m_level = NoLevel;
+};
+
+}
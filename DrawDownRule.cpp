@@ -1,10 +1,17 @@
 #include "Common.h"
 #include "RiskManager.h"
+#include "Snapshot.h"
 
 #include "Common/FramedQueue.h"
+#include "Common/ConcurrentMap.h"
 
-#include <unordered_map>
 #include <map>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RM_REVALUE_AVX2
+#include <immintrin.h>
+#endif
 
 using namespace RM;
 namespace
@@ -15,15 +22,17 @@ namespace
 //Apply : by Investor
 //Check : if drawdown ( = max 24hour cumulative P&L – current 24hour cumulative P&L) > EUR100*
 //Action if true : order is rejected, alarm is sent
+//bucket: 0 - хранить все сделки окна, иначе агрегировать по корзинам этой ширины (CBucketedSum)
+//pnl_sample: интервал между точками истории P&L, 0 - точка на каждое изменение
 #define TS_CFG TS_CFG_(DrawDownRule)
 #define TS_CONFIG_ITEMS \
 	TS_ITEM(pnl_time, std::chrono::seconds, 24h) \
  	TS_ITEM(drawdown, TPrice, 100) \
+	TS_ITEM(bucket, std::chrono::milliseconds, 0ms) \
+	TS_ITEM(pnl_sample, std::chrono::milliseconds, 0ms) \
 
 #include "Common/Config.inl"
 
-class CDrawDown;
-
 //Сделки по позиции для расчёта доходности
 struct CTrade
 {
@@ -59,6 +68,14 @@ struct CPositionYield
 		return *this;
 	}
 
+	//Вызывается при выходе корзины сделок из диапазона по времени
+	CPositionYield &operator -=(const CPositionYield &src)
+	{
+		m_sum -= src.m_sum;
+		m_qty -= src.m_qty;
+		return *this;
+	}
+
 	TPrice GetYield(const TPrice &price) const
 	{
 		return price * m_qty - m_sum;
@@ -68,21 +85,143 @@ struct CPositionYield
 	TQty m_qty = 0; //Количество по всем сделкам
 };
 
-struct CPosition
+//Переоценка позиций по новой цене: delta = qty * (price - prev), yield += delta, prev = price
+typedef void (*TRevalue)(size_t n, const TQty *qty, TPrice *prev, TPrice *yield, TPrice *delta, TPrice price);
+
+void RevalueScalar(size_t n, const TQty *qty, TPrice *prev, TPrice *yield, TPrice *delta, TPrice price)
 {
-	template <typename Rep, typename Period>
-	CPosition(const TPriceTime &price, std::chrono::duration<Rep, Period> dt)
-	: m_price(price)
-	, m_trades(dt)
+	for (size_t i = 0; i < n; ++i)
+	{
+		delta[i] = qty[i] * (price - prev[i]);
+		yield[i] += delta[i];
+		prev[i] = price;
+	}
+}
+
+#ifdef RM_REVALUE_AVX2
+//Без FMA, чтобы результат совпадал со скалярной версией
+__attribute__((target("avx2")))
+void RevalueAvx2(size_t n, const TQty *qty, TPrice *prev, TPrice *yield, TPrice *delta, TPrice price)
+{
+	const auto p = _mm256_set1_pd(price);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		const auto d = _mm256_mul_pd(_mm256_loadu_pd(qty + i), _mm256_sub_pd(p, _mm256_loadu_pd(prev + i)));
+		_mm256_storeu_pd(delta + i, d);
+		_mm256_storeu_pd(yield + i, _mm256_add_pd(_mm256_loadu_pd(yield + i), d));
+		_mm256_storeu_pd(prev + i, p);
+	}
+
+	RevalueScalar(n - i, qty + i, prev + i, yield + i, delta + i, price);
+}
+#endif
+
+//Не x86 - только скалярная версия
+TRevalue GetRevalue()
+{
+	static const TRevalue _fn = []()
 	{
+#ifdef RM_REVALUE_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			Log.Info("DrawDown revaluation", "avx2");
+			return &RevalueAvx2;
+		}
+#endif
+		Log.Info("DrawDown revaluation", "scalar");
+		return &RevalueScalar;
+	}();
+
+	return _fn;
+}
+
+struct CInvestor;
+
+//Позиции всех инвесторов по инструменту в виде структуры массивов: котировка переоценивает их одним проходом.
+//Порядок блокировок: инвестор, затем книга; при котировке книга отпускается до обращения к инвесторам.
+struct CSymbolBook
+{
+	struct SDelta
+	{
+		CInvestor *m_investor;
+		TPrice m_delta;
+		bool m_expired;
+	};
+
+	size_t AddSlot(CInvestor *investor, const TPriceTime &price)
+	{
+		SYS_LOCK(m_mx);
+		if (m_time < price.second)
+			m_time = price.second;
+
+		m_qty.emplace_back(0);
+		m_price.emplace_back(price.first);
+		m_yield.emplace_back(0);
+		m_valid_to.emplace_back(TDateTime::max());
+		m_investors.emplace_back(investor);
+		return m_investors.size() - 1;
 	}
 
-	void PutQuote(const SQuote &quote)
+	//deltas - только держатели, у которых изменилась доходность или из окна сделок пора удалять устаревшие
+	void PutQuote(const SQuote &quote, std::vector<SDelta> &deltas)
 	{
-		if (quote.m_time < m_price.second)
+		deltas.clear();
+		SYS_LOCK(m_mx);
+		if (quote.m_time < m_time)
 			return;
 
-		m_price = TPriceTime(quote.m_price, quote.m_time);
+		const size_t n = m_investors.size();
+		m_delta.assign(n, 0);
+		m_time = quote.m_time;
+		GetRevalue()(n, m_qty.data(), m_price.data(), m_yield.data(), m_delta.data(), quote.m_price);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			const bool expired = m_valid_to[i] < m_time;
+			if (m_delta[i] != 0 || expired)
+				deltas.emplace_back(SDelta{m_investors[i], m_delta[i], expired});
+		}
+	}
+
+	//Слоты сохраняет и загружает позиция (CPosition), книга - только время последней котировки
+	void Save(Snapshot::CWriter &out)
+	{
+		SYS_LOCK(m_mx);
+		out.Write(m_time);
+	}
+
+	void Load(Snapshot::CReader &in)
+	{
+		const auto tm = in.Read<TDateTime>();
+		SYS_LOCK(m_mx);
+		if (m_time < tm)
+			m_time = tm;
+	}
+
+	std::mutex m_mx;
+	TDateTime m_time; //Время последней котировки
+
+	std::vector<TQty> m_qty; //Количество по сделкам окна на момент последнего пересчёта
+	std::vector<TPrice> m_price;
+	std::vector<TPrice> m_yield;
+	std::vector<TDateTime> m_valid_to;
+	std::vector<CInvestor *> m_investors;
+
+	std::vector<TPrice> m_delta;
+};
+
+//Окно сделок позиции; цена, количество и доходность - в слоте книги инструмента
+struct CPosition
+{
+	template <typename Rep, typename Period>
+	CPosition(CSymbolBook &book, size_t slot, std::chrono::duration<Rep, Period> dt, std::chrono::milliseconds bucket)
+	: m_book(book)
+	, m_slot(slot)
+	, m_trades(dt, bucket)
+	{
 	}
 
 	void PutTrade(const STrade &trade)
@@ -90,76 +229,203 @@ struct CPosition
 		m_trades.PutValue(trade.m_time, trade);
 	}
 
-	void UpdateYield()
+	//Пересчёт по окну сделок с удалением устаревших, возвращает изменение доходности.
+	//Окно пересчитывается вне блокировки книги; переоценки, прошедшие за это время, учитываются в разнице.
+	TPrice UpdateYield()
+	{
+		TDateTime tm;
+		{
+			SYS_LOCK(m_book.m_mx);
+			tm = m_book.m_time;
+		}
+
+		const auto sum = m_trades.GetSum(tm);
+		const auto valid_to = m_trades.GetValidTo();
+
+		SYS_LOCK(m_book.m_mx);
+		m_book.m_qty[m_slot] = sum.m_qty;
+		m_book.m_valid_to[m_slot] = valid_to;
+
+		auto &yield = m_book.m_yield[m_slot];
+		const auto prev = yield;
+		yield = sum.GetYield(m_book.m_price[m_slot]);
+		return yield - prev;
+	}
+
+	//Из окна сделок пора удалять устаревшие
+	bool IsExpired() const
 	{
-		m_yield = m_trades.GetSum(m_price.second).GetYield(m_price.first);
+		SYS_LOCK(m_book.m_mx);
+		return m_book.m_valid_to[m_slot] < m_book.m_time;
 	}
 
+	bool HasPrice() const
+	{
+		SYS_LOCK(m_book.m_mx);
+		return m_book.m_price[m_slot] != 0;
+	}
+
+	void Save(Snapshot::CWriter &out)
+	{
+		m_trades.Save(out);
 
-	TPriceTime m_price; //Current instrument price
-	TPrice m_yield = 0;
-	TS::CMovingSum<CTrade, CPositionYield> m_trades;
+		SYS_LOCK(m_book.m_mx);
+		out.Write(m_book.m_qty[m_slot]);
+		out.Write(m_book.m_price[m_slot]);
+		out.Write(m_book.m_yield[m_slot]);
+		out.Write(m_book.m_valid_to[m_slot]);
+	}
+
+	void Load(Snapshot::CReader &in)
+	{
+		m_trades.Load(in);
+
+		SYS_LOCK(m_book.m_mx);
+		in.Read(m_book.m_qty[m_slot]);
+		in.Read(m_book.m_price[m_slot]);
+		in.Read(m_book.m_yield[m_slot]);
+		in.Read(m_book.m_valid_to[m_slot]);
+	}
+
+	CSymbolBook &m_book;
+	const size_t m_slot;
+	TS::CMovingSumEx<CTrade, CPositionYield, TDateTime, Sys::CNullMutex> m_trades; //Под блокировкой инвестора
 };
 
 struct CInvestor
 {
-	template <typename Rep, typename Period>
-	CInvestor(CDrawDown &rule, std::chrono::duration<Rep, Period> dt)
-	: m_rule(rule)
-	, m_pnl_max(dt)
+	template <typename Rep, typename Period, typename Rep2, typename Period2>
+	CInvestor(std::chrono::duration<Rep, Period> dt, std::chrono::duration<Rep2, Period2> sample)
+	: m_pnl_max(dt)
+	, m_sample(sample)
 	{
 	}
 
-	void PutQuote(const SQuote &quote)
+	void PutQuote(const TDateTime &tm, const CSymbolBook::SDelta &delta)
 	{
 		SYS_LOCK(m_mx);
-		auto it = m_positions.find(quote.m_symbol);
-		if (it == m_positions.end())
-			return;
+		if (m_time < tm)
+			m_time = tm;
 
-		auto &pos = *it->second;
-		if (m_time < quote.m_time)
-			m_time = quote.m_time;
+		m_pnl += delta.m_delta;
+		if (delta.m_expired)
+			Refresh();
 
-		pos.PutQuote(quote);
-		UpdatePnL(pos);
+		UpdatePnL();
 	}
 
-	void PutTrade(const STrade &trade)
+	template <typename TFunc>
+	void PutTrade(const STrade &trade, CSymbolBook &book, std::chrono::milliseconds bucket, TFunc &&get_price)
 	{
 		SYS_LOCK(m_mx);
-        auto &pos = GetPosition(trade.m_symbol);
-        if (pos.m_price.first == 0)
+		auto *pos = m_positions.find(trade.m_symbol);
+		if (!pos)
+			pos = m_positions.insert_or_get(trade.m_symbol, book, book.AddSlot(this, get_price()), m_pnl_max.GetFrame(), bucket).first;
+
+		if (!pos->HasPrice())
 			return;
 
-		pos.PutTrade(trade);
-		UpdatePnL(pos);
+		pos->PutTrade(trade);
+		m_pnl += pos->UpdateYield();
+		UpdatePnL();
+	}
+
+	TPrice GetDrawDown() const
+	{
+		return m_drawdown;
 	}
 
-	void UpdatePnL(CPosition &pos)
+	//Под m_mx: пересчёт позиций, из окон которых пора удалять сделки. Выполняется котировкой, обнаружившей устаревание,
+	//а не фоновой очисткой: иначе точки истории P&L зависели бы от того, успела ли очистка до следующей котировки.
+	void Refresh()
 	{
-		//Обновляем значение суммарного P&L при изменении позиции
-		const auto yield = pos.m_yield;
-		pos.UpdateYield();
-		m_pnl += pos.m_yield - yield;
+		m_positions.ForEachItem([this](const TSymbol &, CPosition &pos)
+		{
+			if (pos.IsExpired())
+				m_pnl += pos.UpdateYield();
+		});
+	}
 
+	//История P&L пополняется не чаще раза в m_sample, в точку пишется максимум за интервал,
+	//поэтому точка может остаться в окне дольше на величину интервала
+	void UpdatePnL()
+	{
 		const auto pnl_max = m_pnl_max.GetMax(m_time);
+		m_drawdown = std::max(pnl_max, m_pnl_peak) - m_pnl;
 
-		m_drawdown = pnl_max - m_pnl;
-		m_pnl_max.PutValue(m_time, m_pnl);
+		m_pnl_peak = m_sampled? std::max(m_pnl_peak, m_pnl): m_pnl;
+		m_sampled = true;
+		if (m_time < m_sample_time + m_sample)
+			return;
+
+		m_pnl_max.PutValue(m_time, m_pnl_peak);
+		m_pnl_peak = std::numeric_limits<TPrice>::lowest();
+		m_sampled = false;
+		m_sample_time = m_time;
+	}
+
+	void Save(Snapshot::CWriter &out)
+	{
+		SYS_LOCK(m_mx);
+		out.Write(m_pnl);
+		m_pnl_max.Save(out);
+		out.Write(m_sample_time);
+		out.Write(m_pnl_peak);
+		out.Write(m_sampled);
+		out.Write(m_drawdown.load());
+		out.Write(m_time);
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			m_positions.ForEachItem([&out, &n](const TSymbol &symbol, CPosition &pos)
+			{
+				out.Write(symbol);
+				pos.Save(out);
+				++n;
+			});
+			return n;
+		});
 	}
 
-	CPosition &GetPosition(auto &id);
+	//Позиции, окна которых устарели за время простоя, пересчитываются сразу: книги загружены раньше
+	template <typename TGetBook>
+	void Load(Snapshot::CReader &in, std::chrono::milliseconds bucket, TGetBook &&get_book)
+	{
+		SYS_LOCK(m_mx);
+		in.Read(m_pnl);
+		m_pnl_max.Load(in);
+		in.Read(m_sample_time);
+		in.Read(m_pnl_peak);
+		in.Read(m_sampled);
+		m_drawdown = in.Read<TPrice>();
+		in.Read(m_time);
+		in.ReadList([&]()
+		{
+			TSymbol symbol;
+			in.Read(symbol);
+
+			auto &book = get_book(symbol);
+			auto *pos = m_positions.insert_or_get(symbol, book, book.AddSlot(this, TPriceTime(0, TDateTime())), m_pnl_max.GetFrame(), bucket).first;
+			pos->Load(in);
+		});
+
+		Refresh();
+		m_drawdown = std::max(m_pnl_max.GetMax(m_time), m_pnl_peak) - m_pnl;
+	}
 
-	CDrawDown &m_rule;
 	std::mutex m_mx;
 	TPrice m_pnl = 0; //Cumulative P&L
-	TS::CMovingMinMax<TPrice> m_pnl_max;
+	TS::CMovingMinMax<TPrice, TDateTime, Sys::CNullMutex> m_pnl_max;
+
+	const std::chrono::milliseconds m_sample;
+	TDateTime m_sample_time;
+	TPrice m_pnl_peak = std::numeric_limits<TPrice>::lowest(); //Максимум P&L с последней точки истории
+	bool m_sampled = false;
 
 	std::atomic<TPrice> m_drawdown{0};
 
 	TDateTime m_time;
-	std::unordered_map<TSymbol, std::unique_ptr<CPosition>> m_positions;
+	TS::CConcurrentMap<TSymbol, CPosition> m_positions;
 };
 
 
@@ -167,103 +433,153 @@ class CDrawDown
 : public COrderCheckRule
 {
 public:
-	DrawDownRule::CConfig m_cfg;
+	TS::CRcuValue<DrawDownRule::CConfig> m_cfg;
 
 	CDrawDown(CRiskManager &rm, const TS::CConfigFile &cfg)
 	: COrderCheckRule(rm, cfg)
-	, m_cfg(cfg)
+	, m_cfg(LoadConfig(cfg))
 	{
 		RegisterCallback<SQuote>(&CDrawDown::ProcessQuote, this);
 		RegisterCallback<STrade>(&CDrawDown::ProcessTrade, this);
 		RegisterCallback<SOrder>(&CDrawDown::CheckOrder, this);
 	}
 
+	virtual void Reload(const TS::CConfigFile &cfg) override
+	{
+		COrderCheckRule::Reload(cfg);
+		m_cfg.Publish(LoadConfig(cfg));
+	}
+
+	static DrawDownRule::CConfig LoadConfig(const TS::CConfigFile &src)
+	{
+		DrawDownRule::CConfig cfg(src);
+		cfg.bucket = CheckBucket("DrawDown", cfg.pnl_time, cfg.bucket);
+		return cfg;
+	}
+
 	void ProcessQuote(const SQuote &quote)
 	{
-		if (!UpdateLastPrice(quote))
+		//Котировка уже учтена в рыночных данных; более ранняя, чем последняя по инструменту, пропускается
+		if (quote.m_time < m_rm.GetMarketData().GetLastPrice(quote.m_symbol).second)
 			return;
 
+		auto *book = m_books.find(quote.m_symbol);
+		if (!book)
+			return;
 
-		SYS_LOCK_READ(m_investors);
-		auto it = m_positions.lower_bound(std::pair<const TSymbol &, const TUserID &>(quote.m_symbol, TUserID()));
-		for (auto end = m_positions.end(); it != end && it->first.first == quote.m_symbol; ++it)
-			it->second->PutQuote(quote);
+		static thread_local std::vector<CSymbolBook::SDelta> _deltas;
+		book->PutQuote(quote, _deltas);
+		for (auto &delta: _deltas)
+			delta.m_investor->PutQuote(quote.m_time, delta);
 	}
 
 	void ProcessTrade(const STrade &trade)
 	{
-		GetInvestor(trade.m_user_id, trade.m_symbol).PutTrade(trade);
+		auto &investor = GetInvestor(trade.m_user_id);
+		auto &book = *m_books.insert_or_get(trade.m_symbol).first;
+		investor.PutTrade(trade, book, m_cfg->bucket, [this, &trade]()
+		{
+			return GetLastPrice(trade.m_symbol);
+		});
 	}
 
 	void CheckOrder(const SOrder &order)
 	{
-		SYS_LOCK_READ(m_investors);
-		auto it = m_investors.find(order.m_user_id);
-		if (it == m_investors.end())
+		auto *inv = m_investors.find(order.m_user_id);
+		if (!inv)
 			return;
 
-		const auto &inv = *it->second;
-		if (inv.m_drawdown > m_cfg.drawdown)
-			RejectOrder(order, "TrailingDrowdown", inv.m_drawdown);
+		const auto drawdown = inv->GetDrawDown();
+		if (drawdown > m_cfg->drawdown)
+			RejectOrder(order, "TrailingDrowdown", drawdown);
 	}
 
-	TPriceTime GetLastPrice(auto &symbol) const
+	virtual std::string GetStateKey() const override
 	{
-		SYS_LOCK(m_prices);
-		auto it = m_prices.find(symbol);
-		return it == m_prices.end()? TPriceTime(0, TDateTime()): it->second;
+		const auto &cfg = *m_cfg;
+		return TS::FormatStr("1", cfg.pnl_time.count(), cfg.bucket.count(), cfg.pnl_sample.count());
 	}
-protected:
-	bool UpdateLastPrice(const SQuote &quote)
-	{
-		SYS_LOCK(m_prices);
-		auto it = m_prices.find(quote.m_symbol);
-		if (it == m_prices.end())
-		{
-			m_prices.emplace(quote.m_symbol, TPriceTime(quote.m_price, quote.m_time));
-			return true;
-		}
 
-		if (quote.m_time < it->second.second)
-			return false;
+	//Максимум P&L берётся по точкам за pnl_time, а P&L каждой точки - по сделкам за pnl_time до неё.
+	//Цены для новых позиций дают рыночные данные, их при загрузке обновляют все прочитанные котировки.
+	virtual TDateTime::duration GetQuoteHorizon() const override
+	{
+		const auto &cfg = *m_cfg;
+		return cfg.pnl_time + cfg.pnl_sample;
+	}
 
-		it->second = TPriceTime(quote.m_price, quote.m_time);
-		return true;
+	virtual TDateTime::duration GetTradeHorizon() const override
+	{
+		const auto &cfg = *m_cfg;
+		return 2 * cfg.pnl_time + cfg.bucket + cfg.pnl_sample;
 	}
 
-	CInvestor &GetInvestor(const TUserID &id, const TSymbol &symbol)
+	//Книги - раньше инвесторов: позиции при загрузке занимают в них слоты
+	virtual void SaveState(Snapshot::CWriter &out) override
 	{
-		auto res = Sys::Locked::Emplace(id, m_investors, [this]()
+		out.WriteList([this, &out]()
 		{
-			auto sp = std::make_shared<CInvestor>(*this, m_cfg.pnl_time);
-			return sp;
+			size_t n = 0;
+			m_books.ForEachItem([&out, &n](const TSymbol &symbol, CSymbolBook &book)
+			{
+				out.Write(symbol);
+				book.Save(out);
+				++n;
+			});
+			return n;
 		});
 
-		auto *p = res.first->second.get();
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			m_investors.ForEachItem([&out, &n](const TUserID &id, CInvestor &investor)
+			{
+				out.Write(id);
+				investor.Save(out);
+				++n;
+			});
+			return n;
+		});
+	}
 
-		const std::pair<const TSymbol &, const TUserID &> pos_id(symbol, id);
-		Sys::Locked::Emplace(pos_id, m_positions, m_investors.mutex(), [p]()
+	virtual void LoadState(Snapshot::CReader &in) override
+	{
+		in.ReadList([this, &in]()
 		{
-			return p;
+			TSymbol symbol;
+			in.Read(symbol);
+			m_books.insert_or_get(symbol).first->Load(in);
 		});
 
-		return *p;
+		in.ReadList([this, &in]()
+		{
+			TUserID id;
+			in.Read(id);
+			GetInvestor(id).Load(in, m_cfg->bucket, [this](const TSymbol &symbol) -> CSymbolBook &
+			{
+				return *m_books.insert_or_get(symbol).first;
+			});
+		});
 	}
 
-	Sys::CLockedObject<std::unordered_map<TUserID, std::shared_ptr<CInvestor>>, std::shared_mutex> m_investors;
-	std::map<std::pair<TSymbol, TUserID>, CInvestor *> m_positions;
-	mutable Sys::CLockedObject<std::unordered_map<TSymbol, TPriceTime>> m_prices;
-};
+	TPriceTime GetLastPrice(auto &symbol) const
+	{
+		return m_rm.GetMarketData().GetLastPrice(symbol);
+	}
+protected:
+	CInvestor &GetInvestor(const TUserID &id)
+	{
+		auto *p = m_investors.find(id);
+		if (p)
+			return *p;
 
-CPosition &CInvestor::GetPosition(auto &id)
-{
-	auto it = m_positions.find(id);
-	if (it != m_positions.end())
-		return *it->second;
+		const auto &cfg = *m_cfg;
+		return *m_investors.insert_or_get(id, cfg.pnl_time, cfg.pnl_sample).first;
+	}
 
-	auto sp = std::make_unique<CPosition>(m_rule.GetLastPrice(id), m_pnl_max.GetFrame());
-	return *m_positions.emplace(id, std::move(sp)).first->second;
-}
+	TS::CConcurrentMap<TUserID, CInvestor> m_investors;
+	TS::CConcurrentMap<TSymbol, CSymbolBook> m_books;
+};
 
 }
 
@@ -0,0 +1,776 @@
+#pragma once
+#include "RiskManager.h"
+#include "Common/Crc32.h"
+
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace RM
+{
+//Двоичный журнал котировок и сделок.
+//Запись: SRecordHeader (длина тела и его CRC-32C), тело - байт типа TRecord и поля фиксированной раскладки,
+//строковый идентификатор сделки - в конце тела (длина uint16 и байты).
+//Инструменты и инвесторы пишутся номерами словаря: словарная запись идёт перед первой ссылкой на номер.
+//Запись Segment открывает сегмент и сбрасывает словари, поэтому в конец существующего файла можно дописывать новый сегмент.
+//Файл выделяется заранее и до закрытия дополнен нулями: нулевая длина записи - конец данных.
+//Журнал аудита (заявки и решения по ним, записи Decision) - отдельные файлы того же формата.
+//Время - int64 наносекунд от эпохи.
+namespace Journal
+{
+static const uint32_t Magic = 0x4a4d5231; //RMJ1
+static const uint16_t Version = 1;
+
+enum class TRecord : uint8_t
+{
+	Segment = 1,
+	Symbol = 2,
+	User = 3,
+	Quote = 4,
+	Trade = 5,
+	Snapshot = 6,
+	Decision = 7,
+};
+
+//Метка снимка состояния: объекты до неё учтены в снимке с тем же id, после - нет
+struct SSnapshotMark
+{
+	uint64_t m_id;
+};
+
+//Заявка и решение по ней из журнала аудита; текст отказа не хранится, m_reject - код причины
+struct SAudit
+{
+	SOrder m_order;
+	SVerdict m_verdict;
+};
+
+struct SRecordHeader
+{
+	uint32_t m_size;
+	uint32_t m_crc;
+};
+
+static const size_t MaxRecordSize = 64 * 1024;
+
+inline
+int64_t ToNanoseconds(const TDateTime &tm)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(tm.time_since_epoch()).count();
+}
+
+inline
+TDateTime FromNanoseconds(int64_t ns)
+{
+	return TDateTime(std::chrono::duration_cast<TDateTime::duration>(std::chrono::nanoseconds(ns)));
+}
+
+//Запись фиксированного размера для очереди к потоку записи: поля объекта как есть, строки подряд в m_strs.
+//Заполняется без выделения памяти; объект с длинными строками (Fits() == false) в неё не помещается.
+//У решения по заявке в конце m_strs - время проверки и конец моратория.
+struct SEntry
+{
+	static const size_t Size = 128;
+
+	TRecord m_type;
+	TSide m_side;
+	uint8_t m_lens[5]; //symbol, user_id, trade_id или order_id, rule, reason
+	uint8_t m_order_type;
+	TDateTime m_time;
+	TPrice m_price;
+	TQty m_qty;
+	char m_strs[Size - 32];
+
+	static const size_t DecisionStrs = sizeof(m_strs) - 2 * sizeof(int64_t);
+
+	static bool Fits(const SQuote &quote)
+	{
+		return quote.m_symbol.size() <= sizeof(m_strs);
+	}
+
+	static bool Fits(const SSnapshotMark &)
+	{
+		return true;
+	}
+
+	static bool Fits(const STrade &trade)
+	{
+		return trade.m_symbol.size() <= 0xff && trade.m_user_id.size() <= 0xff && trade.m_trade_id.size() <= 0xff &&
+			trade.m_symbol.size() + trade.m_user_id.size() + trade.m_trade_id.size() <= sizeof(m_strs);
+	}
+
+	static bool Fits(const SDecision &decision)
+	{
+		const auto &order = decision.m_order;
+		const auto &verdict = decision.m_verdict;
+		return order.m_symbol.size() + order.m_user_id.size() + order.m_order_id.size() + verdict.m_rule.size() + verdict.m_reason.size() <= DecisionStrs;
+	}
+
+	void Set(const SQuote &quote)
+	{
+		m_type = TRecord::Quote;
+		m_time = quote.m_time;
+		m_price = quote.m_price;
+		SetStrings(quote.m_symbol);
+	}
+
+	void Set(const STrade &trade)
+	{
+		m_type = TRecord::Trade;
+		m_side = trade.m_side;
+		m_time = trade.m_time;
+		m_price = trade.m_price;
+		m_qty = trade.m_qty;
+		SetStrings(trade.m_symbol, trade.m_user_id, trade.m_trade_id);
+	}
+
+	void Set(const SSnapshotMark &mark)
+	{
+		m_type = TRecord::Snapshot;
+		std::memcpy(m_strs, &mark.m_id, sizeof(mark.m_id));
+	}
+
+	void Set(const SDecision &decision)
+	{
+		const auto &order = decision.m_order;
+		const auto &verdict = decision.m_verdict;
+		m_type = TRecord::Decision;
+		m_side = order.m_side;
+		m_order_type = uint8_t(order.m_type);
+		m_time = order.m_time;
+		m_price = order.m_price;
+		m_qty = order.m_qty;
+		SetStrings(order.m_symbol, order.m_user_id, order.m_order_id, verdict.m_rule, verdict.m_reason);
+
+		const int64_t vals[] = {verdict.m_latency.count(), ToNanoseconds(verdict.m_moratorium)};
+		std::memcpy(m_strs + DecisionStrs, vals, sizeof(vals));
+	}
+
+	//func вызывается с восстановленным SQuote, STrade, SSnapshotMark или SAudit
+	template <typename TFunc>
+	void Get(TFunc &&func) const
+	{
+		const char *p = m_strs;
+		auto str = [&p, this](size_t i)
+		{
+			p += m_lens[i];
+			return std::string(p - m_lens[i], m_lens[i]);
+		};
+
+		if (m_type == TRecord::Quote)
+		{
+			SQuote quote;
+			quote.m_symbol = str(0);
+			quote.m_price = m_price;
+			quote.m_time = m_time;
+			func(quote);
+		}
+		else if (m_type == TRecord::Trade)
+		{
+			STrade trade;
+			trade.m_symbol = str(0);
+			trade.m_user_id = str(1);
+			trade.m_trade_id = str(2);
+			trade.m_side = m_side;
+			trade.m_price = m_price;
+			trade.m_qty = m_qty;
+			trade.m_time = m_time;
+			func(trade);
+		}
+		else if (m_type == TRecord::Snapshot)
+		{
+			SSnapshotMark mark;
+			std::memcpy(&mark.m_id, m_strs, sizeof(mark.m_id));
+			func(mark);
+		}
+		else if (m_type == TRecord::Decision)
+		{
+			SAudit audit;
+			audit.m_order.m_symbol = str(0);
+			audit.m_order.m_user_id = str(1);
+			audit.m_order.m_order_id = str(2);
+			audit.m_verdict.m_rule = str(3);
+			audit.m_verdict.m_reason = str(4);
+			audit.m_verdict.m_reject = audit.m_verdict.m_reason;
+			audit.m_order.m_type = TOrderType(m_order_type);
+			audit.m_order.m_side = m_side;
+			audit.m_order.m_price = m_price;
+			audit.m_order.m_qty = m_qty;
+			audit.m_order.m_time = m_time;
+
+			int64_t vals[2];
+			std::memcpy(vals, m_strs + DecisionStrs, sizeof(vals));
+			audit.m_verdict.m_latency = std::chrono::nanoseconds(vals[0]);
+			audit.m_verdict.m_moratorium = FromNanoseconds(vals[1]);
+			func(audit);
+		}
+	}
+
+protected:
+	template <typename... TT>
+	void SetStrings(const TT&... vals)
+	{
+		size_t pos = 0, i = 0;
+		for (const std::string *val: {&vals...})
+		{
+			m_lens[i++] = uint8_t(val->size());
+			std::memcpy(m_strs + pos, val->data(), val->size());
+			pos += val->size();
+		}
+	}
+};
+
+static_assert(sizeof(SEntry) == SEntry::Size, "SEntry layout");
+
+//Кодирование в буфер; буфер опустошает владелец после записи в файл
+class CWriter
+{
+public:
+	void Start(const TDateTime &tm)
+	{
+		m_symbols.clear();
+		m_users.clear();
+		PutRecord(TRecord::Segment, [&]()
+		{
+			Write(Magic);
+			Write(Version);
+			Write(ToNanoseconds(tm));
+		});
+	}
+
+	void Put(const SQuote &quote)
+	{
+		const auto symbol = GetID(TRecord::Symbol, m_symbols, quote.m_symbol);
+		PutRecord(TRecord::Quote, [&]()
+		{
+			Write(ToNanoseconds(quote.m_time));
+			Write(quote.m_price);
+			Write(symbol);
+		});
+	}
+
+	void Put(const STrade &trade)
+	{
+		const auto symbol = GetID(TRecord::Symbol, m_symbols, trade.m_symbol);
+		const auto user = GetID(TRecord::User, m_users, trade.m_user_id);
+		PutRecord(TRecord::Trade, [&]()
+		{
+			Write(ToNanoseconds(trade.m_time));
+			Write(trade.m_price);
+			Write(trade.m_qty);
+			Write(symbol);
+			Write(user);
+			Write(trade.m_side);
+			WriteString(trade.m_trade_id);
+		});
+	}
+
+	void Put(const SSnapshotMark &mark)
+	{
+		PutRecord(TRecord::Snapshot, [&]()
+		{
+			Write(mark.m_id);
+		});
+	}
+
+	void Put(const SAudit &audit)
+	{
+		const auto &order = audit.m_order;
+		const auto &verdict = audit.m_verdict;
+		const auto symbol = GetID(TRecord::Symbol, m_symbols, order.m_symbol);
+		const auto user = GetID(TRecord::User, m_users, order.m_user_id);
+		PutRecord(TRecord::Decision, [&]()
+		{
+			Write(ToNanoseconds(order.m_time));
+			Write(order.m_price);
+			Write(order.m_qty);
+			Write(symbol);
+			Write(user);
+			Write(order.m_side);
+			Write(uint8_t(order.m_type));
+			Write(int64_t(verdict.m_latency.count()));
+			Write(ToNanoseconds(verdict.m_moratorium));
+			WriteString(order.m_order_id);
+			WriteString(verdict.m_rule);
+			WriteString(verdict.m_reason);
+		});
+	}
+
+	std::string &GetBuffer()
+	{
+		return m_buf;
+	}
+
+protected:
+	template <typename T>
+	void Write(const T &val)
+	{
+		m_buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+	}
+
+	void WriteString(const std::string &val)
+	{
+		const auto size = uint16_t(std::min<size_t>(val.size(), 0xffff));
+		Write(size);
+		m_buf.append(val.data(), size);
+	}
+
+	template <typename TFunc>
+	void PutRecord(TRecord type, TFunc &&func)
+	{
+		const size_t pos = m_buf.size();
+		m_buf.resize(pos + sizeof(SRecordHeader));
+		Write(type);
+		func();
+
+		const size_t size = m_buf.size() - pos - sizeof(SRecordHeader);
+		const SRecordHeader hdr{uint32_t(size), TS::CCrc32c::Calc(m_buf.data() + pos + sizeof(SRecordHeader), size)};
+		std::memcpy(&m_buf[pos], &hdr, sizeof(hdr));
+	}
+
+	uint32_t GetID(TRecord type, std::unordered_map<std::string, uint32_t> &dict, const std::string &val)
+	{
+		auto it = dict.find(val);
+		if (it != dict.end())
+			return it->second;
+
+		const auto id = uint32_t(dict.size());
+		dict.emplace(val, id);
+		PutRecord(type, [&]()
+		{
+			Write(id);
+			m_buf.append(val);
+		});
+		return id;
+	}
+
+	std::unordered_map<std::string, uint32_t> m_symbols;
+	std::unordered_map<std::string, uint32_t> m_users;
+	std::string m_buf;
+};
+
+//Строка оглавления закрытых файлов журнала: имя файла, время первой и последней котировки или сделки,
+//число объектов, длина и CRC-32C данных файла, время закрытия
+struct SSegmentInfo
+{
+	std::string m_name;
+	TDateTime m_first = TDateTime::max();
+	TDateTime m_last = TDateTime::min();
+	uint64_t m_count = 0;
+	uint64_t m_size = 0;
+	uint32_t m_crc = 0;
+	TDateTime m_closed = TDateTime::min();
+
+	template <typename T>
+	void Put(const T &obj)
+	{
+		m_first = std::min(m_first, obj.m_time);
+		m_last = std::max(m_last, obj.m_time);
+		++m_count;
+	}
+
+	void Put(const SSnapshotMark &)
+	{
+		++m_count;
+	}
+
+	void Append(const char *data, size_t size)
+	{
+		m_crc = TS::CCrc32c::Calc(data, size, m_crc);
+		m_size += size;
+	}
+
+	std::string Format() const
+	{
+		std::ostringstream out;
+		out << m_name << ' ' << ToNanoseconds(m_first) << ' ' << ToNanoseconds(m_last) << ' ' << m_count << ' ' << m_size << ' ' << m_crc
+			<< ' ' << ToNanoseconds(m_closed);
+		return out.str();
+	}
+
+	//Строки прежних версий - без времени закрытия: m_closed остаётся min
+	bool Parse(const std::string &line)
+	{
+		std::istringstream in(line);
+		int64_t first, last, closed;
+		if (!(in >> m_name >> first >> last >> m_count >> m_size >> m_crc))
+			return false;
+
+		m_first = FromNanoseconds(first);
+		m_last = FromNanoseconds(last);
+		if (in >> closed)
+			m_closed = FromNanoseconds(closed);
+		else if (!in.eof())
+			return false;
+		return true;
+	}
+};
+
+//Разобранная часть журнала: объекты по типам и порядок их следования
+struct SBatch
+{
+	std::vector<TRecord> m_order;
+	std::vector<SQuote> m_quotes;
+	std::vector<STrade> m_trades;
+	std::vector<SSnapshotMark> m_marks;
+
+	void Put(SQuote &quote)
+	{
+		m_order.push_back(TRecord::Quote);
+		m_quotes.push_back(std::move(quote));
+	}
+
+	void Put(STrade &trade)
+	{
+		m_order.push_back(TRecord::Trade);
+		m_trades.push_back(std::move(trade));
+	}
+
+	void Put(SSnapshotMark &mark)
+	{
+		m_order.push_back(TRecord::Snapshot);
+		m_marks.push_back(mark);
+	}
+
+	//Память остаётся для следующей части
+	void clear()
+	{
+		m_order.clear();
+		m_quotes.clear();
+		m_trades.clear();
+		m_marks.clear();
+	}
+
+	//func вызывается для объектов в порядке журнала
+	template <typename TFunc>
+	void ForEach(TFunc &&func) const
+	{
+		size_t quote = 0, trade = 0, mark = 0;
+		for (auto type: m_order)
+		{
+			if (type == TRecord::Quote)
+				func(m_quotes[quote++]);
+			else if (type == TRecord::Trade)
+				func(m_trades[trade++]);
+			else
+				func(m_marks[mark++]);
+		}
+	}
+};
+
+//Разбор журнала из памяти. Чтение останавливается на нулевой длине записи (конец данных выделенного файла)
+//или на первой неполной или повреждённой записи (недописанный хвост после аварийной остановки); GetSize() - длина корректной части.
+class CReader
+{
+public:
+	struct SDict
+	{
+		std::vector<std::string> m_symbols;
+		std::vector<std::string> m_users;
+	};
+
+	CReader(const char *data, size_t size)
+	: m_data(data)
+	, m_size(size)
+	{
+	}
+
+	//Часть [begin, end) журнала data, начинающаяся с границы записи, со словарями на её начало
+	CReader(const char *data, size_t begin, size_t end, const SDict &dict)
+	: m_data(data)
+	, m_size(end)
+	, m_pos(begin)
+	, m_dict(dict)
+	{
+	}
+
+	//Деление на части примерно по step байт для разбора в нескольких потоках.
+	//Проходит только по заголовкам записей; словарные записи разбираются, чтобы каждая часть получила словари на своё начало.
+	//Последняя часть доходит до конца данных: повреждённая запись найдётся при её разборе.
+	std::vector<CReader> Split(size_t step)
+	{
+		std::vector<CReader> res;
+		size_t begin = m_pos;
+		SDict dict = m_dict;
+		int64_t first = std::numeric_limits<int64_t>::max(), last = std::numeric_limits<int64_t>::min();
+		while (m_pos + sizeof(SRecordHeader) <= m_size)
+		{
+			SRecordHeader hdr;
+			std::memcpy(&hdr, m_data + m_pos, sizeof(hdr));
+			const char *body = m_data + m_pos + sizeof(hdr);
+			if (!hdr.m_size)
+			{
+				m_size = m_pos;
+				break;
+			}
+
+			if (hdr.m_size > MaxRecordSize || hdr.m_size > m_size - m_pos - sizeof(hdr))
+				break;
+
+			if (m_pos - begin >= step)
+			{
+				res.emplace_back(m_data, begin, m_pos, dict);
+				res.back().SetTimeRange(first, last);
+				begin = m_pos;
+				dict = m_dict;
+				first = std::numeric_limits<int64_t>::max();
+				last = std::numeric_limits<int64_t>::min();
+			}
+
+			//Время котировки и сделки - сразу за типом записи
+			const auto type = TRecord(*body);
+			if ((type == TRecord::Quote || type == TRecord::Trade) && hdr.m_size >= 1 + sizeof(int64_t))
+			{
+				int64_t tm;
+				std::memcpy(&tm, body + 1, sizeof(tm));
+				first = std::min(first, tm);
+				last = std::max(last, tm);
+			}
+			else if (type == TRecord::Segment || type == TRecord::Symbol || type == TRecord::User)
+			{
+				size_t n = 0;
+				m_cur = body;
+				m_end = body + hdr.m_size;
+				if (TS::CCrc32c::Calc(body, hdr.m_size) != hdr.m_crc || !Decode([](const auto &) {}, [](const SAudit &) {}, n))
+					break;
+			}
+			m_pos += sizeof(hdr) + hdr.m_size;
+		}
+
+		res.emplace_back(m_data, begin, m_size, dict);
+		res.back().SetTimeRange(first, last);
+		return res;
+	}
+
+	//Продолжение разбора дописываемого журнала: те же данные, возможно по новому адресу, с новой длиной
+	void Extend(const char *data, size_t size)
+	{
+		m_data = data;
+		m_size = size;
+	}
+
+	//Время самой ранней и самой поздней котировки или сделки части Split по заголовкам записей (без проверки CRC);
+	//(max, min) - их в части нет
+	std::pair<TDateTime, TDateTime> GetTimeRange() const
+	{
+		return {m_first, m_last};
+	}
+
+	//func вызывается для SQuote, STrade и SSnapshotMark; возвращает число объектов кроме меток
+	template <typename TFunc>
+	size_t ForEach(TFunc &&func)
+	{
+		return ForEach(func, [](const SAudit &) {});
+	}
+
+	//То же с журналом аудита: audit вызывается для SAudit
+	template <typename TFunc, typename TAudit>
+	size_t ForEach(TFunc &&func, TAudit &&audit)
+	{
+		size_t n = 0;
+		while (m_pos + sizeof(SRecordHeader) <= m_size)
+		{
+			SRecordHeader hdr;
+			std::memcpy(&hdr, m_data + m_pos, sizeof(hdr));
+			const char *body = m_data + m_pos + sizeof(hdr);
+			if (!hdr.m_size)
+			{
+				m_size = m_pos;
+				break;
+			}
+
+			if (hdr.m_size > MaxRecordSize || hdr.m_size > m_size - m_pos - sizeof(hdr) ||
+				TS::CCrc32c::Calc(body, hdr.m_size) != hdr.m_crc)
+				break;
+
+			m_cur = body;
+			m_end = body + hdr.m_size;
+			if (!Decode(func, audit, n))
+				break;
+
+			m_pos += sizeof(hdr) + hdr.m_size;
+		}
+		return n;
+	}
+
+	//Проверка заголовков и CRC записей без разбора объектов; результат - IsComplete()
+	void Verify()
+	{
+		while (m_pos + sizeof(SRecordHeader) <= m_size)
+		{
+			SRecordHeader hdr;
+			std::memcpy(&hdr, m_data + m_pos, sizeof(hdr));
+			if (!hdr.m_size)
+			{
+				m_size = m_pos;
+				break;
+			}
+
+			if (hdr.m_size > MaxRecordSize || hdr.m_size > m_size - m_pos - sizeof(hdr) ||
+				TS::CCrc32c::Calc(m_data + m_pos + sizeof(hdr), hdr.m_size) != hdr.m_crc)
+				break;
+
+			m_pos += sizeof(hdr) + hdr.m_size;
+		}
+	}
+
+	size_t GetSize() const
+	{
+		return m_pos;
+	}
+
+	bool IsComplete() const
+	{
+		return m_pos == m_size;
+	}
+
+protected:
+	template <typename TFunc, typename TAudit>
+	bool Decode(TFunc &&func, TAudit &&audit, size_t &n)
+	{
+		TRecord type;
+		if (!Read(type))
+			return false;
+
+		switch (type)
+		{
+		case TRecord::Segment:
+		{
+			uint32_t magic;
+			uint16_t version;
+			int64_t tm;
+			if (!Read(magic) || !Read(version) || !Read(tm) || magic != Magic || version != Version)
+				return false;
+
+			m_dict = SDict();
+			return true;
+		}
+		case TRecord::Symbol:
+			return ReadDict(m_dict.m_symbols);
+		case TRecord::User:
+			return ReadDict(m_dict.m_users);
+		case TRecord::Quote:
+		{
+			SQuote quote;
+			int64_t tm;
+			uint32_t symbol;
+			if (!Read(tm) || !Read(quote.m_price) || !Read(symbol) || !GetDict(m_dict.m_symbols, symbol, quote.m_symbol))
+				return false;
+
+			quote.m_time = FromNanoseconds(tm);
+			func(quote);
+			++n;
+			return true;
+		}
+		case TRecord::Trade:
+		{
+			STrade trade;
+			int64_t tm;
+			uint32_t symbol, user;
+			if (!Read(tm) || !Read(trade.m_price) || !Read(trade.m_qty) || !Read(symbol) || !Read(user) || !Read(trade.m_side) ||
+				!ReadString(trade.m_trade_id) || !GetDict(m_dict.m_symbols, symbol, trade.m_symbol) || !GetDict(m_dict.m_users, user, trade.m_user_id))
+				return false;
+
+			trade.m_time = FromNanoseconds(tm);
+			func(trade);
+			++n;
+			return true;
+		}
+		case TRecord::Snapshot:
+		{
+			SSnapshotMark mark;
+			if (!Read(mark.m_id))
+				return false;
+
+			func(mark);
+			return true;
+		}
+		case TRecord::Decision:
+		{
+			SAudit res;
+			auto &order = res.m_order;
+			auto &verdict = res.m_verdict;
+			int64_t tm, latency, moratorium;
+			uint32_t symbol, user;
+			uint8_t type;
+			if (!Read(tm) || !Read(order.m_price) || !Read(order.m_qty) || !Read(symbol) || !Read(user) || !Read(order.m_side) || !Read(type) ||
+				!Read(latency) || !Read(moratorium) || !ReadString(order.m_order_id) || !ReadString(verdict.m_rule) || !ReadString(verdict.m_reason) ||
+				!GetDict(m_dict.m_symbols, symbol, order.m_symbol) || !GetDict(m_dict.m_users, user, order.m_user_id))
+				return false;
+
+			order.m_type = TOrderType(type);
+			order.m_time = FromNanoseconds(tm);
+			verdict.m_reject = verdict.m_reason;
+			verdict.m_latency = std::chrono::nanoseconds(latency);
+			verdict.m_moratorium = FromNanoseconds(moratorium);
+			audit(res);
+			++n;
+			return true;
+		}
+		}
+		return false;
+	}
+
+	template <typename T>
+	bool Read(T &dst)
+	{
+		if (size_t(m_end - m_cur) < sizeof(T))
+			return false;
+
+		std::memcpy(&dst, m_cur, sizeof(T));
+		m_cur += sizeof(T);
+		return true;
+	}
+
+	bool ReadString(std::string &dst)
+	{
+		uint16_t size;
+		if (!Read(size) || size_t(m_end - m_cur) < size)
+			return false;
+
+		dst.assign(m_cur, size);
+		m_cur += size;
+		return true;
+	}
+
+	bool ReadDict(std::vector<std::string> &dict)
+	{
+		uint32_t id;
+		if (!Read(id) || id != dict.size())
+			return false;
+
+		dict.emplace_back(m_cur, m_end);
+		return true;
+	}
+
+	static bool GetDict(const std::vector<std::string> &dict, uint32_t id, std::string &dst)
+	{
+		if (id >= dict.size())
+			return false;
+
+		dst = dict[id];
+		return true;
+	}
+
+	void SetTimeRange(int64_t first, int64_t last)
+	{
+		m_first = first != std::numeric_limits<int64_t>::max()? FromNanoseconds(first): TDateTime::max();
+		m_last = last != std::numeric_limits<int64_t>::min()? FromNanoseconds(last): TDateTime::min();
+	}
+
+	const char *m_data;
+	size_t m_size;
+	size_t m_pos = 0;
+
+	const char *m_cur = nullptr;
+	const char *m_end = nullptr;
+
+	SDict m_dict;
+	TDateTime m_first = TDateTime::min();
+	TDateTime m_last = TDateTime::max();
+};
+
+}
+}
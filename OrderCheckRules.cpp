@@ -1,9 +1,13 @@
 #include "Common.h"
 #include "RiskManager.h"
+#include "Snapshot.h"
 
 #include "Common/FramedQueue.h"
+#include "Common/ConcurrentMap.h"
+#include "Common/SeqLock.h"
 
 #include <unordered_map>
+#include <limits>
 
 
 using namespace RM;
@@ -24,7 +28,7 @@ class CNewOrderMoratorium
 : public COrderCheckRule
 {
 public:
-	NewOrderMoratorium::CConfig m_cfg;
+	TS::CRcuValue<NewOrderMoratorium::CConfig> m_cfg;
 
 	CNewOrderMoratorium(CRiskManager &rm, const TS::CConfigFile &cfg)
 	: COrderCheckRule(rm, cfg)
@@ -33,40 +37,90 @@ public:
 		RegisterCallback<SOrder>(&CNewOrderMoratorium::CheckOrder, this);
 	}
 
+	virtual void Reload(const TS::CConfigFile &cfg) override
+	{
+		COrderCheckRule::Reload(cfg);
+		m_cfg.Publish(NewOrderMoratorium::CConfig(cfg));
+	}
+
 	void CheckOrder(const SOrder &order)
 	{
-		auto key = std::make_pair(order.m_user_id, order.m_symbol);
-		auto it = Sys::Locked::Emplace(key, m_investors, m_mx, [&order]()
+		const std::pair<const TUserID &, const TSymbol &> key(order.m_user_id, order.m_symbol);
+		const auto ticks = order.m_time.time_since_epoch().count();
+		auto res = m_investors.insert_or_get(key, ticks);
+		if (res.second) //New Investor
+			return;
+
+		//Заявка с более ранним временем не проверяется и время не сдвигает; отклонённая заявка время не обновляет
+		auto &last = *res.first;
+		auto prev = last.load(std::memory_order_relaxed);
+		do
 		{
-			auto sp = std::make_unique<CInvestor>();
-			sp->m_order_time = order.m_time;
-			return std::move(sp);
-		});
+			if (prev > ticks)
+				return;
 
-		if (it.second) //New Investor
-			return;
+			const auto tm = TDateTime(TDateTime::duration(prev)) + m_cfg->timeout;
+			if (tm > order.m_time)
+				RejectOrder(order, "NewOrderMoratorium", tm - order.m_time);
+		}
+		while (!last.compare_exchange_weak(prev, ticks, std::memory_order_relaxed));
+	}
 
-		auto &investor = *it.first->second;
+	virtual std::string GetStateKey() const override
+	{
+		return "1";
+	}
 
-		SYS_LOCK(investor.m_mx);
-		if (investor.m_order_time > order.m_time)
-			return;
+	//Котировки и сделки правилу не нужны
+	virtual TDateTime::duration GetQuoteHorizon() const override
+	{
+		return TDateTime::duration::zero();
+	}
 
-		const auto tm = investor.m_order_time + m_cfg.timeout;
-		if (tm > order.m_time)
-			RejectOrder(order, "NewOrderMoratorium", tm - order.m_time);
+	virtual TDateTime::duration GetTradeHorizon() const override
+	{
+		return TDateTime::duration::zero();
+	}
 
-		investor.m_order_time = order.m_time;
+	//Время заявки старше timeout уже ничего не отклонит
+	virtual TDateTime::duration GetOrderHorizon() const override
+	{
+		return m_cfg->timeout;
 	}
 
-	struct CInvestor
+	virtual void SaveState(Snapshot::CWriter &out) override
 	{
-		std::mutex m_mx;
-		TDateTime m_order_time;
-	};
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			m_investors.ForEachItem([&out, &n](const auto &key, const std::atomic<TDateTime::rep> &last)
+			{
+				out.Write(key.first);
+				out.Write(key.second);
+				out.Write(last.load(std::memory_order_relaxed));
+				++n;
+			});
+			return n;
+		});
+	}
 
-	std::shared_mutex m_mx;
-	std::map<std::pair<TUserID, TSymbol>, std::unique_ptr<CInvestor>> m_investors; //Время последней заявки для инвестора
+	virtual void LoadState(Snapshot::CReader &in) override
+	{
+		in.ReadList([this, &in]()
+		{
+			std::pair<TUserID, TSymbol> key;
+			in.Read(key.first);
+			in.Read(key.second);
+			const auto ticks = in.Read<TDateTime::rep>();
+
+			auto &last = *m_investors.insert_or_get(key, ticks).first;
+			auto prev = last.load(std::memory_order_relaxed);
+			while (prev < ticks && !last.compare_exchange_weak(prev, ticks, std::memory_order_relaxed))
+				;
+		});
+	}
+
+	TS::CConcurrentMap<std::pair<TUserID, TSymbol>, std::atomic<TDateTime::rep>> m_investors; //Время последней заявки для инвестора
 };
 
 
@@ -78,10 +132,12 @@ public:
 //	for a sell order, if the price is lower than trailing 3*hour average price by more than 5*%
 //Action if true : order is rejected, alarm is sent, moratorium starts
 
+//bucket: 0 - хранить все котировки окна, иначе агрегировать по корзинам этой ширины (CBucketedSum)
 #define TS_CFG TS_CFG_(PriceCheck)
 #define TS_CONFIG_ITEMS \
 	TS_ITEM(timeframe, std::chrono::seconds, 3h) \
 	TS_ITEM(price_dev, double, 5.0 / 100.0) \
+	TS_ITEM(bucket, std::chrono::milliseconds, 0ms) \
 
 #include "Common/Config.inl"
 
@@ -89,20 +145,37 @@ class CPriceCheck
 : public COrderCheckRule
 {
 public:
-	PriceCheck::CConfig m_cfg;
+	TS::CRcuValue<PriceCheck::CConfig> m_cfg;
 
 	CPriceCheck(CRiskManager &rm, const TS::CConfigFile &cfg)
 	: COrderCheckRule(rm, cfg)
-	, m_cfg(cfg)
+	, m_cfg(LoadConfig(cfg))
 	{
 		RegisterCallback<SQuote>(&CPriceCheck::ProcessQuote, this);
 		RegisterCallback<SOrder>(&CPriceCheck::CheckOrder, this);
 	}
 
+	virtual void Reload(const TS::CConfigFile &cfg) override
+	{
+		COrderCheckRule::Reload(cfg);
+		m_cfg.Publish(LoadConfig(cfg));
+	}
+
+	static PriceCheck::CConfig LoadConfig(const TS::CConfigFile &src)
+	{
+		PriceCheck::CConfig cfg(src);
+		cfg.bucket = CheckBucket("PriceCheck", cfg.timeframe, cfg.bucket);
+		return cfg;
+	}
+
 	void ProcessQuote(const SQuote &quote)
 	{
 		auto &instr = GetInstrument(quote.m_symbol);
-		instr.PutValue(quote.m_time, quote.m_price);
+
+		SYS_LOCK(instr.m_mx);
+		instr.m_prices.PutValue(quote.m_time, quote.m_price);
+		const auto band = instr.PublishBand(instr.m_prices.GetAverage(), *m_cfg);
+		instr.m_expiry.Schedule(band.m_valid_to);
 	}
 
 	void CheckOrder(const SOrder &order)
@@ -110,36 +183,135 @@ public:
 		if (order.m_type != TOrderType::Limit)
 			return;
 
-		SYS_LOCK_READ(m_mx);
-		auto it = m_instrs.find(order.m_symbol);
-		if (it == m_instrs.end())
+		auto *instr = m_instrs.find(order.m_symbol);
+		if (!instr)
 			RejectOrder(order, "InstrumentNotFound", order.m_symbol);
 
-		auto &instr = *it->second;
-		const auto avg = instr.GetAverage(order.m_time);
+		const auto band = instr->GetBand(order.m_time, *m_cfg);
 
 		const bool reject = order.m_side == TSide::Buy?
-			order.m_price > avg * (1.0 + m_cfg.price_dev):
-			-order.m_price < -avg * (1.0 - m_cfg.price_dev); //Raise when avg == 0
+			order.m_price > band.m_buy:
+			-order.m_price < -band.m_sell; //Raise when avg == 0
 
 		if (reject)
-			RejectOrder(order, "PriceCheck", avg);
+			RejectOrder(order, "PriceCheck", band.m_avg);
 	}
 
-protected:
-	typedef TS::CMovingSum<TPrice> TInstrument;
+	virtual std::string GetStateKey() const override
+	{
+		const auto &cfg = *m_cfg;
+		return TS::FormatStr("1", cfg.timeframe.count(), cfg.bucket.count());
+	}
 
-	TInstrument &GetInstrument(const TSymbol &id)
+	//Окно котировок с корзиной на краю
+	virtual TDateTime::duration GetQuoteHorizon() const override
 	{
-		auto res = Sys::Locked::Emplace(id, m_instrs, m_mx, [this]()
+		const auto &cfg = *m_cfg;
+		return cfg.timeframe + cfg.bucket;
+	}
+
+	virtual TDateTime::duration GetTradeHorizon() const override
+	{
+		return TDateTime::duration::zero();
+	}
+
+	virtual void SaveState(Snapshot::CWriter &out) override
+	{
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			m_instrs.ForEachItem([&out, &n](const TSymbol &symbol, CInstrument &instr)
+			{
+				SYS_LOCK(instr.m_mx);
+				out.Write(symbol);
+				instr.m_prices.Save(out);
+				++n;
+			});
+			return n;
+		});
+	}
+
+	virtual void LoadState(Snapshot::CReader &in) override
+	{
+		in.ReadList([this, &in]()
 		{
-			return std::make_unique<TInstrument>(m_cfg.timeframe);
+			TSymbol symbol;
+			in.Read(symbol);
+
+			auto &instr = GetInstrument(symbol);
+			SYS_LOCK(instr.m_mx);
+			instr.m_prices.Load(in);
+			const auto band = instr.PublishBand(instr.m_prices.GetAverage(), *m_cfg);
+			instr.m_expiry.Schedule(band.m_valid_to);
 		});
-		return *res.first->second;
 	}
 
-	std::shared_mutex m_mx;
-	std::unordered_map<TSymbol, std::unique_ptr<TInstrument>> m_instrs;
+protected:
+	//Границы цены по средней окна; действуют, пока из окна ничего не устарело и не сменились параметры
+	struct SBand
+	{
+		const PriceCheck::CConfig *m_cfg;
+		TDateTime m_valid_to;
+		TPrice m_avg;
+		TPrice m_buy;
+		TPrice m_sell;
+	};
+
+	struct CInstrument
+	{
+		template <typename... TT>
+		CInstrument(TTimerWheel &wheel, const TS::CRcuValue<PriceCheck::CConfig> &cfg, TT&&... args)
+		: m_prices(std::forward<TT>(args)...)
+		, m_expiry(wheel, [this, &cfg](const TDateTime &tm)
+		{
+			return EraseExpired(tm, *cfg);
+		})
+		{
+		}
+
+		//Заявка читает опубликованные границы без блокировок; если они устарели к времени заявки
+		//или посчитаны по прежним параметрам, пересчитывает их под блокировкой инструмента
+		SBand GetBand(const TDateTime &tm, const PriceCheck::CConfig &cfg)
+		{
+			const auto band = m_band.Load();
+			if (band.m_cfg == &cfg && !(band.m_valid_to < tm))
+				return band;
+
+			SYS_LOCK(m_mx);
+			return PublishBand(m_prices.GetAverage(tm), cfg);
+		}
+
+		//Вызывается под m_mx
+		SBand PublishBand(TPrice avg, const PriceCheck::CConfig &cfg)
+		{
+			const SBand band{&cfg, m_prices.GetValidTo(), avg, avg * (1.0 + cfg.price_dev), avg * (1.0 - cfg.price_dev)};
+			m_band.Store(band);
+			return band;
+		}
+
+		//Фоновая очистка окна с публикацией новых границ, возвращает срок следующей
+		TDateTime EraseExpired(const TDateTime &tm, const PriceCheck::CConfig &cfg)
+		{
+			SYS_LOCK(m_mx);
+			if (m_prices.EraseExpired(tm))
+				PublishBand(m_prices.GetAverage(), cfg);
+
+			return m_prices.GetValidTo();
+		}
+
+		std::mutex m_mx; //Упорядочивает изменения окна и публикацию границ
+		TS::CMovingSumEx<TPrice, TPrice, TDateTime, Sys::CNullMutex> m_prices; //Только под m_mx
+		TS::CSeqLock<SBand> m_band{SBand{nullptr, TDateTime::min(), 0, 0, 0}};
+		TTimerWheel::CTimer m_expiry;
+	};
+
+	CInstrument &GetInstrument(const TSymbol &id)
+	{
+		const auto &cfg = *m_cfg;
+		return *m_instrs.insert_or_get(id, m_rm.GetExpiry(), m_cfg, cfg.timeframe, cfg.bucket).first;
+	}
+
+	TS::CConcurrentMap<TSymbol, CInstrument> m_instrs;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -158,7 +330,7 @@ class CSeqBadTrades
 : public COrderCheckRule
 {
 public:
-	SeqBadTrades::CConfig m_cfg;
+	TS::CRcuValue<SeqBadTrades::CConfig> m_cfg;
 
 	CSeqBadTrades(CRiskManager &rm, const TS::CConfigFile &cfg)
 	: COrderCheckRule(rm, cfg)
@@ -168,88 +340,234 @@ public:
 		RegisterCallback<SOrder>(&CSeqBadTrades::CheckOrder, this);
 	}
 
+	virtual void Reload(const TS::CConfigFile &cfg) override
+	{
+		COrderCheckRule::Reload(cfg);
+		m_cfg.Publish(SeqBadTrades::CConfig(cfg));
+	}
+
 	void ProcessTrade(const STrade &trade)
 	{
-		const auto id = std::make_pair(trade.m_symbol, trade.m_user_id);
-		auto &trades = *Sys::Locked::Emplace(id, m_trades, m_mx, [this]()
-		{
-			return std::make_unique<CTradesPair>(m_cfg.timeframe);
-		}).first->second;
+		const std::pair<const TSymbol &, const TUserID &> id(trade.m_symbol, trade.m_user_id);
+		const auto &cfg = *m_cfg;
+		auto &trades = *m_trades.insert_or_get(id, cfg.cnt).first;
 
-		trades.ProcessTrade(trade);
+		trades.ProcessTrade(trade, cfg.cnt);
 	}
 
 	void CheckOrder(const SOrder &order)
 	{
-		SYS_LOCK_READ(m_mx);
-		auto it = m_trades.find({order.m_symbol, order.m_user_id});
-		if (it == m_trades.end())
+		auto *trades = m_trades.find(std::pair<const TSymbol &, const TUserID &>(order.m_symbol, order.m_user_id));
+		if (!trades)
 			return;
 
-		const auto n = it->second->GetBadTrades(order.m_time);
-		const bool reject = n > m_cfg.cnt;
+		const auto &cfg = *m_cfg;
+		const auto n = trades->GetBadTrades(order.m_time, cfg.timeframe);
+		const bool reject = n > cfg.cnt;
 		if (reject)
 			RejectOrder(order, "SeqBadTrades", n);
 	}
 
+	virtual std::string GetStateKey() const override
+	{
+		const auto &cfg = *m_cfg;
+		return TS::FormatStr("2", cfg.timeframe.count(), cfg.cnt);
+	}
+
+	virtual TDateTime::duration GetQuoteHorizon() const override
+	{
+		return TDateTime::duration::zero();
+	}
+
+	//Убыточные пары старше окна не считаются; серия сделок одной стороны, начатая раньше, восстанавливается с первой сделки в горизонте
+	virtual TDateTime::duration GetTradeHorizon() const override
+	{
+		return m_cfg->timeframe;
+	}
+
+	virtual void SaveState(Snapshot::CWriter &out) override
+	{
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			m_trades.ForEachItem([&out, &n](const auto &id, CTradesPair &trades)
+			{
+				out.Write(id.first);
+				out.Write(id.second);
+				trades.Save(out);
+				++n;
+			});
+			return n;
+		});
+	}
+
+	virtual void LoadState(Snapshot::CReader &in) override
+	{
+		const auto &cfg = *m_cfg;
+		in.ReadList([this, &in, &cfg]()
+		{
+			std::pair<TSymbol, TUserID> id;
+			in.Read(id.first);
+			in.Read(id.second);
+			m_trades.insert_or_get(id, cfg.cnt).first->Load(in);
+		});
+	}
+
 protected:
+	//Состояние пары (инструмент, инвестор): VWAP текущей серии сделок одной стороны и кольцо времён последних cnt + 1 убыточных пар сделок -
+	//больше хранить незачем, заявка отклоняется уже при cnt + 1 в окне. Окно берётся из текущих настроек,
+	//кольцо растёт под m_mx со следующей сделкой после перезагрузки, увеличившей cnt.
+	//Сделки пишут под спинлоком, CheckOrder читает без блокировок.
 	struct CTradesPair
 	{
-		CTradesPair(auto tm)
-		: m_price(tm)
-		, m_bads(tm, 0)
+		typedef TDateTime::rep TTicks;
+		static constexpr TTicks Empty = std::numeric_limits<TTicks>::min();
+
+		explicit CTradesPair(size_t cnt)
+		: m_ring(cnt + 1)
 		{
 		}
 
-		void ProcessTrade(const STrade &trade)
+		void ProcessTrade(const STrade &trade, size_t cnt)
 		{
 			SYS_LOCK(m_mx);
-			if (trade.m_side == m_side)
+			Grow(cnt + 1);
+
+			auto leg = m_leg.Load();
+			if (trade.m_side == leg.m_side)
 			{
 				m_time = trade.m_time;
-				m_price.PutValue(trade.m_time, trade.m_price);
+				leg.m_sum += trade.m_price * trade.m_qty;
+				leg.m_qty += trade.m_qty;
+				m_leg.Store(leg);
 				return;
 			}
 
-			const auto price = m_price.GetAverage(trade.m_time);
-			if (_IsBadTrade(price))
-				m_bads.PutValue(m_time, 1);
+			if (leg.IsBadTrade())
+				PutBadTrade(m_time);
 
-			m_price.Clear();
-
-			m_side = trade.m_side;
 			m_time = trade.m_time;
-			m_price.PutValue(trade.m_time, trade.m_price);
+			leg.m_price2 = leg.GetPrice();
+			leg.m_side = trade.m_side;
+			leg.m_sum = trade.m_price * trade.m_qty;
+			leg.m_qty = trade.m_qty;
+			m_leg.Store(leg);
 		}
 
-		bool _IsBadTrade(TPrice price)
+		size_t GetBadTrades(TDateTime tm, std::chrono::seconds frame) const
 		{
-			if (m_price2 == 0 || price == 0)
-				return false;
+			const auto &ring = *m_ring;
+			size_t n = 0;
+			for (size_t i = 0; i < ring.m_size; ++i)
+			{
+				const auto ticks = ring.m_bads[i].load(std::memory_order_relaxed);
+				if (ticks != Empty && !(TDateTime(TDateTime::duration(ticks)) + frame < tm))
+					++n;
+			}
+			return m_leg.Load().IsBadTrade()? n + 1: n;
+		}
 
-			return m_side == TSide::Buy? price > m_price2: price < m_price2;
+		void Save(Snapshot::CWriter &out)
+		{
+			SYS_LOCK(m_mx);
+			out.Write(m_time);
+			out.Write(m_leg.Load());
+			out.WriteList([this, &out]()
+			{
+				const auto &ring = *m_ring;
+				for (size_t i = 0; i < ring.m_size; ++i)
+					out.Write(ring.m_bads[i].load(std::memory_order_relaxed));
+				return ring.m_size;
+			});
 		}
 
-		size_t GetBadTrades(auto tm)
+		void Load(Snapshot::CReader &in)
 		{
-			SYS_LOCK(m_mx)
-			const auto n = m_bads.GetSize(tm);
-			return _IsBadTrade(m_price.GetAverage())? n + 1: n;
+			SYS_LOCK(m_mx);
+			in.Read(m_time);
+			m_leg.Store(in.Read<SLeg>());
+			in.ReadList([this, &in]()
+			{
+				const auto ticks = in.Read<TTicks>();
+				if (ticks != Empty)
+					PutBadTrade(TDateTime(TDateTime::duration(ticks)));
+			});
 		}
 
-		std::mutex m_mx;
+	protected:
+		struct SLeg
+		{
+			TPrice GetPrice() const
+			{
+				return m_qty > 0? m_sum / m_qty: 0;
+			}
 
-		TSide m_side = TSide::Buy;
-		TDateTime m_time;
-		TS::CMovingSum<TPrice> m_price;
+			bool IsBadTrade() const
+			{
+				const auto price = GetPrice();
+				if (m_price2 == 0 || price == 0)
+					return false;
+
+				return m_side == TSide::Buy? price > m_price2: price < m_price2;
+			}
+
+			TPrice m_sum = 0;
+			TQty m_qty = 0;
+			TPrice m_price2 = 0; //VWAP предыдущей серии, противоположной стороны
+			TSide m_side = TSide::Buy;
+		};
 
-		TPrice m_price2 = 0;
+		struct SRing
+		{
+			explicit SRing(size_t size)
+			: m_size(size)
+			, m_bads(new std::atomic<TTicks>[size])
+			{
+				for (size_t i = 0; i < m_size; ++i)
+					m_bads[i].store(Empty, std::memory_order_relaxed);
+			}
+
+			const size_t m_size;
+			const std::unique_ptr<std::atomic<TTicks>[]> m_bads;
+		};
+
+		//Под m_mx: отметки переносятся в новое кольцо, прежнее остаётся читателям до разрушения пары
+		void Grow(size_t size)
+		{
+			const auto &ring = *m_ring;
+			if (size <= ring.m_size)
+				return;
+
+			auto grown = std::make_unique<SRing>(size);
+			for (size_t i = 0; i < ring.m_size; ++i)
+				grown->m_bads[i].store(ring.m_bads[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			m_ring.Publish(std::move(grown));
+		}
+
+		//Вытесняется самая ранняя отметка: порядок времён сделок пары не гарантирован
+		void PutBadTrade(TDateTime tm)
+		{
+			const auto &ring = *m_ring;
+			const auto ticks = tm.time_since_epoch().count();
+			size_t pos = 0;
+			for (size_t i = 1; i < ring.m_size; ++i)
+			{
+				if (ring.m_bads[i].load(std::memory_order_relaxed) < ring.m_bads[pos].load(std::memory_order_relaxed))
+					pos = i;
+			}
+
+			if (!(ticks < ring.m_bads[pos].load(std::memory_order_relaxed)))
+				ring.m_bads[pos].store(ticks, std::memory_order_relaxed);
+		}
+
+		Sys::CSpinSharedMutex m_mx;
+		TDateTime m_time;
 
-		TS::CFramedQueue<int> m_bads;
+		TS::CSeqLock<SLeg> m_leg;
+		TS::CRcuValue<SRing> m_ring;
 	};
 
-	std::shared_mutex m_mx;
-	std::map<std::pair<TSymbol, TUserID>, std::unique_ptr<CTradesPair>> m_trades;
+	TS::CConcurrentMap<std::pair<TSymbol, TUserID>, CTradesPair> m_trades;
 };
 
 }
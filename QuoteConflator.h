@@ -0,0 +1,145 @@
+#pragma once
+#include "RiskManager.h"
+#include "Common/Thread.h"
+#include "Common/ConcurrentMap.h"
+
+#include <vector>
+
+namespace RM
+{
+//Прореживание котировок: по каждому инструменту хранится только последняя котировка,
+//поток доставки раз в цикл передаёт правилам последнюю котировку по каждому изменившемуся инструменту.
+//Котировка ждёт доставки не дольше max_staleness (плюс время самой доставки).
+class CQuoteConflator
+{
+public:
+	typedef TS::CFunction<void(const SQuote &)> TDeliver;
+
+	template <typename Rep, typename Period>
+	CQuoteConflator(std::chrono::duration<Rep, Period> max_staleness, TDeliver &&deliver)
+	: m_max_staleness(max_staleness)
+	, m_deliver(std::move(deliver))
+	{
+		m_thread.Start(&CQuoteConflator::ThreadProc, this);
+	}
+
+	~CQuoteConflator()
+	{
+		m_thread.Stop();
+	}
+
+	void PutQuote(const SQuote &quote)
+	{
+		++m_received;
+
+		auto &slot = *m_slots.insert_or_get(quote.m_symbol).first;
+		{
+			SYS_LOCK(slot.m_mx);
+			if (quote.m_time < slot.m_quote.m_time)
+				return;
+
+			slot.m_quote = quote;
+			if (slot.m_pending)
+				return;
+
+			slot.m_pending = true;
+		}
+
+		SYS_LOCK(m_pending);
+		m_pending.emplace_back(&slot);
+		m_evQuote.Set();
+	}
+
+	std::pair<size_t, size_t> GetCounters() const
+	{
+		return {m_received, m_delivered};
+	}
+
+	//Пока блокировка жива, поток доставки стоит, а начатая им доставка уже закончена
+	std::unique_lock<std::mutex> Hold()
+	{
+		return std::unique_lock<std::mutex>(m_drain);
+	}
+
+	//Доставка ожидающих котировок в потоке вызывающего, только под Hold()
+	template <typename TFunc>
+	void Drain(TFunc &&deliver)
+	{
+		auto items = Sys::Locked::Move(m_pending);
+		for (auto *slot: items)
+		{
+			SQuote quote;
+			{
+				SYS_LOCK(slot->m_mx);
+				quote = slot->m_quote;
+				slot->m_pending = false;
+			}
+
+			TS_NOEXCEPT(deliver(quote));
+			++m_delivered;
+		}
+	}
+
+protected:
+	struct CSlot
+	{
+		mutable std::mutex m_mx;
+		SQuote m_quote;
+		bool m_pending = false;
+	};
+
+	void Drain()
+	{
+		SYS_LOCK(m_drain);
+		Drain(m_deliver);
+	}
+
+	void ThreadProc(Sys::CThreadControl &thread)
+	{
+		auto tm = std::chrono::steady_clock::now();
+		size_t received = 0;
+		for (;;)
+		{
+			const auto *ev = thread.Wait(1min, m_evQuote);
+			if (!ev)
+				break;
+
+			if (ev == &m_evQuote && m_max_staleness.count())
+				thread.Wait(m_max_staleness);
+
+			Drain();
+
+			const auto now = std::chrono::steady_clock::now();
+			if (now - tm >= 1min && received != m_received)
+			{
+				tm = now;
+				received = m_received;
+				LogCounters();
+			}
+		}
+
+		Drain();
+		LogCounters();
+	}
+
+	void LogCounters() const
+	{
+		const size_t received = m_received, delivered = m_delivered;
+		Log.Info("QuoteConflation", received, delivered, delivered? double(received) / delivered: 0.0);
+	}
+
+	const std::chrono::milliseconds m_max_staleness;
+	const TDeliver m_deliver;
+
+	TS::CConcurrentMap<TSymbol, CSlot> m_slots;
+	Sys::CLockedObject<std::vector<CSlot *>, std::mutex> m_pending;
+	std::mutex m_drain;
+
+	std::atomic<size_t> m_received{0};
+	std::atomic<size_t> m_delivered{0};
+
+	Sys::CThread m_thread;
+	Sys::CEvent<false> m_evQuote{m_thread};
+};
+
+}
@@ -1,21 +1,319 @@
 #include "Common.h"
 #include "RiskManager.h"
+#include "QuoteConflator.h"
+#include "Snapshot.h"
+
+#include <numeric>
+#include <algorithm>
+#include <set>
+#include <map>
 
 using namespace RM;
 
 
 CRiskManager::CRiskManager(const TS::CConfigFile &cfg)
+: TConfig(cfg)
+, m_expiry(std::max<std::chrono::milliseconds>(m_cfg.sweep_period, 1ms))
 {
+	if (m_cfg.conflate_quotes)
+		m_conflator = std::make_unique<CQuoteConflator>(m_cfg.max_staleness, CQuoteConflator::TDeliver(&CRiskManager::PutObject<SQuote>, this));
+
 	cfg.ForEachNode("rule", [this](auto &&cfg)
 	{
 		auto name = cfg.template ReadValue<std::string>("id");
 		AddRule(name, cfg);
 	});
+
+#if TS_LATENCY_STATS
+	const auto overhead = TS::CLatencyStats::MeasureOverhead();
+	if (overhead > TS::CLatencyStats::OverheadBudget)
+		Log.Warning("LatencyStats overhead, ns", overhead, TS::CLatencyStats::OverheadBudget);
+	else
+		Log.Info("LatencyStats overhead, ns", overhead);
+#endif
+
+	if (m_cfg.sweep_period.count() > 0)
+		m_sweeper.Start(&CRiskManager::SweepThreadProc, this);
 }
 
 CRiskManager::~CRiskManager()
 {
+	m_sweeper.Stop();
+	m_conflator.reset();
+}
+
+//Устаревание по времени данных переносится с чтений на этот поток: к приходу заявки окна уже очищены
+void CRiskManager::SweepThreadProc(Sys::CThreadControl &thread)
+{
+	while (thread.Wait(m_cfg.sweep_period))
+	{
+		const auto ticks = m_time.load(std::memory_order_relaxed);
+		if (ticks == TDateTime::min().time_since_epoch().count())
+			continue;
+
+		m_expiry.Advance(TDateTime(TDateTime::duration(ticks)) - m_cfg.sweep_lag);
+	}
+}
+
+template <>
+void CRiskManager::ProcessMessage<SQuote>(CTransport &trans, const CMessage &msg)
+{
+	TS_LATENCY_SCOPE(m_latency.m_Quote);
+	auto quote = Parse<SQuote>(msg);
+	if (!m_conflator)
+		return PutObject(quote);
+
+	//Рыночные данные и журнал получают каждую котировку, правила - только прореженные.
+	//Котировка попадает в прореживание под той же блокировкой, что и в журнал: снимок доставляет её правилам до метки.
+	SYS_LOCK_READ(m_cut);
+	UpdateTime(quote.m_time);
+	UpdateMarketData(quote);
+	m_received.ForEachCallback2(quote);
+	m_conflator->PutQuote(quote);
+}
+
+template <>
+void CRiskManager::ReplayMessage<SQuote>(CTransport &trans, const CMessage &msg)
+{
+	PutObject(Parse<SQuote>(msg));
+}
+
+
+void CMarketData::Save(Snapshot::CWriter &out) const
+{
+	out.WriteList([this, &out]()
+	{
+		size_t n = 0;
+		m_slots.ForEachItem([&out, &n](const TSymbol &symbol, const CSlot &slot)
+		{
+			const auto last = slot.m_last.Load();
+			out.Write(symbol);
+			out.Write(last.m_price);
+			out.Write(last.m_time);
+			++n;
+		});
+		return n;
+	});
+}
+
+void CMarketData::Load(Snapshot::CReader &in)
+{
+	in.ReadList([this, &in]()
+	{
+		SQuote quote;
+		in.Read(quote.m_symbol);
+		in.Read(quote.m_price);
+		in.Read(quote.m_time);
+		PutQuote(quote);
+	});
+}
+
+void CRiskManager::CInvestor::Save(Snapshot::CWriter &out) const
+{
+	SYS_LOCK_READ(m_mx);
+	out.WriteList([this, &out]()
+	{
+		for (auto &item: m_moratorium)
+		{
+			out.Write(item.first);
+			out.Write(item.second);
+		}
+		return m_moratorium.size();
+	});
+}
+
+void CRiskManager::CInvestor::Load(Snapshot::CReader &in)
+{
+	SYS_LOCK_WRITE(m_mx);
+	in.ReadList([this, &in]()
+	{
+		TSymbol symbol;
+		TDateTime tm;
+		in.Read(symbol);
+		in.Read(tm);
+		m_moratorium[symbol] = tm;
+		m_expiry.Schedule(tm);
+	});
+}
+
+//Раскладка: время данных, раздел рыночных данных, раздел мораториев инвесторов, список разделов правил (имя, ключ, раздел)
+void CRiskManager::SaveSnapshot(Snapshot::CWriter &out, const std::function<void()> &cut)
+{
+	std::unique_lock<std::mutex> hold;
+	if (m_conflator)
+		hold = m_conflator->Hold();
+
+	SYS_LOCK_WRITE(m_cut);
+
+	//Котировки, уже записанные в журнал, правила получают до метки снимка
+	if (m_conflator)
+	{
+		m_conflator->Drain([this](const SQuote &quote)
+		{
+			TCallbackManager<SQuote>::ForEachCallback2(quote);
+		});
+	}
+	cut();
 
+	out.Write(m_time.load(std::memory_order_relaxed));
+	out.WriteSection([this, &out]()
+	{
+		m_market.Save(out);
+	});
+
+	out.WriteSection([this, &out]()
+	{
+		out.WriteList([this, &out]()
+		{
+			size_t n = 0;
+			m_investors.ForEachItem([&out, &n](const TUserID &id, const CInvestor &investor)
+			{
+				out.Write(id);
+				investor.Save(out);
+				++n;
+			});
+			return n;
+		});
+	});
+
+	SYS_LOCK(m_rules);
+	out.WriteList([this, &out]()
+	{
+		size_t n = 0;
+		for (auto &rule: m_rules)
+		{
+			const auto key = rule? rule->GetStateKey(): std::string();
+			if (key.empty())
+				continue;
+
+			out.Write(rule->m_name);
+			out.Write(key);
+			out.WriteSection([&rule, &out]()
+			{
+				rule->SaveState(out);
+			});
+			++n;
+		}
+		return n;
+	});
+}
+
+bool CRiskManager::LoadSnapshot(Snapshot::CReader in)
+{
+	TDateTime::rep ticks;
+	in.Read(ticks);
+	auto market = in.ReadSection();
+	auto investors = in.ReadSection();
+
+	//Каждому правилу с состоянием - раздел с тем же ключом
+	SYS_LOCK(m_rules);
+	std::map<COrderCheckRule *, Snapshot::CReader> rules;
+	in.ReadList([this, &in, &rules]()
+	{
+		std::string name, key;
+		in.Read(name);
+		in.Read(key);
+		auto section = in.ReadSection();
+
+		auto it = std::find_if(m_rules.begin(), m_rules.end(), [&name](const auto &rule)
+		{
+			return rule && rule->m_name == name;
+		});
+
+		if (it != m_rules.end() && (*it)->GetStateKey() == key)
+			rules.emplace(it->get(), section);
+		else
+			Log.Warning("Snapshot: rule state doesn't match", name, key);
+	});
+
+	for (auto &rule: m_rules)
+	{
+		if (rule && !rule->GetStateKey().empty() && !rules.count(rule.get()))
+		{
+			Log.Warning("Snapshot: no state for rule", rule->m_name, rule->GetStateKey());
+			return false;
+		}
+	}
+
+	UpdateTime(TDateTime(TDateTime::duration(ticks)));
+	m_market.Load(market);
+	investors.ReadList([this, &investors]()
+	{
+		TUserID id;
+		investors.Read(id);
+		GetInvestor(id).Load(investors);
+	});
+
+	for (auto &item: rules)
+		item.first->LoadState(item.second);
+	return true;
+}
+
+//Время, с которого нужны объекты для горизонта horizon с запасом lag; TDateTime::min() - вся история
+inline
+TDateTime GetReplayFrom(const TDateTime &end, TDateTime::duration horizon, TDateTime::duration lag)
+{
+	if (horizon > TDateTime::duration::max() - lag || end.time_since_epoch() < TDateTime::duration::min() + horizon + lag)
+		return TDateTime::min();
+
+	return end - horizon - lag;
+}
+
+TDateTime CRiskManager::StartReplay(const TDateTime &end)
+{
+	if (end == TDateTime::min())
+		return end;
+
+	SYS_LOCK(m_rules);
+	auto res = TDateTime::max();
+	for (auto &rule: m_rules)
+	{
+		if (!rule)
+			continue;
+
+		SReplayRule item{rule.get()};
+		item.m_quotes = GetReplayFrom(end, rule->GetQuoteHorizon(), m_cfg.sweep_lag);
+		item.m_trades = GetReplayFrom(end, rule->GetTradeHorizon(), m_cfg.sweep_lag);
+		item.m_orders = rule->GetOrderHorizon() > TDateTime::duration::zero()? GetReplayFrom(end, rule->GetOrderHorizon(), m_cfg.sweep_lag): TDateTime::max();
+		res = std::min({res, item.m_quotes, item.m_trades});
+
+		Log.Info("Replay horizon", rule->m_name, item.m_quotes, item.m_trades, item.m_orders);
+		m_replay.push_back(item);
+	}
+	return m_replay.empty()? TDateTime::min(): res;
+}
+
+void CRiskManager::FinishReplay()
+{
+	m_replay.clear();
+}
+
+void CRiskManager::ReplayDecision(const SOrder &order, const SVerdict &verdict)
+{
+	UpdateTime(order.m_time);
+	if (verdict.m_moratorium != TDateTime::min())
+		GetInvestor(order.m_user_id).SetMoratorium(order.m_symbol, verdict.m_moratorium);
+
+	//Отказ по мораторию инвестора: правила заявку не проверяли
+	if (!verdict && verdict.m_rule.empty())
+		return;
+
+	for (auto &item: m_replay)
+	{
+		if (!(order.m_time < item.GetFrom(order)))
+		{
+			try
+			{
+				item.m_rule->CCallbackPtrHolder<SOrder>::m_cb(order);
+			}
+			catch(const CCheckOrderError &)
+			{
+			}
+		}
+
+		if (item.m_rule->m_name == verdict.m_rule)
+			break;
+	}
 }
 
 
@@ -33,3 +331,211 @@ std::unique_ptr<COrderCheckRule> CRiskManager::CreateRule(const std::string &rul
 	return nullptr;
 }
 
+bool CRiskManager::ReloadRule(const std::string &name, const TS::CConfigFile &cfg)
+{
+	SYS_LOCK(m_rules);
+	auto it = std::find_if(m_rules.begin(), m_rules.end(), [&name](const auto &rule)
+	{
+		return rule && rule->m_name == name;
+	});
+
+	if (it == m_rules.end())
+		return false;
+
+	(*it)->Reload(cfg);
+	return true;
+}
+
+void CRiskManager::Reload(const TS::CConfigFile &cfg)
+{
+	std::set<std::string> names;
+	cfg.ForEachNode("rule", [this, &names](auto &&cfg)
+	{
+		auto name = cfg.template ReadValue<std::string>("id");
+		names.emplace(name);
+		if (!ReloadRule(name, cfg))
+			AddRule(name, cfg);
+	});
+
+	std::list<std::unique_ptr<COrderCheckRule>> removed;
+	{
+		SYS_LOCK(m_rules);
+		for (auto it = m_rules.begin(); it != m_rules.end(); )
+		{
+			auto &rule = *it;
+			if (names.empty()) //Правила заданы в main() по имени, узлов rule нет
+			{
+				if (rule)
+					rule->Reload(cfg);
+			}
+			else if (!rule || !names.count(rule->m_name))
+			{
+				removed.splice(removed.end(), m_rules, it++);
+				continue;
+			}
+			++it;
+		}
+	}
+
+	//Отписка ждёт завершения текущих вызовов правила, поэтому выполняется вне блокировки списка
+	for (auto &rule: removed)
+	{
+		if (!rule)
+			continue;
+
+		Log.Info("Remove rule", rule->m_name);
+		rule->Reset();
+	}
+
+	Log.Info("Rules reloaded", names.size(), removed.size());
+}
+
+void CRiskManager::CheckOrders(TS::span<const SOrder> orders, TS::span<SVerdict> verdicts)
+{
+	//Проверка заявки меняет только состояние по инструменту (окна PriceCheck) и по паре (инвестор, инструмент),
+	//поэтому заявки группируются по инструменту с сохранением исходного порядка внутри группы.
+	//Инвестор и его мораторий по инструменту ищутся один раз на группу.
+	std::vector<size_t> idx(orders.size());
+	std::iota(idx.begin(), idx.end(), 0);
+	std::stable_sort(idx.begin(), idx.end(), [&orders](size_t i1, size_t i2)
+	{
+		return orders[i1].m_symbol < orders[i2].m_symbol;
+	});
+
+	struct CGroupItem
+	{
+		const TUserID *m_user_id;
+		CInvestor *m_investor;
+		TDateTime m_moratorium;
+	};
+
+	const auto callbacks = TCallbackManager<SOrder>::GetCallbacks();
+	const auto decisions = TCallbackManager<SDecision>::GetCallbacks();
+
+	std::vector<CGroupItem> group;
+	const TSymbol *symbol = nullptr;
+	for (const auto i: idx)
+	{
+		const auto &order = orders[i];
+		auto &verdict = verdicts[i];
+		const auto tm = TS::CLatencyStats::TClock::now();
+		UpdateTime(order.m_time);
+
+		if (!symbol || *symbol != order.m_symbol)
+		{
+			symbol = &order.m_symbol;
+			group.clear();
+		}
+
+		auto it = std::find_if(group.begin(), group.end(), [&order](const auto &item)
+		{
+			return *item.m_user_id == order.m_user_id;
+		});
+
+		if (it == group.end())
+		{
+			TS_LATENCY_SCOPE(m_latency.m_Investor);
+			auto &investor = GetInvestor(order.m_user_id);
+			it = group.insert(it, CGroupItem{&order.m_user_id, &investor, investor.GetMoratorium(order.m_symbol)});
+		}
+
+		if (order.m_time < it->m_moratorium)
+			verdict.m_reject = verdict.m_reason = "Moratorium";
+		else
+		{
+			try
+			{
+				TS_LATENCY_SCOPE(m_latency.m_Check);
+				for (auto &cb: callbacks)
+					(*cb)(order);
+
+				verdict.m_reject.clear();
+			}
+			catch(const CCheckOrderError &err)
+			{
+				it->m_moratorium = it->m_investor->SetMoratorium(order, err);
+				verdict.SetReject(err, it->m_moratorium);
+			}
+		}
+
+		verdict.m_latency = TS::CLatencyStats::TClock::now() - tm;
+	}
+
+	if (decisions.empty())
+		return;
+
+	//Решения публикуются в порядке поступления заявок: журнал аудита не должен зависеть от группировки
+	for (size_t i = 0; i < orders.size(); ++i)
+	{
+		for (auto &cb: decisions)
+			(*cb)(SDecision{orders[i], verdicts[i]});
+	}
+}
+
+void CRiskManager::ProcessOrders(CTransport &trans, TS::span<const CMessage *const> msgs)
+{
+	TS_LATENCY_SCOPE(m_latency.m_Orders);
+	std::vector<SOrder> orders;
+	orders.reserve(msgs.size());
+	for (auto *msg: msgs)
+		orders.emplace_back(Parse<SOrder>(*msg));
+
+	std::vector<SVerdict> verdicts(msgs.size());
+	CheckOrders(orders, verdicts);
+
+	std::vector<CMessage::TAttrs> rejects;
+	rejects.reserve(msgs.size());
+
+	std::vector<const CMessage::TAttrs *> replies;
+	replies.reserve(msgs.size());
+	for (size_t i = 0; i < msgs.size(); ++i)
+	{
+		if (verdicts[i])
+			replies.emplace_back(&msgs[i]->m_attrs);
+		else
+		{
+			rejects.emplace_back(MakeReject(orders[i], msgs[i]->m_attrs, std::move(verdicts[i].m_reject)));
+			replies.emplace_back(&rejects.back());
+		}
+	}
+
+	TS_LATENCY_SCOPE(m_latency.m_Reply);
+	trans.SendMessages(replies);
+}
+
+static void FormatLatency(CMessage::TAttrs &dst, const std::string &name, const TS::CLatencyStats &stats)
+{
+	const auto data = stats.GetData();
+	if (!data.m_cnt)
+		return;
+
+	dst.emplace_back(name + ".cnt", TS::FormatStr(data.m_cnt));
+	dst.emplace_back(name + ".avg", TS::FormatStr(data.m_sum / data.m_cnt));
+	static const std::pair<const char *, double> _pcts[] = {{".p50", 50}, {".p90", 90}, {".p99", 99}, {".p999", 99.9}};
+	for (auto &pct: _pcts)
+		dst.emplace_back(name + pct.first, TS::FormatStr(data.GetPercentile(pct.second)));
+
+	dst.emplace_back(name + ".max", TS::FormatStr(data.m_max));
+}
+
+void CRiskManager::ProcessStats(CTransport &trans, const std::shared_ptr<const CMessage> &sp)
+{
+	auto attrs = sp->m_attrs;
+
+#define TS_ITEM(name) FormatLatency(attrs, #name, m_latency.m_##name);
+	RM_STAGES
+#undef TS_ITEM
+
+	SYS_LOCK(m_rules);
+	for (auto &rule: m_rules)
+	{
+		if (!rule)
+			continue;
+
+#define TS_ITEM(name) FormatLatency(attrs, rule->m_name + "." #name, rule->GetLatency<S##name>());
+		RM_OBJECTS
+#undef TS_ITEM
+	}
+
+	trans.SendMessage(attrs);
+}
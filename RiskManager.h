@@ -2,11 +2,20 @@
 #include "Common/Errors.h"
 #include "Common/CallbackManager.h"
 #include "Common/Config.h"
+#include "Common/ConcurrentMap.h"
+#include "Common/Span.h"
+#include "Common/Histogram.h"
+#include "Common/Rcu.h"
+#include "Common/TimerWheel.h"
+#include "Common/SeqLock.h"
+#include "Common/Thread.h"
 
 #include "Transport.h"
 
 #include <chrono>
+#include <functional>
 #include <unordered_map>
+#include <vector>
 
 #define RM_CHECK_ORDER_RULES \
 	TS_ITEM(NewOrderMoratorium) \
@@ -48,10 +57,23 @@
 	TS_ITEM(Trade) \
 	TS_ITEM(Order) \
 
+//Этапы обработки, по которым собираются задержки (Quote, Trade, Order - ProcessMessage соответствующего типа)
+#define RM_STAGES \
+	TS_ITEM(Parse) \
+	RM_OBJECTS \
+	TS_ITEM(Orders) \
+	TS_ITEM(Investor) \
+	TS_ITEM(Check) \
+	TS_ITEM(Reply) \
+	TS_ITEM(Commit) \
+	TS_ITEM(Durable) \
+
 namespace RM
 {
 class CRiskManager;
 class COrderCheckRule;
+namespace Snapshot {class CWriter; class CReader;}
+class CQuoteConflator;
 
 typedef std::string TSymbol;
 typedef std::string TUserID;
@@ -64,6 +86,7 @@ typedef std::chrono::system_clock::time_point TDateTime;
 typedef uintmax_t TRevNo;
 
 typedef std::pair<TPrice, TDateTime> TPriceTime;
+typedef TS::CTimerWheel<TDateTime> TTimerWheel;
 
 enum class TSide : char
 {
@@ -129,6 +152,87 @@ public:
 	}
 
 	std::chrono::seconds m_moratorium;
+	std::string m_rule;
+	std::string m_reason; //Код причины без подробностей
+};
+
+//Результат проверки заявки; пустая причина - заявка принята.
+//Для журнала аудита: отказавшее правило (пустое - отказ по мораторию инвестора) и код причины,
+//время проверки и конец моратория инвестора, если отказ его начал
+struct SVerdict
+{
+	explicit operator bool() const
+	{
+		return m_reject.empty();
+	}
+
+	void SetReject(const CCheckOrderError &err, const TDateTime &moratorium)
+	{
+		m_reject = err.what();
+		m_rule = err.m_rule;
+		m_reason = err.m_reason;
+		m_moratorium = moratorium;
+	}
+
+	std::string m_reject;
+	std::string m_rule;
+	std::string m_reason;
+	std::chrono::nanoseconds m_latency{0};
+	TDateTime m_moratorium = TDateTime::min();
+};
+
+//Заявка и решение по ней, передаются подписчикам (журналу аудита) без копирования
+struct SDecision
+{
+	const SOrder &m_order;
+	const SVerdict &m_verdict;
+};
+
+//Общие для правил рыночные данные: обновляются один раз на котировку до вызова правил.
+//Запись по инструменту упорядочена спинлоком слота, чтение - без блокировок через seqlock.
+class CMarketData
+{
+public:
+	struct SLastPrice
+	{
+		TPrice m_price;
+		TDateTime m_time;
+	};
+
+	//false, если по инструменту уже есть более поздняя котировка
+	bool PutQuote(const SQuote &quote)
+	{
+		auto &slot = *m_slots.insert_or_get(quote.m_symbol).first;
+		SYS_LOCK(slot.m_mx);
+		if (quote.m_time < slot.m_last.Load().m_time)
+			return false;
+
+		slot.m_last.Store(SLastPrice{quote.m_price, quote.m_time});
+		return true;
+	}
+
+	//Цена и время последней котировки; (0, TDateTime()), если котировок не было
+	TPriceTime GetLastPrice(const TSymbol &symbol) const
+	{
+		auto *slot = m_slots.find(symbol);
+		if (!slot)
+			return TPriceTime(0, TDateTime());
+
+		const auto last = slot->m_last.Load();
+		return TPriceTime(last.m_price, last.m_time);
+	}
+
+	void Save(Snapshot::CWriter &out) const;
+	void Load(Snapshot::CReader &in);
+
+protected:
+	struct CSlot
+	{
+		Sys::CSpinSharedMutex m_mx;
+		TS::CSeqLock<SLastPrice> m_last{SLastPrice{0, TDateTime()}};
+	};
+
+	TS::CConcurrentMap<TSymbol, CSlot> m_slots;
 };
 
 template <typename T>
@@ -137,6 +241,12 @@ struct CCallbackPtrHolder
 	TCallbackPtr<T> m_cb;
 };
 
+template <typename T>
+struct CLatencyStatsHolder
+{
+	TS::CLatencyStats m_latency;
+};
+
 
 template <typename TRiskManager = CRiskManager>
 class CObjectHandler
@@ -167,15 +277,36 @@ protected:
 	TRiskManager &m_rm;
 };
 
+//Ширина корзины окна frame (CBucketedSum): кольцо корзин выделяется сразу на каждый ключ,
+//поэтому корзин на окно не больше MaxBuckets; отрицательная ширина - окно без корзин
+inline
+std::chrono::milliseconds CheckBucket(const char *rule, std::chrono::milliseconds frame, std::chrono::milliseconds bucket)
+{
+	static constexpr size_t MaxBuckets = 4096;
+
+	auto res = std::max(bucket, std::chrono::milliseconds(0));
+	if (res.count() && size_t(frame / res) > MaxBuckets)
+		res = (frame + std::chrono::milliseconds(MaxBuckets - 1)) / MaxBuckets;
+
+	if (res != bucket)
+		Log.Warning("Bucket adjusted", rule, bucket.count(), res.count());
+	return res;
+}
+
 #define TS_CFG TS_CFG_(CheckRule)
 #define TS_CONFIG_ITEMS \
 	TS_ITEM(moratorium, std::chrono::seconds, 1min)
 
 #include "Common/Config.inl"
 
+//Замеры объявлены раньше CObjectHandler, чтобы разрушаться после отписки от объектов
 class COrderCheckRule
-: protected CObjectHandler<>
+: protected CLatencyStatsHolder<SQuote>
+, protected CLatencyStatsHolder<STrade>
+, protected CLatencyStatsHolder<SOrder>
+, protected CObjectHandler<>
 {
+friend class CRiskManager;
 public:
 	COrderCheckRule(CRiskManager &rm, const TS::CConfigFile &cfg)
 	: CObjectHandler(rm)
@@ -187,21 +318,90 @@ public:
 	{
 	}
 
+	//Каждый обработчик правила оборачивается замером задержки
+	template <typename T, typename... TT>
+	void RegisterCallback(TT&&... args)
+	{
+		CObjectHandler::RegisterCallback<T>([this, fn = TS::CFunction<void(const T &)>(std::forward<TT>(args)...)](const T &obj)
+		{
+			TS_LATENCY_SCOPE(CLatencyStatsHolder<T>::m_latency);
+			fn(obj);
+		});
+	}
+
+	template <typename T>
+	const TS::CLatencyStats &GetLatency() const
+	{
+		return CLatencyStatsHolder<T>::m_latency;
+	}
+
 	template <typename... TT>
 	void RejectOrder(const SOrder &order, const std::string &reason, TT&&... args)
 	{
-		CCheckOrderError::Raise(m_cfg.moratorium, reason, std::forward<TT>(args)...);
+		CCheckOrderError err(m_cfg->moratorium, reason, std::forward<TT>(args)...);
+		err.m_rule = m_name;
+		err.m_reason = reason;
+		throw err;
 	}
 
-	CheckRule::CConfig m_cfg;
+	//Публикация новых параметров без остановки проверок; накопленное состояние сохраняется.
+	//Пороги действуют сразу, длины окон - для окон, созданных после перезагрузки.
+	virtual void Reload(const TS::CConfigFile &cfg)
+	{
+		m_cfg.Publish(CheckRule::CConfig(cfg));
+	}
+
+	//Состояние правила в снимке (Snapshot.h). Ключ - версия раскладки и параметры, от которых она зависит (окна);
+	//пустой ключ - правило без состояния. Снимок, ключи которого не совпали с текущими правилами, не загружается.
+	virtual std::string GetStateKey() const
+	{
+		return std::string();
+	}
+
+	virtual void SaveState(Snapshot::CWriter &out)
+	{
+	}
+
+	virtual void LoadState(Snapshot::CReader &in)
+	{
+	}
+
+	//Глубина истории котировок и сделок, от которой зависит состояние правила: при загрузке журнала
+	//правилу передаются только объекты не старше его горизонта от конца журнала. По умолчанию - вся история.
+	virtual TDateTime::duration GetQuoteHorizon() const
+	{
+		return TDateTime::duration::max();
+	}
+
+	virtual TDateTime::duration GetTradeHorizon() const
+	{
+		return TDateTime::duration::max();
+	}
+
+	//То же для заявок из журнала аудита; по умолчанию состояние правила от заявок не зависит и они ему не передаются
+	virtual TDateTime::duration GetOrderHorizon() const
+	{
+		return TDateTime::duration::zero();
+	}
+
+	TS::CRcuValue<CheckRule::CConfig> m_cfg;
+
+protected:
+	std::string m_name;
 };
 
 template <typename T>
 std::unique_ptr<COrderCheckRule> CreateRule(CRiskManager &, const TS::CConfigFile &);
 
 
+//sweep_period: шаг фоновой очистки окон и мораториев (и шаг колеса таймеров), 0 - очистка только при чтении;
+//sweep_lag: очистка идёт по самому позднему времени данных минус sweep_lag, чтобы не задеть запаздывающие заявки
 #define TS_CFG TS_CFG_(RiskManager)
 #define TS_CONFIG_ITEMS \
+	TS_ITEM(conflate_quotes, bool, false) \
+	TS_ITEM(max_staleness, std::chrono::milliseconds, 1ms) \
+	TS_ITEM(sweep_period, std::chrono::milliseconds, 100ms) \
+	TS_ITEM(sweep_lag, std::chrono::milliseconds, 1s) \
 
 #include "Common/Config.inl"
 
@@ -212,32 +412,71 @@ class CRiskManager
 , protected TCallbackManager<SQuote>
 , protected TCallbackManager<STrade>
 , protected TCallbackManager<SOrder>
+, protected TCallbackManager<SDecision>
 {
 public:
 	struct CInvestor
 	{
-		void SetMoratorium(const SOrder &order, const CCheckOrderError &err)
+		CInvestor(TTimerWheel &wheel)
+		: m_expiry(wheel, [this](const TDateTime &tm)
 		{
-			SYS_LOCK_WRITE(m_mx);
-			const auto tm = order.m_time + err.m_moratorium;
+			return EraseExpired(tm);
+		})
+		{
+		}
+
+		TDateTime SetMoratorium(const SOrder &order, const CCheckOrderError &err)
+		{
+			return SetMoratorium(order.m_symbol, order.m_time + err.m_moratorium);
+		}
 
-			auto it = m_moratorium.find(order.m_symbol);
+		TDateTime SetMoratorium(const TSymbol &symbol, const TDateTime &tm)
+		{
+			SYS_LOCK_WRITE(m_mx);
+			auto it = m_moratorium.find(symbol);
 			if (it == m_moratorium.end())
-				m_moratorium.emplace(order.m_symbol, tm);
+				m_moratorium.emplace(symbol, tm);
 			else
 				it->second = tm;
+
+			m_expiry.Schedule(tm);
+			return tm;
+		}
+
+		//Удаление истёкших мораториев, возвращает ближайший срок оставшихся
+		TDateTime EraseExpired(const TDateTime &tm)
+		{
+			SYS_LOCK_WRITE(m_mx);
+			auto res = TDateTime::max();
+			for (auto it = m_moratorium.begin(); it != m_moratorium.end(); )
+			{
+				if (it->second <= tm)
+					it = m_moratorium.erase(it);
+				else
+					res = std::min(res, (it++)->second);
+			}
+			return res;
 		}
 
 
 		bool IsMoratorium(const SOrder &order) const
+		{
+			return order.m_time < GetMoratorium(order.m_symbol);
+		}
+
+		TDateTime GetMoratorium(const TSymbol &symbol) const
 		{
 			SYS_LOCK_READ(m_mx);
-			auto it = m_moratorium.find(order.m_symbol);
-			return it != m_moratorium.end() && order.m_time < it->second;
+			auto it = m_moratorium.find(symbol);
+			return it != m_moratorium.end()? it->second: TDateTime::min();
 		}
 
+		void Save(Snapshot::CWriter &out) const;
+		void Load(Snapshot::CReader &in);
+
 		mutable std::shared_mutex m_mx;
 		std::unordered_map<TSymbol, TDateTime> m_moratorium;
+		TTimerWheel::CTimer m_expiry;
 
 		//TDateTime m_moratorium{TDateTime::min()};
 	};
@@ -248,24 +487,88 @@ public:
 	void AddRule(const std::string &name, const TS::CConfigFile &cfg)
 	{
 		auto sp = CreateRule(name, cfg);
+		if (sp)
+			sp->m_name = name;
+
+		SYS_LOCK(m_rules);
 		m_rules.emplace_back(std::move(sp));
 	}
 
+	//Перезагрузка настроек правил. Если в cfg есть узлы rule, набор правил приводится к ним:
+	//правила с тем же id получают новые параметры с сохранением состояния, новые создаются, отсутствующие удаляются.
+	//Проверки заявок при этом не останавливаются.
+	void Reload(const TS::CConfigFile &cfg);
+
 	template <typename T, typename TFunc, typename... TT>
 	auto RegisterCallback(TFunc &&func, TT&&... args)
 	{
 		return TCallbackManager<T>::RegisterCallback(std::forward<TFunc>(func), std::forward<TT>(args)...);
 	}
 
+	//Котировки в порядке поступления, до прореживания (журнал); без прореживания - то же, что RegisterCallback<SQuote>
+	template <typename TFunc, typename... TT>
+	auto RegisterReceivedQuote(TFunc &&func, TT&&... args)
+	{
+		if (!m_conflator)
+			return RegisterCallback<SQuote>(std::forward<TFunc>(func), std::forward<TT>(args)...);
+
+		return m_received.RegisterCallback(std::forward<TFunc>(func), std::forward<TT>(args)...);
+	}
+
 	template <typename T>
 	void PutObject(const T &obj)
 	{
+		SYS_LOCK_READ(m_cut);
+		UpdateTime(obj.m_time);
+		UpdateMarketData(obj);
 		TCallbackManager<T>::ForEachCallback2(obj);
 	}
 
+	//Заявки не ждут снимка состояния
+	void PutObject(const SOrder &order)
+	{
+		UpdateTime(order.m_time);
+		TCallbackManager<SOrder>::ForEachCallback2(order);
+	}
+
+	void PutDecision(const SOrder &order, const SVerdict &verdict)
+	{
+		TCallbackManager<SDecision>::ForEachCallback2(SDecision{order, verdict});
+	}
+
+	void UpdateMarketData(const SQuote &quote)
+	{
+		m_market.PutQuote(quote);
+	}
+
+	template <typename T>
+	void UpdateMarketData(const T &obj)
+	{
+	}
+
+	const CMarketData &GetMarketData() const
+	{
+		return m_market;
+	}
+
+	//Самое позднее время принятых объектов; гонка между потоками допустима - её покрывает sweep_lag
+	void UpdateTime(const TDateTime &tm)
+	{
+		const auto ticks = tm.time_since_epoch().count();
+		if (m_time.load(std::memory_order_relaxed) < ticks)
+			m_time.store(ticks, std::memory_order_relaxed);
+	}
+
+	//Колесо фоновой очистки: правила ставят на него таймеры окон и прочего устаревающего состояния
+	TTimerWheel &GetExpiry()
+	{
+		return m_expiry;
+	}
+
 	template <typename T>
 	void ProcessMessage(CTransport &trans, const CMessage &msg) //Quote, Trade
 	{
+		TS_LATENCY_SCOPE(GetLatency<T>());
 		auto obj = Parse<T>(msg);
 		PutObject(obj);
 	}
@@ -276,58 +579,182 @@ public:
 		ProcessMessage<T>(trans, *sp);
 	}
 
-	CInvestor &GetInvestor(const TUserID &id)
+	//Проверка пачки заявок, результат эквивалентен последовательной обработке в том же порядке
+	void CheckOrders(TS::span<const SOrder> orders, TS::span<SVerdict> verdicts);
+
+	//Проверка пачки заявок с отправкой всех ответов одной записью
+	void ProcessOrders(CTransport &trans, TS::span<const CMessage *const> msgs);
+
+	//Восстановление из журнала: котировки идут мимо прореживания, чтобы сохранить порядок со сделками
+	template <typename T>
+	void ReplayMessage(CTransport &trans, const CMessage &msg)
+	{
+		ProcessMessage<T>(trans, msg);
+	}
+
+	//То же для объектов, уже разобранных из двоичного журнала.
+	//Между StartReplay и FinishReplay объект получают только правила, в горизонт которых он попадает.
+	template <typename T>
+	void ReplayObject(const T &obj)
 	{
-		auto res = Sys::Locked::Emplace(id, m_investors, []()
+		if (m_replay.empty())
+			return PutObject(obj);
+
+		UpdateTime(obj.m_time);
+		UpdateMarketData(obj);
+		for (auto &item: m_replay)
 		{
-			return std::make_unique<CInvestor>();
-		});
-		return *res.first->second;
+			if (!(obj.m_time < item.GetFrom(obj)))
+				item.m_rule->CCallbackPtrHolder<T>::m_cb(obj);
+		}
+	}
+
+	//Загрузка журнала с концом end: горизонты правил (с запасом sweep_lag) переводятся во время, с которого правилу нужны объекты.
+	//Возвращает самое раннее из этих времён для котировок и сделок - более старые объекты не нужны ни одному правилу.
+	TDateTime StartReplay(const TDateTime &end);
+	void FinishReplay();
+
+	//Восстановление по журналу аудита: мораторий инвестора, начатый отказом, и состояние правил, зависящее от заявок.
+	//Заявка передаётся правилам в горизонте заявок (после StartReplay), которые она прошла при проверке, до отказавшего включительно.
+	void ReplayDecision(const SOrder &order, const SVerdict &verdict);
+
+	//Снимок состояния без остановки проверки заявок: котировки и сделки ждут, пока состояние пишется в буфер.
+	//cut вызывается первым, когда все принятые до снимка объекты уже прошли обработчики (метка снимка в журнале).
+	void SaveSnapshot(Snapshot::CWriter &out, const std::function<void()> &cut);
+
+	//false - разделы снимка не совпали с текущими правилами, состояние не менялось
+	bool LoadSnapshot(Snapshot::CReader in);
+
+	//Ответ на Stats: атрибуты запроса плюс счётчик, среднее и перцентили задержек (нс) по этапам и по обработчикам правил
+	void ProcessStats(CTransport &trans, const std::shared_ptr<const CMessage> &sp);
+
+	template <typename T>
+	TS::CLatencyStats &GetLatency();
+
+	struct SLatency
+	{
+#define TS_ITEM(name) TS::CLatencyStats m_##name;
+		RM_STAGES
+#undef TS_ITEM
+	} m_latency;
+
+	CInvestor &GetInvestor(const TUserID &id)
+	{
+		return *m_investors.insert_or_get(id, m_expiry).first;
 	}
 
 protected:
 
 	std::unique_ptr<COrderCheckRule> CreateRule(const std::string &rule, const TS::CConfigFile &cfg);
 
-	std::list<std::unique_ptr<COrderCheckRule>> m_rules;
-	Sys::CLockedObject<std::unordered_map<TUserID, std::unique_ptr<CInvestor>>, std::shared_mutex> m_investors;
+	bool ReloadRule(const std::string &name, const TS::CConfigFile &cfg);
+
+	void SweepThreadProc(Sys::CThreadControl &thread);
 
+	struct SReplayRule
+	{
+		const TDateTime &GetFrom(const SQuote &) const
+		{
+			return m_quotes;
+		}
 
+		const TDateTime &GetFrom(const STrade &) const
+		{
+			return m_trades;
+		}
+
+		const TDateTime &GetFrom(const SOrder &) const
+		{
+			return m_orders;
+		}
+
+		COrderCheckRule *m_rule;
+		TDateTime m_quotes;
+		TDateTime m_trades;
+		TDateTime m_orders;
+	};
+
+	mutable std::shared_mutex m_cut; //Котировки и сделки - общий доступ, снимок состояния - исключительный
+	std::atomic<TDateTime::rep> m_time{TDateTime::min().time_since_epoch().count()};
+	TTimerWheel m_expiry; //Разрушается после правил и инвесторов, владеющих таймерами
+	Sys::CLockedObject<std::list<std::unique_ptr<COrderCheckRule>>, std::mutex> m_rules;
+	TS::CConcurrentMap<TUserID, CInvestor> m_investors;
+	CMarketData m_market;
+
+	std::unique_ptr<CQuoteConflator> m_conflator;
+	TCallbackManager<SQuote> m_received; //Подписчики котировок до прореживания
+	std::vector<SReplayRule> m_replay; //Только на время загрузки журнала
+	Sys::CThread m_sweeper;
 };
 
+#define TS_ITEM(name) template <> inline TS::CLatencyStats &CRiskManager::GetLatency<S##name>() {return m_latency.m_##name;}
+RM_OBJECTS
+#undef TS_ITEM
+
+template <> void CRiskManager::ProcessMessage<SQuote>(CTransport &trans, const CMessage &msg);
+template <> void CRiskManager::ReplayMessage<SQuote>(CTransport &trans, const CMessage &msg);
+
 inline
-void SendReject(CTransport &trans, const SOrder &order, CMessage::TAttrs attrs, std::string reason)
+CMessage::TAttrs MakeReject(const SOrder &order, CMessage::TAttrs attrs, std::string reason)
 {
 	Log.Debug("REJECT", order.m_time, order.m_order_id, order.m_symbol, order.m_user_id, reason);
 	attrs.emplace_back("reject"s, std::move(reason));
-	trans.SendMessage(attrs);
+	return attrs;
+}
+
+inline
+void SendReject(CTransport &trans, const SOrder &order, const CMessage::TAttrs &attrs, std::string reason)
+{
+	trans.SendMessage(MakeReject(order, attrs, std::move(reason)));
 }
 
 template <> inline
 void CRiskManager::ProcessMessage<SOrder>(CTransport &trans, const CMessage &msg)
 {
+	TS_LATENCY_SCOPE(m_latency.m_Order);
+	const auto tm = TS::CLatencyStats::TClock::now();
 	const auto &order = Parse<SOrder>(msg);
+	SVerdict verdict;
 
+	auto &investor = [&]() -> CInvestor &
+	{
+		TS_LATENCY_SCOPE(m_latency.m_Investor);
+		return GetInvestor(order.m_user_id);
+	}();
 
-	auto &investor = GetInvestor(order.m_user_id);
 	if (investor.IsMoratorium(order))
 	{
-		SendReject(trans, order, msg.m_attrs, "Moratorium");
+		verdict.m_reject = verdict.m_reason = "Moratorium";
+		verdict.m_latency = TS::CLatencyStats::TClock::now() - tm;
+		PutDecision(order, verdict);
+
+		TS_LATENCY_SCOPE(m_latency.m_Reply);
+		SendReject(trans, order, msg.m_attrs, std::move(verdict.m_reject));
 		return;
 	}
 
 	try
 	{
-		PutObject(order);
+		{
+			TS_LATENCY_SCOPE(m_latency.m_Check);
+			PutObject(order);
+		}
+		verdict.m_latency = TS::CLatencyStats::TClock::now() - tm;
+		PutDecision(order, verdict);
 
 		//Log.Debug(order.m_time, order.m_order_id, order.m_symbol, order.m_user_id);
+		TS_LATENCY_SCOPE(m_latency.m_Reply);
 		trans.SendMessage(msg.m_attrs);
 		return;
 	}
 	catch(const CCheckOrderError &err)
 	{
-		investor.SetMoratorium(order, err);
-		SendReject(trans, order, msg.m_attrs, err.what());
+		verdict.SetReject(err, investor.SetMoratorium(order, err));
+		verdict.m_latency = TS::CLatencyStats::TClock::now() - tm;
+		PutDecision(order, verdict);
+
+		TS_LATENCY_SCOPE(m_latency.m_Reply);
+		SendReject(trans, order, msg.m_attrs, std::move(verdict.m_reject));
 	}
 }
 
@@ -0,0 +1,182 @@
+#pragma once
+#include "RiskManager.h"
+#include "Common/Crc32.h"
+
+#include <string>
+#include <type_traits>
+
+namespace RM
+{
+//Снимок состояния для быстрого перезапуска.
+//Файл: заголовок (Magic, Version, id, длина и CRC-32C тела), тело.
+//Тело пишет CRiskManager::SaveSnapshot: общее состояние и разделы правил (имя, ключ состояния, длина, данные).
+//Значения пишутся как есть в порядке байт машины: снимок читается той же сборкой на той же платформе.
+namespace Snapshot
+{
+static const uint32_t Magic = 0x534d5231; //RMS1
+static const uint16_t Version = 1;
+
+class CError
+: public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+class CWriter
+{
+public:
+	template <typename T>
+	void Write(const T &val)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Snapshot::CWriter::Write");
+		m_buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+	}
+
+	void Write(const std::string &val)
+	{
+		Write(uint32_t(val.size()));
+		m_buf.append(val);
+	}
+
+	//func пишет элементы и возвращает их число, оно ставится перед элементами
+	template <typename TFunc>
+	void WriteList(TFunc &&func)
+	{
+		const size_t pos = m_buf.size();
+		Write(uint32_t(0));
+		const auto n = uint32_t(func());
+		std::memcpy(&m_buf[pos], &n, sizeof(n));
+	}
+
+	//Раздел с длиной, чтобы читатель мог его пропустить
+	template <typename TFunc>
+	void WriteSection(TFunc &&func)
+	{
+		const size_t pos = m_buf.size();
+		Write(uint64_t(0));
+		func();
+		const uint64_t size = m_buf.size() - pos - sizeof(uint64_t);
+		std::memcpy(&m_buf[pos], &size, sizeof(size));
+	}
+
+	std::string &GetBuffer()
+	{
+		return m_buf;
+	}
+
+protected:
+	std::string m_buf;
+};
+
+//Чтение с исключением CError при выходе за границу
+class CReader
+{
+public:
+	CReader(const char *data, size_t size)
+	: m_cur(data)
+	, m_end(data + size)
+	{
+	}
+
+	template <typename T>
+	void Read(T &dst)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Snapshot::CReader::Read");
+		std::memcpy(&dst, Get(sizeof(T)), sizeof(T));
+	}
+
+	void Read(std::string &dst)
+	{
+		uint32_t size;
+		Read(size);
+		dst.assign(Get(size), size);
+	}
+
+	template <typename T>
+	T Read()
+	{
+		T res;
+		Read(res);
+		return res;
+	}
+
+	template <typename TFunc>
+	void ReadList(TFunc &&func)
+	{
+		for (auto n = Read<uint32_t>(); n; --n)
+			func();
+	}
+
+	//Раздел WriteSection как отдельный читатель
+	CReader ReadSection()
+	{
+		const auto size = Read<uint64_t>();
+		return CReader(Get(size), size);
+	}
+
+	const char *GetData() const
+	{
+		return m_cur;
+	}
+
+	size_t GetSize() const
+	{
+		return m_end - m_cur;
+	}
+
+protected:
+	const char *Get(size_t size)
+	{
+		if (size_t(m_end - m_cur) < size)
+			throw CError("Snapshot: unexpected end of data");
+
+		const char *res = m_cur;
+		m_cur += size;
+		return res;
+	}
+
+	const char *m_cur;
+	const char *m_end;
+};
+
+//Заголовок файла перед телом снимка; id совпадает с меткой снимка в журнале (Journal::SSnapshotMark)
+inline
+std::string MakeHeader(uint64_t id, const std::string &body)
+{
+	CWriter out;
+	out.Write(Magic);
+	out.Write(Version);
+	out.Write(id);
+	out.Write(uint64_t(body.size()));
+	out.Write(TS::CCrc32c::Calc(body.data(), body.size()));
+	return std::move(out.GetBuffer());
+}
+
+//Проверка заголовка и CRC тела; false - файл повреждён или другой версии
+inline
+bool ParseFile(const std::string &data, uint64_t &id, CReader &body)
+{
+	try
+	{
+		CReader in(data.data(), data.size());
+		if (in.Read<uint32_t>() != Magic || in.Read<uint16_t>() != Version)
+			return false;
+
+		in.Read(id);
+		const auto size = in.Read<uint64_t>();
+		const auto crc = in.Read<uint32_t>();
+		if (in.GetSize() != size || TS::CCrc32c::Calc(in.GetData(), size) != crc)
+			return false;
+
+		body = in;
+		return true;
+	}
+	catch(const CError &)
+	{
+		return false;
+	}
+}
+
+}
+}
@@ -3,12 +3,21 @@
 
 #include "Common/Parser.h"
 #include "Common/FramedQueue.h"
+#include "Common/MappedFile.h"
 
 #include "Transport.h"
+#include "Snapshot.h"
+#include "Archive.h"
 
+#include <algorithm>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <set>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 
 namespace RM
 {
@@ -27,25 +36,346 @@ RM_SAVE_OBJECT(Order){RM_ORDER;}
 
 using namespace RM;
 
+//Часть журнала для параллельного разбора при загрузке
+static const size_t LoadChunk = 4 * 1024 * 1024;
+
+inline
+TDateTime GetTime(const Journal::SSnapshotMark &)
+{
+	return TDateTime::min();
+}
+
+template <typename T> inline
+TDateTime GetTime(const T &obj)
+{
+	return obj.m_time;
+}
+
+//func вызывается с разбором двоичного журнала (Journal::CReader) или его архива (Archive::CReader)
+template <typename TFunc> inline
+void ReadJournal(const fs::path &file_name, const TS::CMappedFile &file, TFunc &&func)
+{
+	if (file_name.extension() == ".rm_arch")
+		func(Archive::CReader(file.data(), file.size()));
+	else
+		func(Journal::CReader(file.data(), file.size()));
+}
+
+//Время самого позднего объекта журнала: ищется с конца последнего файла, в котором есть котировки или сделки
+inline
+TDateTime GetJournalEnd(const std::set<fs::path> &files)
+{
+	for (auto it = files.rbegin(); it != files.rend(); ++it)
+	{
+		if (it->extension() == ".rm_save")
+			continue;
+
+		const TS::CMappedFile file(it->native());
+		auto res = TDateTime::min();
+		ReadJournal(*it, file, [&res](auto &&reader)
+		{
+			auto chunks = reader.Split(LoadChunk);
+			for (auto chunk = chunks.rbegin(); chunk != chunks.rend() && res == TDateTime::min(); ++chunk)
+			{
+				chunk->ForEach([&res](const auto &obj)
+				{
+					res = std::max(res, GetTime(obj));
+				});
+			}
+		});
+
+		if (res != TDateTime::min())
+			return res;
+	}
+	return TDateTime::min();
+}
+
 void CStorage::Load()
 {
 	if (!fs::exists(m_cfg.dir) || !fs::is_directory(m_cfg.dir))
 		return;
 
-	std::set<fs::path> files;
+	LoadIndex();
+
+	std::set<fs::path> files, audit;
 	for(auto &item: fs::directory_iterator(m_cfg.dir))
 	{
-		if (fs::is_regular_file(item.status()) && item.path().extension() == ".rm_save")
+		const auto ext = item.path().extension();
+		if (!fs::is_regular_file(item.status()))
+			continue;
+
+		if (ext == ".rm_save" || ext == ".rm_jrnl" || ext == ".rm_arch")
 			files.emplace(item.path());
+		else if (ext == ".rm_audit")
+			audit.emplace(item.path());
 	}
 
-#define TS_ITEM(name) {#name##s, &CRiskManager::ProcessMessage<S##name>},
+	//Архив заменяет файл журнала переименованием, и журнал удаляется после: при остановке между ними журнал лишний
+	for (auto it = files.begin(); it != files.end(); )
+	{
+		if (it->extension() == ".rm_jrnl" && files.count(fs::path(*it).replace_extension(".rm_arch")))
+		{
+			Log.Info("Delete archived save file", *it, ::remove(it->c_str()), errno);
+			it = files.erase(it);
+		}
+		else
+			++it;
+	}
+
+#define TS_ITEM(name) {#name##s, &CRiskManager::ReplayMessage<S##name>},
 	THandlers handlers = {RM_OBJECTS};
 #undef TS_ITEM
 
-	Log.Info("Load files...", files.size());
+	//Со снимком загружается только хвост журнала после его метки
+	fs::path journal;
+	if (LoadSnapshot(files, journal))
+	{
+		for (auto it = files.begin(); it != files.end() && *it < journal; )
+		{
+			ExpireFile(*it);
+			it = files.erase(it);
+		}
+	}
+
+	//Без снимка правилам передаются только объекты в их горизонтах от конца журнала, части журнала старше всех горизонтов не читаются
+	if (!m_mark)
+		m_from = m_rm.StartReplay(GetJournalEnd(files));
+
+	Log.Info("Load files...", files.size(), m_from);
+	for (auto &item: files)
+		TS_NOEXCEPT(item.extension() == ".rm_save"? LoadFile(item, handlers): LoadJournal(item));
+
+	m_rm.FinishReplay();
+	m_from = TDateTime::min();
+
+	LoadAudit(audit);
+}
+
+//Время самого позднего решения: ищется с конца последнего файла аудита, в котором они есть
+inline
+TDateTime GetAuditEnd(const std::set<fs::path> &files)
+{
+	for (auto it = files.rbegin(); it != files.rend(); ++it)
+	{
+		const TS::CMappedFile file(it->native());
+		auto res = TDateTime::min();
+		Journal::CReader(file.data(), file.size()).ForEach([](const auto &) {}, [&res](const Journal::SAudit &audit)
+		{
+			res = std::max(res, audit.m_order.m_time);
+		});
+
+		if (res != TDateTime::min())
+			return res;
+	}
+	return TDateTime::min();
+}
+
+//Решения повторно применимы: моратории и время последней заявки у правил только сдвигаются вперёд,
+//поэтому журнал аудита читается целиком и со снимком состояния
+void CStorage::LoadAudit(const std::set<fs::path> &files)
+{
+	m_rm.StartReplay(GetAuditEnd(files));
 	for (auto &item: files)
-		TS_NOEXCEPT(LoadFile(item, handlers));
+	{
+		ExpireFile(item);
+		const auto tm = std::chrono::system_clock::now();
+		const TS::CMappedFile file(item.native());
+		Journal::CReader reader(file.data(), file.size());
+		const auto n = reader.ForEach([](const auto &) {}, [this](const Journal::SAudit &audit)
+		{
+			m_rm.ReplayDecision(audit.m_order, audit.m_verdict);
+		});
+
+		if (!reader.IsComplete())
+			Log.Warning("RiskManager::LoadAudit: broken tail", item, reader.GetSize(), file.size());
+		Log.Info("RiskManager::LoadAudit", item, n, std::chrono::system_clock::now() - tm);
+	}
+	m_rm.FinishReplay();
+}
+
+inline
+std::string ReadFile(const std::string &name)
+{
+	std::string res;
+	std::ifstream in(name, std::ifstream::binary);
+	in.seekg(0, std::ios::end);
+	res.resize(std::max<std::streamoff>(in.tellg(), 0));
+	in.seekg(0);
+	in.read(&res[0], res.size());
+	res.resize(in.gcount());
+	return res;
+}
+
+inline
+std::string GetSnapshotName(const std::string &dir)
+{
+	return TS::FormatStr<0>(dir, '/', program_invocation_short_name, ".rm_snap");
+}
+
+inline
+bool IsMark(const Journal::SSnapshotMark &mark, uint64_t id)
+{
+	return mark.m_id == id;
+}
+
+template <typename T> inline
+bool IsMark(const T &, uint64_t)
+{
+	return false;
+}
+
+//Снимок берётся, только если его метка есть в журнале: иначе неизвестно, с какого места догружать.
+//Ошибка при загрузке уже проверенного снимка в CRiskManager не исправить полной загрузкой журнала, она прерывает запуск.
+bool CStorage::LoadSnapshot(const std::set<fs::path> &files, fs::path &journal)
+{
+	const auto name = GetSnapshotName(m_cfg.dir);
+	if (!fs::exists(name))
+		return false;
+
+	const auto tm = std::chrono::system_clock::now();
+	const auto data = ReadFile(name);
+	uint64_t id = 0;
+	Snapshot::CReader body(nullptr, 0);
+	if (!Snapshot::ParseFile(data, id, body))
+	{
+		Log.Warning("Snapshot: broken file", name);
+		return false;
+	}
+
+	for (auto it = files.rbegin(); it != files.rend() && journal.empty(); ++it)
+	{
+		if (it->extension() == ".rm_save")
+			continue;
+
+		const TS::CMappedFile file(it->native());
+		bool found = false;
+		ReadJournal(*it, file, [&found, id](auto &&reader)
+		{
+			reader.ForEach([&found, id](const auto &obj)
+			{
+				found |= IsMark(obj, id);
+			});
+		});
+
+		if (found)
+			journal = *it;
+	}
+
+	if (journal.empty())
+	{
+		Log.Warning("Snapshot: mark not found in journal", name, id);
+		return false;
+	}
+
+	if (!m_rm.LoadSnapshot(body))
+		return false;
+
+	m_mark = id;
+	Log.Info("Snapshot loaded", name, journal, body.GetSize(), std::chrono::system_clock::now() - tm);
+	return true;
+}
+
+//Журнал или архив отображается в память и делится на части по границам записей или блоков. Части разбираются параллельно
+//(не больше load_threads одновременно), а применяются по порядку в этом потоке, пока разбираются следующие.
+//Части, все объекты которых старше горизонтов правил (m_from), не разбираются.
+template <typename TReader>
+void CStorage::LoadChunks(const std::string &name, std::vector<TReader> chunks, size_t size)
+{
+	const auto tm = std::chrono::system_clock::now();
+
+	//Части старше горизонтов не разбираются, но проверяются: после повреждения не применяется ничего
+	std::vector<bool> skip(chunks.size());
+	size_t loaded = 0;
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		skip[i] = chunks[i].GetTimeRange().second < m_from;
+		loaded += !skip[i];
+	}
+
+	const size_t threads = m_cfg.load_threads? m_cfg.load_threads: std::max(std::thread::hardware_concurrency(), 1u);
+
+	//Ячеек на одну больше, чем разбираемых частей: та, что применяется, не занята разбором
+	std::vector<Journal::SBatch> batches(threads + 1);
+	std::deque<std::future<void>> pending;
+	auto decode = [&chunks, &skip, &batches, &pending](size_t i)
+	{
+		auto &batch = batches[i % batches.size()];
+		batch.clear();
+		pending.push_back(std::async(std::launch::async, [&reader = chunks[i], &batch, skip = bool(skip[i])]()
+		{
+			if (skip)
+				return reader.Verify();
+
+			reader.ForEach([&batch](auto &obj)
+			{
+				batch.Put(obj);
+			});
+		}));
+	};
+
+	size_t n = 0;
+	for (size_t i = 0; i < std::min(threads, chunks.size()); ++i)
+		decode(i);
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		pending.front().get();
+		pending.pop_front();
+
+		//После повреждённой записи следующие части не применяются
+		const bool complete = chunks[i].IsComplete();
+		if (complete && i + threads < chunks.size())
+			decode(i + threads);
+
+		const auto &batch = batches[i % batches.size()];
+		batch.ForEach([this](const auto &obj)
+		{
+			Replay(obj);
+		});
+		n += batch.m_quotes.size() + batch.m_trades.size();
+
+		if (!complete)
+		{
+			Log.Warning("RiskManager::LoadJournal: broken tail", name, chunks[i].GetSize(), size);
+			break;
+		}
+	}
+
+	for (auto &item: pending)
+		item.wait();
+
+	Log.Info("RiskManager::LoadJournal", name, n, loaded, chunks.size(), std::chrono::system_clock::now() - tm);
+}
+
+void CStorage::LoadJournal(const fs::path &file_name)
+{
+	auto name = file_name.native();
+	ExpireFile(file_name);
+
+	//По оглавлению файл целиком старше горизонтов правил
+	{
+		SYS_LOCK(m_index);
+		auto it = m_index.find(file_name.filename().native());
+		if (it != m_index.end() && it->second.m_last < m_from)
+		{
+			Log.Info("RiskManager::LoadJournal: skip", name, it->second.m_last, it->second.m_count);
+			return;
+		}
+	}
+
+	const TS::CMappedFile file(name);
+	ReadJournal(file_name, file, [this, &name, &file](auto &&reader)
+	{
+		LoadChunks(name, reader.Split(LoadChunk), file.size());
+	});
+}
+
+//Файлы вне оглавления (текстовые, прежних версий, недописанный после аварийной остановки) удаляются по времени изменения
+void CStorage::ExpireFile(const fs::path &file_name)
+{
+	SYS_LOCK(m_index);
+	if (!m_index.count(file_name.filename().native()))
+		m_remove.PutValue(fs::last_write_time(file_name), file_name.native());
 }
 
 void CStorage::LoadFile(const fs::path &file_name, const THandlers &handlers)
@@ -89,54 +419,617 @@ void CStorage::LoadFile(const fs::path &file_name, const THandlers &handlers)
 	}
 
 	Log.Info("RiskManager::LoadFile", name, n, std::chrono::system_clock::now() - tm);
-	m_remove.PutValue(fs::last_write_time(file_name), file_name);
+	ExpireFile(file_name);
 }
 
 inline
-std::string GetFileName(const std::string &dir, auto now)
+std::string GetFileName(const std::string &dir, auto now, const char *ext)
 {
 	std::stringstream stm;
 
 	TS::FormatVals<0>(stm, dir, '/', program_invocation_short_name, '.');
 	TS::FormatVal(stm, std::chrono::system_clock::time_point(now), "%y%m%d-%H");
-	TS::FormatVals<0>(stm, ".rm_save");
+	TS::FormatVals<0>(stm, ext);
 
 	return stm.str();
 }
 
+inline
+std::string GetFileName(const std::string &dir, auto now, bool binary)
+{
+	return GetFileName(dir, now, binary? ".rm_jrnl": ".rm_save");
+}
+
+inline
+bool WriteFile(int fd, const std::string &buf)
+{
+	for (size_t pos = 0; pos < buf.size(); )
+	{
+		const auto res = ::write(fd, buf.data() + pos, buf.size() - pos);
+		if (res < 0 && errno == EINTR)
+			continue;
+
+		if (res <= 0)
+		{
+			Log.Error("Write file error", errno);
+			return false;
+		}
+		pos += res;
+	}
+	return true;
+}
+
+//Недописанный хвост журнала (аварийная остановка) отрезается, дальше пишется новый сегмент со своими словарями.
+//Двоичный журнал пишется через отображение, дескриптор его файла нужен только для fdatasync.
+int CStorage::OpenFile(const std::string &file_name, const TDateTime &tm)
+{
+	if (!m_cfg.binary)
+	{
+		const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+		if (fd < 0)
+			Log.Error("Can't open save file", file_name, errno);
+		return fd;
+	}
+
+	m_segment = Journal::SSegmentInfo();
+	m_segment.m_name = fs::path(file_name).filename().native();
+	{
+		SYS_LOCK(m_index);
+		m_index.erase(m_segment.m_name);
+	}
+
+	if (m_next && m_next_name == file_name)
+		m_file = std::move(m_next);
+	else
+	{
+		const TS::CMappedFile file(file_name);
+		Journal::CReader reader(file.data(), file.size());
+		reader.ForEach([this](const auto &obj)
+		{
+			m_segment.Put(obj);
+		});
+
+		if (!reader.IsComplete())
+			Log.Warning("Truncate broken journal tail", file_name, reader.GetSize(), file.size());
+
+		m_segment.Append(file.data(), reader.GetSize());
+		m_file.reset(new TS::CMappedWriter(file_name, reader.GetSize(), m_cfg.segment_size));
+	}
+
+	if (!m_file->IsOpen())
+		Log.Error("Can't open save file", file_name, errno);
+
+	m_journal.Start(tm);
+	if (m_tail && !m_tail->Open(m_segment.m_name, m_file->size()))
+	{
+		Log.Warning("Tail is not published: journal file name is too long", m_segment.m_name);
+		m_tail.reset();
+	}
+	return m_file->fd();
+}
+
+//Закрытый файл двоичного журнала обрезается до записанного и попадает в оглавление
+void CStorage::CloseFile(int fd, const std::string &file_name, const TDateTime &tm)
+{
+	Commit(fd, true);
+	if (!m_cfg.binary)
+	{
+		::close(fd);
+		m_remove.PutValue(tm, file_name);
+		return;
+	}
+
+	if (!m_file->Close())
+		Log.Error("Can't truncate save file", file_name, errno);
+	m_file.reset();
+
+	m_segment.m_closed = std::chrono::system_clock::now();
+	{
+		SYS_LOCK(m_index);
+		m_index[m_segment.m_name] = m_segment;
+		SaveIndex();
+	}
+
+	if (m_cfg.archive)
+		m_evCompact.Set();
+}
+
+//Файл следующего часа выделяется заранее, чтобы смена файла не ждала fallocate; оставшийся от аварийной остановки
+//выделенный файл без данных берётся снова. Невостребованный файл удаляется; пустое имя - только удалить.
+void CStorage::PrepareFile(const std::string &file_name)
+{
+	if (m_next)
+	{
+		m_next.reset();
+		::remove(m_next_name.c_str());
+	}
+
+	if (file_name.empty())
+		return;
+
+	if (fs::exists(file_name))
+	{
+		const TS::CMappedFile file(file_name);
+		Journal::CReader reader(file.data(), file.size());
+		reader.ForEach([](const auto &) {});
+		if (reader.GetSize())
+			return;
+	}
+
+	m_next.reset(new TS::CMappedWriter(file_name, 0, m_cfg.segment_size));
+	m_next_name = file_name;
+	if (!m_next->IsOpen())
+	{
+		Log.Warning("Can't prepare save file", file_name, errno);
+		m_next.reset();
+	}
+}
+
+//Журнал аудита дописывается в конец файла новым сегментом, недописанный хвост после аварийной остановки отрезается
+void CStorage::OpenAudit(const std::string &file_name, const TDateTime &tm)
+{
+	if (fs::exists(file_name))
+	{
+		const TS::CMappedFile file(file_name);
+		Journal::CReader reader(file.data(), file.size());
+		reader.ForEach([](const auto &) {});
+		if (!reader.IsComplete())
+		{
+			Log.Warning("Truncate broken journal tail", file_name, reader.GetSize(), file.size());
+			if (::truncate(file_name.c_str(), reader.GetSize()) != 0)
+				Log.Error("Can't truncate save file", file_name, errno);
+		}
+	}
+
+	m_audit_name = file_name;
+	m_audit_fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+	if (m_audit_fd < 0)
+		Log.Error("Can't open save file", file_name, errno);
+
+	m_audit.Start(tm);
+}
+
+void CStorage::CloseAudit(const TDateTime &tm)
+{
+	if (m_audit_fd < 0)
+		return;
+
+	::close(m_audit_fd);
+	m_audit_fd = -1;
+	m_remove.PutValue(tm, m_audit_name);
+}
+
+inline
+std::string GetIndexName(const std::string &dir)
+{
+	return TS::FormatStr<0>(dir, '/', program_invocation_short_name, ".rm_index");
+}
+
+inline
+std::string GetTailName(const std::string &dir)
+{
+	return TS::FormatStr<0>(dir, '/', program_invocation_short_name, ".rm_tail");
+}
+
+void CStorage::LoadIndex()
+{
+	std::ifstream in(GetIndexName(m_cfg.dir));
+	SYS_LOCK(m_index);
+	std::string line;
+	while (std::getline(in, line))
+	{
+		Journal::SSegmentInfo info;
+		if (!info.Parse(line))
+		{
+			Log.Warning("Storage: broken index line", line);
+			continue;
+		}
+
+		//Время закрытия для строк прежних версий: время изменения файла, если его нет - последнего объекта
+		if (info.m_closed == TDateTime::min())
+		{
+			std::error_code err;
+			const auto tm = fs::last_write_time(m_cfg.dir / info.m_name, err);
+			info.m_closed = err? info.m_last: TDateTime(std::chrono::duration_cast<TDateTime::duration>(tm.time_since_epoch()));
+		}
+		m_index[info.m_name] = info;
+	}
+}
+
+//Файл пишется во временный и заменяет прежний переименованием
+inline
+bool ReplaceFile(const std::string &name, const std::string &body)
+{
+	const auto tmp = name + ".tmp";
+	const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return false;
+
+	const bool res = WriteFile(fd, body) && ::fdatasync(fd) == 0;
+	::close(fd);
+	return res && ::rename(tmp.c_str(), name.c_str()) == 0;
+}
+
+void CStorage::SaveIndex()
+{
+	std::string body;
+	for (auto &item: m_index)
+		body += item.second.Format() + '\n';
+
+	const auto name = GetIndexName(m_cfg.dir);
+	if (!ReplaceFile(name, body))
+		Log.Error("Index is not saved", name, errno);
+}
+
+//Файл из оглавления удаляется целиком через period после закрытия: по времени объектов нельзя, в файле могут быть только метки снимков
+void CStorage::EraseExpired(const TDateTime &tm)
+{
+	SYS_LOCK(m_index);
+	bool changed = false;
+	for (auto it = m_index.begin(); it != m_index.end(); )
+	{
+		if (it->second.m_closed >= tm - m_cfg.period)
+		{
+			++it;
+			continue;
+		}
+
+		const auto name = (m_cfg.dir / it->first).native();
+		const auto res = ::remove(name.c_str());
+		Log.Info("Delete expired save file", name, it->second.m_closed, it->second.m_count, res, errno);
+		it = m_index.erase(it);
+		changed = true;
+	}
+
+	if (changed)
+		SaveIndex();
+}
+
+//Список переполнения забирается вместе с хвостом кольца: всё, что производитель положил в кольцо
+//до своих объектов в списке, лежит до этого хвоста и пишется раньше списка. Объекты после хвоста - позже списка.
+size_t CStorage::Drain(size_t max)
+{
+	size_t n = 0;
+	const auto ring = [this, &n](size_t max)
+	{
+		const size_t res = m_queue.Drain([this](const Journal::SEntry &entry)
+		{
+			entry.Get([this](const auto &obj)
+			{
+				WriteObject(obj);
+			});
+		}, max);
+		m_written += res;
+		n += res;
+	};
+
+	while (n < max)
+	{
+		if (!m_pending.empty())
+		{
+			ring(std::min(max - n, m_pending_tail - m_queue.GetHead()));
+			if (m_queue.GetHead() < m_pending_tail)
+			{
+				//Ячейка занята производителем, но ещё не заполнена
+				if (n < max)
+					std::this_thread::yield();
+				continue;
+			}
+
+			for (; n < max && !m_pending.empty(); ++n, ++m_spill_written)
+			{
+				TS_NOEXCEPT(m_pending.front()());
+				m_pending.pop_front();
+			}
+			continue;
+		}
+
+		ring(max - n);
+		if (n == max || !m_spilled.load(std::memory_order_relaxed))
+			break;
+
+		SYS_LOCK(m_spill);
+		m_pending.swap(m_spill);
+		m_pending_tail = m_queue.GetTail();
+		m_spilled.store(false, std::memory_order_relaxed);
+	}
+
+	if (n && !m_uncommitted)
+		m_uncommitted_time = std::chrono::system_clock::now();
+	m_uncommitted += n;
+	return n;
+}
+
+//Записанное в файл фиксируется по режиму durability, после чего ждущие производители отпускаются
+void CStorage::Commit(int fd, bool force)
+{
+	if (!m_uncommitted)
+		return;
+
+	if (m_durability == TDurability::Group && !force && m_uncommitted < m_cfg.group_records
+		&& std::chrono::system_clock::now() - m_uncommitted_time < m_cfg.group_period)
+		return;
+
+	if (m_durability != TDurability::None && fd >= 0 && ::fdatasync(fd) != 0)
+		Log.Error("Storage: fdatasync error", errno);
+
+	if (m_durability != TDurability::None && m_audit_fd >= 0 && ::fdatasync(m_audit_fd) != 0)
+		Log.Error("Storage: fdatasync error", errno);
+
+	{
+		std::lock_guard<std::mutex> lock(m_commit_mx);
+		m_committed.store(m_written, std::memory_order_release);
+		m_spill_committed.store(m_spill_written, std::memory_order_release);
+	}
+	m_commit_cv.notify_all();
+
+	m_rm.m_latency.m_Commit.Put(std::chrono::system_clock::now() - m_uncommitted_time);
+	m_uncommitted = 0;
+}
+
+//Поток записи фиксирует всё записанное и при остановке дописывает очередь, поэтому ожидание без тайм-аута:
+//не дождаться можно, только если объект положен после завершения потока записи
+void CStorage::WaitCommit(const std::atomic<uint64_t> &committed, uint64_t ticket)
+{
+	if (committed.load(std::memory_order_acquire) >= ticket)
+		return;
+
+	TS_LATENCY_SCOPE(m_rm.m_latency.m_Durable);
+	std::unique_lock<std::mutex> lock(m_commit_mx);
+	m_commit_cv.wait(lock, [this, &committed, ticket]()
+	{
+		return committed.load(std::memory_order_acquire) >= ticket || m_writer_stopped;
+	});
+
+	if (committed.load(std::memory_order_acquire) < ticket)
+		Log.Error("Storage: object is not committed, writer is stopped", ticket);
+}
+
+void CStorage::Flush(int fd)
+{
+	if (!m_cfg.binary)
+	{
+		const auto text = m_text.str();
+		m_text.str({});
+		if (fd >= 0)
+			WriteFile(fd, text);
+		return;
+	}
+
+	auto &buf = m_journal.GetBuffer();
+	if (m_file && m_file->Write(buf.data(), buf.size()))
+	{
+		m_segment.Append(buf.data(), buf.size());
+		if (m_tail)
+			m_tail->Publish(m_file->size());
+	}
+	else if (!buf.empty())
+		Log.Error("Write file error", errno);
+	buf.clear();
+
+	auto &audit = m_audit.GetBuffer();
+	if (m_audit_fd >= 0 && !audit.empty())
+		WriteFile(m_audit_fd, audit);
+	audit.clear();
+}
+
+//Снимок пишется во временный файл и заменяет прежний переименованием
+void CStorage::SaveSnapshot()
+{
+	const auto tm = std::chrono::system_clock::now();
+	const uint64_t id = Journal::ToNanoseconds(tm);
+
+	Snapshot::CWriter out;
+	m_rm.SaveSnapshot(out, [this, id]()
+	{
+		Save(Journal::SSnapshotMark{id});
+	});
+	const auto tm2 = std::chrono::system_clock::now();
+
+	const auto &body = out.GetBuffer();
+	const auto name = GetSnapshotName(m_cfg.dir);
+	const auto tmp = name + ".tmp";
+	const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+	{
+		Log.Error("Can't open snapshot file", tmp, errno);
+		return;
+	}
+
+	const bool res = WriteFile(fd, Snapshot::MakeHeader(id, body)) && WriteFile(fd, body) && ::fdatasync(fd) == 0;
+	::close(fd);
+	if (!res || ::rename(tmp.c_str(), name.c_str()) != 0)
+	{
+		Log.Error("Snapshot is not saved", name, errno);
+		return;
+	}
+
+	Log.Info("Snapshot saved", name, id, body.size(), tm2 - tm, std::chrono::system_clock::now() - tm2);
+}
+
+void CStorage::SnapshotThreadProc(Sys::CThreadControl &thread)
+{
+	while (thread.Wait(m_cfg.snapshot_period))
+		TS_NOEXCEPT(SaveSnapshot());
+}
+
+//Закрытый файл журнала сверяется с оглавлением, переписывается в архив и заменяется им в оглавлении.
+//false - файл не совпал с оглавлением или архив не записан.
+bool CStorage::Compact(const Journal::SSegmentInfo &info)
+{
+	const auto name = (m_cfg.dir / info.m_name).native();
+	const auto arch = fs::path(name).replace_extension(".rm_arch").native();
+	const auto tm = std::chrono::system_clock::now();
+
+	std::string body;
+	{
+		const TS::CMappedFile file(name);
+		if (file.size() != info.m_size || TS::CCrc32c::Calc(file.data(), file.size()) != info.m_crc)
+		{
+			Log.Warning("Archive: file doesn't match index", name, file.size(), info.m_size);
+			return false;
+		}
+
+		Archive::CWriter out;
+		Journal::CReader(file.data(), file.size()).ForEach([&out](const auto &obj)
+		{
+			out.Put(obj);
+		});
+		body = out.Finish();
+	}
+
+	if (!ReplaceFile(arch, body))
+	{
+		Log.Error("Archive is not saved", arch, errno);
+		return false;
+	}
+
+	auto res = info;
+	res.m_name = fs::path(arch).filename().native();
+	res.m_size = body.size();
+	res.m_crc = TS::CCrc32c::Calc(body.data(), body.size());
+	{
+		SYS_LOCK(m_index);
+		//Файл уже удалён по сроку хранения
+		if (!m_index.erase(info.m_name))
+		{
+			::remove(arch.c_str());
+			return true;
+		}
+
+		m_index[res.m_name] = res;
+		SaveIndex();
+	}
+
+	::remove(name.c_str());
+	Log.Info("Save file archived", name, info.m_size, body.size(), std::chrono::system_clock::now() - tm);
+	return true;
+}
+
+//Файл текущего часа не архивируется: после перезапуска поток записи продолжит его
+void CStorage::CompactThreadProc(Sys::CThreadControl &thread)
+{
+	do
+	{
+		const auto now = std::chrono::duration_cast<std::chrono::hours>(std::chrono::system_clock::now().time_since_epoch());
+		const auto current = fs::path(GetFileName(m_cfg.dir, now, true)).filename().native();
+
+		std::vector<Journal::SSegmentInfo> items;
+		{
+			SYS_LOCK(m_index);
+			for (auto &item: m_index)
+			{
+				if (fs::path(item.first).extension() == ".rm_jrnl" && item.first != current && !m_broken.count(item.first))
+					items.push_back(item.second);
+			}
+		}
+
+		for (size_t i = 0; i < items.size() && !thread.IsStop(); ++i)
+		{
+			bool res = false;
+			TS_NOEXCEPT(res = Compact(items[i]));
+			if (!res)
+				m_broken.insert(items[i].m_name);
+		}
+	}
+	while (thread.Wait(1min, m_evCompact));
+}
+
+//Файл меняется ровно на границе часа: ожидание не дольше неё
 void CStorage::ThreadProc(Sys::CThreadControl &thread)
 {
 	mkdir(m_cfg.dir.c_str(), 0777);
+	if (m_cfg.binary && m_cfg.tail)
+	{
+		m_tail.reset(new Tail::CPublisher(GetTailName(m_cfg.dir)));
+		if (!m_tail->IsOpen())
+		{
+			Log.Warning("Can't open tail file", GetTailName(m_cfg.dir), errno);
+			m_tail.reset();
+		}
+	}
 
 	typedef std::chrono::hours TPeriod;
 	TPeriod tm(0);
 
-	std::ofstream fout;
+	int fd = -1;
 	std::string file_name;
-	while (thread.Wait(1min, m_evSave) != nullptr)
+	size_t dropped = 0;
+	const size_t batch = m_durability == TDurability::Sync? 1: m_queue.capacity();
+	const auto timeout = [this, &tm]() -> TDateTime::duration
 	{
+		const auto now = std::chrono::system_clock::now();
+		TDateTime::duration res = TDateTime(tm + TPeriod(1)) - now;
+		if (m_durability == TDurability::Group && m_uncommitted)
+			res = std::min<TDateTime::duration>(res, m_uncommitted_time + m_cfg.group_period - now);
+		return std::max<TDateTime::duration>(res, 0s);
+	};
+
+	while (!thread.IsStop() && (!m_queue.Park() || thread.Wait(timeout(), m_evSave) != nullptr))
+	{
+		m_queue.Unpark();
+
 		const auto now = std::chrono::duration_cast<TPeriod>(std::chrono::system_clock::now().time_since_epoch());
 		if (tm != now)
 		{
 			if (!file_name.empty())
 			{
-				fout.close();
+				CloseFile(fd, file_name, TDateTime(now));
+				CloseAudit(TDateTime(now));
 				Log.Debug("Close save file", file_name, std::chrono::system_clock::time_point(tm));
-				m_remove.PutValue(TDateTime(now), file_name);
 			}
 			tm = now;
 
-			file_name = GetFileName(m_cfg.dir, tm);
-			fout.open(file_name, std::ofstream::app);
+			file_name = GetFileName(m_cfg.dir, tm, m_cfg.binary);
+			fd = OpenFile(file_name, TDateTime(now));
 
 			Log.Info("Open file for save", file_name);
+			if (m_cfg.binary)
+				PrepareFile(GetFileName(m_cfg.dir, tm + TPeriod(1), true));
+			if (m_cfg.binary && m_cfg.audit)
+				OpenAudit(GetFileName(m_cfg.dir, tm, ".rm_audit"), TDateTime(now));
 		}
 
-        auto items = Sys::Locked::Move(m_items);
-        for (auto &item: items)
-			TS_NOEXCEPT(item(fout));
+		//Не больше кольца за проход: под постоянной нагрузкой остановка и смена файла проверяются на каждом
+		for (size_t total = 0; total < m_queue.capacity(); )
+		{
+			const size_t n = Drain(batch);
+			if (!n)
+				break;
+
+			Flush(fd);
+			Commit(fd, false);
+			total += n;
+			if (n < batch)
+				break;
+		}
+		Commit(fd, false);
+
+		if (dropped != m_dropped.load(std::memory_order_relaxed))
+		{
+			const auto n = m_dropped.load(std::memory_order_relaxed);
+			Log.Warning("Storage: queue is full, objects dropped", n - dropped, n);
+			dropped = n;
+		}
 
-		m_remove.EraseExpired(std::chrono::system_clock::now());
+		const auto tm2 = std::chrono::system_clock::now();
+		m_remove.EraseExpired(tm2);
+		EraseExpired(tm2);
 	}
-}
 
+	//Обработчики уже сняты: дописывается и фиксируется остаток очереди
+	m_queue.Unpark();
+	while (Drain(m_queue.capacity()))
+		Flush(fd);
+	Commit(fd, true);
+	{
+		std::lock_guard<std::mutex> lock(m_commit_mx);
+		m_writer_stopped = true;
+	}
+	m_commit_cv.notify_all();
+
+	if (!file_name.empty())
+		CloseFile(fd, file_name, std::chrono::system_clock::now());
+	CloseAudit(std::chrono::system_clock::now());
+	PrepareFile({});
+}
@@ -2,17 +2,52 @@
 #include "RiskManager.h"
 #include "Common/Thread.h"
 #include "Common/FramedQueue.h"
+#include "Common/MpscRing.h"
+#include "Common/MappedFile.h"
+#include "Journal.h"
+#include "Tail.h"
 
+#include <condition_variable>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
 #include <sys/stat.h>
 #include <sys/types.h>
 
+//binary: двоичный журнал (.rm_jrnl, см. Journal.h), иначе текст (.rm_save); при загрузке читаются оба
+//queue_size: записей в очереди к потоку записи; overflow - что делать при полной очереди:
+//block - ждать, drop - выбросить и посчитать, spill - сложить в список, который поток записи заберёт после очереди
+//durability: none - объекты пишутся в кэш страниц без fdatasync, group - fdatasync раз в group_period или через group_records объектов,
+//sync - fdatasync после каждого объекта; commit_wait - обработчик котировки или сделки ждёт фиксации своего объекта (в none - записи в файл)
+//segment_size: двоичный журнал пишется через отображение в память в заранее выделенные файлы, место выделяется шагами по segment_size;
+//закрытые за час файлы попадают в оглавление (.rm_index) и удаляются по нему через period после закрытия
+//archive: закрытые файлы двоичного журнала переписываются фоновым потоком в столбцовый архив (.rm_arch, см. Archive.h), он и загружается
+//audit: заявки и решения по ним пишутся в журнал аудита (.rm_audit) через ту же очередь, только с двоичным журналом;
+//при загрузке по нему восстанавливаются моратории инвесторов и состояние правил, зависящее от заявок
+//tail: имя текущего файла двоичного журнала и позиция записи в нём публикуются в <программа>.rm_tail для читателей из других процессов (см. Tail.h)
+//load_threads: потоков разбора журнала при загрузке, 0 - по числу ядер
+//snapshot_period: период снимков состояния (.rm_snap, см. Snapshot.h), 0 - без снимков; снимки пишутся только с двоичным журналом
 #define TS_CFG TS_CFG_(Storage)
 #define TS_CONFIG_ITEMS \
 	TS_ITEM(dir, fs::path, TS::FormatStr<0>("./", program_invocation_short_name, ".data")) \
 	TS_ITEM(period, std::chrono::minutes, 24h) \
+	TS_ITEM(binary, bool, true) \
+	TS_ITEM(queue_size, size_t, 16 * 1024) \
+	TS_ITEM(overflow, std::string, "spill") \
+	TS_ITEM(snapshot_period, std::chrono::seconds, 10min) \
+	TS_ITEM(load_threads, size_t, 0) \
+	TS_ITEM(durability, std::string, "none") \
+	TS_ITEM(group_period, std::chrono::milliseconds, 10ms) \
+	TS_ITEM(group_records, size_t, 1024) \
+	TS_ITEM(commit_wait, bool, false) \
+	TS_ITEM(segment_size, size_t, 64 * 1024 * 1024) \
+	TS_ITEM(archive, bool, true) \
+	TS_ITEM(audit, bool, true) \
+	TS_ITEM(tail, bool, true) \
 
 #include "Common/Config.inl"
 
@@ -27,22 +62,77 @@ public:
 	CStorage(CRiskManager &rm, const TS::CConfigFile &cfg)
 	: CObjectHandler<>(rm)
 	, m_cfg(cfg)
+	, m_overflow(GetOverflow(m_cfg.overflow))
+	, m_durability(GetDurability(m_cfg.durability))
+	, m_queue(m_cfg.queue_size)
 	{
 		Load();
 		m_thread.Start(&CStorage::ThreadProc, this);
 
-		RegisterCallback<SQuote>(&CStorage::Save<SQuote>, this);
+		CCallbackPtrHolder<SQuote>::m_cb = m_rm.RegisterReceivedQuote(&CStorage::Save<SQuote>, this);
 		RegisterCallback<STrade>(&CStorage::Save<STrade>, this);
+		if (m_cfg.binary && m_cfg.audit)
+			m_decisions = m_rm.RegisterCallback<SDecision>(&CStorage::Save<SDecision>, this);
+
+		if (m_cfg.binary && m_cfg.snapshot_period.count() > 0)
+			m_snapshot.Start(&CStorage::SnapshotThreadProc, this);
+
+		if (m_cfg.binary && m_cfg.archive)
+			m_compact.Start(&CStorage::CompactThreadProc, this);
 	}
 
+	//Архив не пишется после остановки записи: закрытый при остановке файл снова откроется при запуске в тот же час
 	~CStorage()
 	{
+		m_compact.Stop();
+		m_snapshot.Stop();
+		m_decisions.reset();
 		CObjectHandler<>::Reset();
 		m_thread.Stop();
 	}
 
+	//Снимок состояния с меткой в журнале; вызывается потоком снимков
+	void SaveSnapshot();
+
 protected:
-	typedef std::map<std::string, decltype(&CRiskManager::ProcessMessage<SQuote>)> THandlers;
+	typedef std::map<std::string, decltype(&CRiskManager::ReplayMessage<SQuote>)> THandlers;
+	typedef std::list<TS::CFunction<void()>> TItems;
+
+	enum class TOverflow
+	{
+		Block,
+		Drop,
+		Spill,
+	};
+
+	static TOverflow GetOverflow(const std::string &val)
+	{
+		if (val == "block")
+			return TOverflow::Block;
+		if (val == "drop")
+			return TOverflow::Drop;
+		if (val != "spill")
+			Log.Error("Storage: unknown overflow policy, use spill", val);
+		return TOverflow::Spill;
+	}
+
+	enum class TDurability
+	{
+		None,
+		Group,
+		Sync,
+	};
+
+	static TDurability GetDurability(const std::string &val)
+	{
+		if (val == "group")
+			return TDurability::Group;
+		if (val == "sync")
+			return TDurability::Sync;
+		if (val != "none")
+			Log.Error("Storage: unknown durability, use none", val);
+		return TDurability::None;
+	}
 
 	struct CRemoveFile
 	{
@@ -63,34 +153,200 @@ protected:
 
 	void Load();
 	void LoadFile(const fs::path &file_name, const THandlers &handlers);
+	void LoadJournal(const fs::path &file_name);
+	void LoadAudit(const std::set<fs::path> &files);
+	template <typename TReader> void LoadChunks(const std::string &name, std::vector<TReader> chunks, size_t size);
+	void ExpireFile(const fs::path &file_name);
+	bool LoadSnapshot(const std::set<fs::path> &files, fs::path &journal);
+
+	//Объекты журнала до метки загруженного снимка уже учтены в нём и пропускаются
+	template <typename T>
+	void Replay(const T &obj)
+	{
+		if (!m_mark)
+			m_rm.ReplayObject(obj);
+	}
+
+	void Replay(const Journal::SSnapshotMark &mark)
+	{
+		if (mark.m_id == m_mark)
+			m_mark = 0;
+	}
 
 	template <typename T> void _SaveObject(const T &obj, std::ostream &out);
 	template <typename T> void SaveObject(const T &obj, std::ostream &out)
 	{
 		out << GetObjectName<T>();
 		_SaveObject(obj, out);
-		out << std::endl;
+		out << '\n';
 	}
 
+	//Вызывается из потоков правил: объект копируется в ячейку кольца без блокировок и выделения памяти.
+	//Пока список переполнения не пуст, новые объекты идут туда же, чтобы не обогнать его.
+	//Фиксации ждут только котировки и сделки: метка снимка ставится под блокировками правил, решение по заявке не задерживает ответ.
 	template <typename T>
 	void Save(const T &obj)
 	{
-		SYS_LOCK(m_items);
-		m_items.emplace_back(&CStorage::SaveObject<T>, this, obj);
+		if (!Journal::SEntry::Fits(obj) || m_spilled.load(std::memory_order_relaxed))
+			return Spill(obj);
+
+		size_t ticket;
+		while (!(ticket = m_queue.TryPush([&obj](Journal::SEntry &entry) {entry.Set(obj);})))
+		{
+			if (m_overflow == TOverflow::Spill)
+				return Spill(obj);
+
+			if (m_overflow == TOverflow::Drop)
+			{
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			std::this_thread::yield();
+		}
+
+		if (m_queue.NeedWake())
+			m_evSave.Set();
+
+		if (m_cfg.commit_wait && IsMarketData<T>())
+			WaitCommit(m_committed, ticket);
+	}
+
+	template <typename T>
+	static constexpr bool IsMarketData()
+	{
+		return std::is_same<T, SQuote>::value || std::is_same<T, STrade>::value;
+	}
+
+	//Номера объектов списка переполнения идут в порядке списка и считаются отдельно от кольца
+	template <typename T>
+	void Spill(const T &obj)
+	{
+		uint64_t ticket;
+		{
+			SYS_LOCK(m_spill);
+			m_spill.emplace_back(&CStorage::WriteObject<T>, this, obj);
+			ticket = ++m_spill_seq;
+			m_spilled.store(true, std::memory_order_relaxed);
+		}
 		m_evSave.Set();
+
+		if (m_cfg.commit_wait && IsMarketData<T>())
+			WaitCommit(m_spill_committed, ticket);
+	}
+
+	//Решение ссылается на объекты вызывающего и копируется целиком
+	void Spill(const SDecision &decision)
+	{
+		Spill(Journal::SAudit{decision.m_order, decision.m_verdict});
 	}
 
+	void WaitCommit(const std::atomic<uint64_t> &committed, uint64_t ticket);
+
+	//Вызывается из потока записи: объект кодируется в буфер, буфер пишется в файл одним вызовом на пачку
+	template <typename T>
+	void WriteObject(const T &obj)
+	{
+		if (m_cfg.binary)
+		{
+			m_journal.Put(obj);
+			m_segment.Put(obj);
+		}
+		else
+			SaveObject(obj, m_text);
+	}
+
+	int OpenFile(const std::string &file_name, const TDateTime &tm);
+	void CloseFile(int fd, const std::string &file_name, const TDateTime &tm);
+	void PrepareFile(const std::string &file_name);
+	void OpenAudit(const std::string &file_name, const TDateTime &tm);
+	void CloseAudit(const TDateTime &tm);
+	size_t Drain(size_t max);
+	void Flush(int fd);
+	void Commit(int fd, bool force);
+
+	void LoadIndex();
+	void SaveIndex(); //Под блокировкой m_index
+	void EraseExpired(const TDateTime &tm);
+	bool Compact(const Journal::SSegmentInfo &info);
+	void CompactThreadProc(Sys::CThreadControl &);
 
 	void ThreadProc(Sys::CThreadControl &);
+	void SnapshotThreadProc(Sys::CThreadControl &);
 
-	Sys::CLockedObject<std::list<TS::CFunction<void(std::ostream &)>>> m_items;
+	const TOverflow m_overflow;
+	const TDurability m_durability;
+	TS::CMpscRing<Journal::SEntry> m_queue;
+	Sys::CLockedObject<TItems> m_spill;
+	uint64_t m_spill_seq = 0; //Под блокировкой m_spill
+	std::atomic<bool> m_spilled{false};
+	std::atomic<size_t> m_dropped{0};
+
+	//Только поток записи: забранный, но не записанный список переполнения и хвост кольца на момент, когда его забрали;
+	//счётчики записанных и ещё не зафиксированных объектов
+	TItems m_pending;
+	size_t m_pending_tail = 0;
+	uint64_t m_written = 0;
+	uint64_t m_spill_written = 0;
+	size_t m_uncommitted = 0;
+	TDateTime m_uncommitted_time;
+
+	//Номера зафиксированных объектов кольца и списка переполнения
+	std::atomic<uint64_t> m_committed{0};
+	std::atomic<uint64_t> m_spill_committed{0};
+	std::mutex m_commit_mx;
+	std::condition_variable m_commit_cv;
+	bool m_writer_stopped = false; //Под m_commit_mx: поток записи завершён, фиксаций больше не будет
+
+	Journal::CWriter m_journal;
+	std::ostringstream m_text;
+
+	//Только поток записи: журнал аудита пишется обычной дозаписью в файл
+	Journal::CWriter m_audit;
+	int m_audit_fd = -1;
+	std::string m_audit_name;
+
+	//Только поток записи: текущий файл двоичного журнала и заранее выделенный следующий
+	std::unique_ptr<TS::CMappedWriter> m_file;
+	std::unique_ptr<TS::CMappedWriter> m_next;
+	std::string m_next_name;
+	Journal::SSegmentInfo m_segment;
+	std::unique_ptr<Tail::CPublisher> m_tail;
+
+	//Оглавление закрытых файлов: пишет поток записи, архивы в нём заменяет поток архивации
+	Sys::CLockedObject<std::map<std::string, Journal::SSegmentInfo>> m_index;
 
 	Sys::CThread m_thread;
 	Sys::CEvent<false> m_evSave{m_thread};
 
 	TS::CMovingSum<std::string, CRemoveFile> m_remove{m_cfg.period};
+
+	uint64_t m_mark = 0; //Метка загруженного снимка, до которой пропускается журнал
+	TDateTime m_from = TDateTime::min(); //Объекты старше не нужны ни одному правилу
+	Sys::CThread m_snapshot;
+
+	TCallbackPtr<SDecision> m_decisions;
+
+	Sys::CThread m_compact;
+	Sys::CEvent<false> m_evCompact{m_compact};
+	std::set<std::string> m_broken; //Файлы, не совпавшие с оглавлением: не архивируются
 };
 
+template <> inline
+void CStorage::WriteObject<Journal::SAudit>(const Journal::SAudit &audit)
+{
+	m_audit.Put(audit);
+}
+
+//Метка снимка есть только в двоичном журнале
+template <> inline
+void CStorage::WriteObject<Journal::SSnapshotMark>(const Journal::SSnapshotMark &mark)
+{
+	if (m_cfg.binary)
+	{
+		m_journal.Put(mark);
+		m_segment.Put(mark);
+	}
+}
 
 }
 
@@ -0,0 +1,264 @@
+#pragma once
+#include "Journal.h"
+#include "Common/SeqLock.h"
+
+#include <atomic>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace RM
+{
+//Чтение текущего файла двоичного журнала из других процессов (мониторинг, P&L) без обращений к RM.
+//RM ведёт в каталоге журнала файл <программа>.rm_tail (SHeader), отображённый в память:
+//имя текущего файла журнала и позиция записи в нём. Позиция публикуется после записи объектов в отображение файла
+//(до fdatasync) и только по границе записей; смена файла публикуется после того, как прежний обрезан до записанного.
+//Читатель отображает файл журнала только для чтения и разбирает записи до опубликованной позиции (Tail::CReader).
+//Если читатель пропустил больше одной смены файла, пропущенные файлы он не читает.
+namespace Tail
+{
+static const uint32_t Magic = 0x544d5231; //RMT1
+static const uint32_t Version = 1;
+
+//Файл журнала; id меняется при каждом открытии файла, в том числе того же после перезапуска
+struct SSegment
+{
+	uint64_t m_id;
+	char m_name[248];
+};
+
+struct SPosition
+{
+	uint64_t m_id;
+	uint64_t m_pos;
+};
+
+struct SHeader
+{
+	uint32_t m_magic = Magic;
+	uint32_t m_version = Version;
+	TS::CSeqLock<SSegment> m_segment{SSegment()};
+	TS::CSeqLock<SPosition> m_pos{SPosition()};
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Tail::SHeader is shared between processes");
+
+//Сторона RM: вызывается только из потока записи
+class CPublisher
+{
+public:
+	explicit CPublisher(const std::string &name)
+	{
+		const int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (fd < 0)
+			return;
+
+		//Заголовок прежнего запуска сохраняется: счётчики seqlock продолжают расти, и читатель, начавший чтение до перезапуска,
+		//не примет смесь старого и нового значений
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && (size_t(st.st_size) == sizeof(SHeader) || ::ftruncate(fd, sizeof(SHeader)) == 0))
+		{
+			void *data = ::mmap(nullptr, sizeof(SHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				m_hdr = static_cast<SHeader *>(data);
+				if (size_t(st.st_size) != sizeof(SHeader) || m_hdr->m_magic != Magic || m_hdr->m_version != Version)
+					m_hdr = new(data) SHeader;
+			}
+		}
+		::close(fd);
+	}
+
+	~CPublisher()
+	{
+		if (m_hdr)
+			::munmap(m_hdr, sizeof(SHeader));
+	}
+
+	TS_COPYABLE(CPublisher, delete);
+	TS_MOVABLE(CPublisher, delete);
+
+	bool IsOpen() const
+	{
+		return m_hdr != nullptr;
+	}
+
+	//Новый файл журнала (имя без каталога) с уже записанными pos байтами; false - имя не помещается в SSegment
+	bool Open(const std::string &name, size_t pos)
+	{
+		SSegment segment = {};
+		if (!m_hdr || name.size() >= sizeof(segment.m_name))
+			return false;
+
+		segment.m_id = Journal::ToNanoseconds(std::chrono::system_clock::now());
+		name.copy(segment.m_name, name.size());
+		m_hdr->m_segment.Store(segment);
+		m_id = segment.m_id;
+		Publish(pos);
+		return true;
+	}
+
+	void Publish(size_t pos)
+	{
+		if (m_hdr)
+			m_hdr->m_pos.Store(SPosition{m_id, pos});
+	}
+
+protected:
+	SHeader *m_hdr = nullptr;
+	uint64_t m_id = 0;
+};
+
+//Сторона читателя: Poll() передаёт объекты, записанные с прошлого вызова. Объекты разбираются прямо из отображения файла,
+//сам RM ничего не делает для читателей, поэтому их число не ограничено.
+class CReader
+{
+public:
+	//name - путь к файлу .rm_tail
+	explicit CReader(const std::string &name)
+	: m_dir(name.substr(0, name.rfind('/') + 1))
+	{
+		const int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(SHeader))
+		{
+			void *data = ::mmap(nullptr, sizeof(SHeader), PROT_READ, MAP_SHARED, fd, 0);
+			if (data != MAP_FAILED)
+				m_hdr = static_cast<const SHeader *>(data);
+		}
+		::close(fd);
+
+		if (m_hdr && (m_hdr->m_magic != Magic || m_hdr->m_version != Version))
+		{
+			::munmap(const_cast<SHeader *>(m_hdr), sizeof(SHeader));
+			m_hdr = nullptr;
+		}
+	}
+
+	~CReader()
+	{
+		Close();
+		if (m_hdr)
+			::munmap(const_cast<SHeader *>(m_hdr), sizeof(SHeader));
+	}
+
+	TS_COPYABLE(CReader, delete);
+	TS_MOVABLE(CReader, delete);
+
+	//false - файл .rm_tail не найден или другой версии
+	bool IsOpen() const
+	{
+		return m_hdr != nullptr;
+	}
+
+	//Текущий файл журнала
+	const std::string &GetName() const
+	{
+		return m_name;
+	}
+
+	//func вызывается для SQuote, STrade и SSnapshotMark в порядке журнала; возвращает число котировок и сделок.
+	//После смены файла сначала дочитывается прежний.
+	template <typename TFunc>
+	size_t Poll(TFunc &&func)
+	{
+		if (!m_hdr)
+			return 0;
+
+		//Без ожидания: RM мог остановиться посреди записи позиции
+		SPosition pos;
+		if (!m_hdr->m_pos.TryLoad(pos))
+			return 0;
+
+		size_t n = 0;
+		if (pos.m_id != m_id)
+		{
+			SSegment segment;
+			if (!m_hdr->m_segment.TryLoad(segment) || segment.m_id != pos.m_id)
+				return 0; //Файл меняется
+
+			struct stat st;
+			if (m_fd >= 0 && ::fstat(m_fd, &st) == 0)
+				n += Read(st.st_size, func);
+
+			segment.m_name[sizeof(segment.m_name) - 1] = 0;
+			if (m_name != segment.m_name)
+				Open(segment.m_name);
+			m_id = pos.m_id;
+		}
+		return n + Read(pos.m_pos, func);
+	}
+
+protected:
+	//Тот же файл после перезапуска RM дописывается новым сегментом: разбор продолжается с прежнего места
+	void Open(const std::string &name)
+	{
+		Close();
+		m_name = name;
+		m_reader = Journal::CReader(nullptr, 0);
+		m_fd = ::open((m_dir + name).c_str(), O_RDONLY | O_CLOEXEC);
+	}
+
+	void Close()
+	{
+		if (m_data)
+			::munmap(const_cast<char *>(m_data), m_size);
+		m_data = nullptr;
+		m_size = 0;
+
+		if (m_fd >= 0)
+			::close(m_fd);
+		m_fd = -1;
+	}
+
+	//Файл растёт шагами segment_size: отображение расширяется до текущего размера файла
+	bool Map(size_t size)
+	{
+		if (size <= m_size)
+			return true;
+
+		struct stat st;
+		if (m_fd < 0 || ::fstat(m_fd, &st) != 0 || size_t(st.st_size) < size)
+			return false;
+
+		void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+
+		if (m_data)
+			::munmap(const_cast<char *>(m_data), m_size);
+		m_data = static_cast<const char *>(data);
+		m_size = st.st_size;
+		return true;
+	}
+
+	template <typename TFunc>
+	size_t Read(size_t size, TFunc &&func)
+	{
+		if (size <= m_reader.GetSize() || !Map(size))
+			return 0;
+
+		m_reader.Extend(m_data, size);
+		return m_reader.ForEach(func);
+	}
+
+	const std::string m_dir;
+	const SHeader *m_hdr = nullptr;
+	uint64_t m_id = 0;
+
+	std::string m_name;
+	int m_fd = -1;
+	const char *m_data = nullptr;
+	size_t m_size = 0;
+	Journal::CReader m_reader{nullptr, 0};
+};
+
+}
+}
@@ -0,0 +1,11 @@
+#Сверка пакетной проверки заявок с последовательной: make -f Check.mak, запуск build_bin/Release/rm_check [число шагов [seed]]
+PROJECT_NAME = Check
+TARGET = executable
+TARGET_NAME = rm_check
+
+SRC = CheckOrders.cpp ../RiskManager.cpp ../OrderCheckRules.cpp ../DrawDownRule.cpp
+INCLUDE = ..
+
+include ../mk/Common.mak
+SOLUTION_DIR := ..
+include $(BUILD_MAK)
@@ -0,0 +1,205 @@
+#include <string>
+#include "Common.h"
+#include "RiskManager.h"
+
+#include <random>
+#include <set>
+
+//Сверка CRiskManager::CheckOrders с последовательной обработкой ProcessMessage<SOrder>:
+//  rm_check [steps [seed]]
+//Два RM с одинаковыми правилами получают один поток котировок и сделок, заявки пачками - один через CheckOrders,
+//другой по одной. Сравниваются ответы и решения для журнала аудита в порядке публикации,
+//отдельно считаются отказы по мораторию, установленному внутри той же пачки.
+using namespace RM;
+
+namespace
+{
+typedef std::shared_ptr<const CMessage> TMessagePtr;
+
+template <typename T>
+TMessagePtr MakeMessage(const T &obj);
+
+#define TS_ITEM(name, type) attrs.emplace_back(#name, TS::FormatStr<0>(obj.m_##name));
+#define RM_MAKE_MESSAGE(name, items) template <> TMessagePtr MakeMessage<S##name>(const S##name &obj) \
+	{CMessage::TAttrs attrs{{GetObjectName<S##name>(), {}}}; items; return std::make_shared<const CMessage>(std::move(attrs));}
+
+RM_MAKE_MESSAGE(Quote, RM_QUOTE)
+RM_MAKE_MESSAGE(Trade, RM_TRADE)
+RM_MAKE_MESSAGE(Order, RM_ORDER)
+
+#undef RM_MAKE_MESSAGE
+#undef TS_ITEM
+
+//Ответы на заявки: пусто - принята, иначе причина отказа
+class CReplies
+: public CTransport
+{
+public:
+	virtual void SendMessage(const CMessage::TAttrs &attrs) override
+	{
+		const auto it = std::find_if(attrs.begin(), attrs.end(), [](const auto &attr)
+		{
+			return attr.first == "reject";
+		});
+		m_replies.emplace_back(it == attrs.end()? std::string(): it->second);
+	}
+
+	std::vector<std::string> m_replies;
+};
+
+class CRun
+{
+public:
+	CRun()
+	: m_rm(m_cfg)
+	{
+		for (const auto *name: {"NewOrderMoratorium", "PriceCheck", "SeqBadTrades", "DrawDown"})
+			m_rm.AddRule(name, m_cfg);
+
+		m_decision = m_rm.RegisterCallback<SDecision>(&CRun::OnDecision, this);
+	}
+
+	template <typename T>
+	void Put(const TMessagePtr &msg)
+	{
+		m_rm.ProcessMessage<T>(m_trans, *msg);
+	}
+
+	void PutSequential(const std::vector<TMessagePtr> &msgs)
+	{
+		for (auto &msg: msgs)
+			m_rm.ProcessMessage<SOrder>(m_trans, *msg);
+	}
+
+	std::vector<SVerdict> PutBatch(const std::vector<TMessagePtr> &msgs)
+	{
+		std::vector<SOrder> orders;
+		for (auto &msg: msgs)
+			orders.emplace_back(Parse<SOrder>(*msg));
+
+		std::vector<SVerdict> verdicts(orders.size());
+		m_rm.CheckOrders(orders, verdicts);
+		return verdicts;
+	}
+
+	void OnDecision(const SDecision &decision)
+	{
+		m_decisions.emplace_back(decision.m_order.m_order_id, decision.m_verdict.m_reject);
+	}
+
+	const TS::CConfigFile m_cfg;
+	CRiskManager m_rm;
+	CReplies m_trans;
+	TCallbackManager<SDecision>::TCallbackPtr m_decision;
+	std::vector<std::pair<TOrderID, std::string>> m_decisions;
+};
+
+int Check(size_t steps, unsigned seed)
+{
+	std::mt19937 rnd(seed);
+	std::uniform_real_distribution<double> real;
+	std::normal_distribution<double> gauss(0, 0.01);
+
+	static const size_t Symbols = 5, Users = 64, MaxBatch = 32;
+	std::vector<TPrice> prices(Symbols, 100);
+	auto tm = TDateTime(std::chrono::hours(24 * 20744 + 10)); //2026-10-18 10:00
+
+	CRun batch, seq;
+	size_t orders = 0, rejects = 0, moratoria = 0, errors = 0;
+	for (size_t step = 0, id = 0; step < steps; ++step, ++id)
+	{
+		tm += std::chrono::milliseconds(size_t(real(rnd) * 10000));
+		const auto n = rnd() % Symbols;
+		const auto symbol = TS::FormatStr<0>('S', n);
+		auto &price = prices[n];
+
+		const auto r = real(rnd);
+		if (r < 0.4)
+		{
+			price *= 1 + gauss(rnd);
+			const auto msg = MakeMessage(SQuote{symbol, price, tm});
+			batch.Put<SQuote>(msg);
+			seq.Put<SQuote>(msg);
+			continue;
+		}
+
+		if (r < 0.6)
+		{
+			const auto side = rnd() % 2? TSide::Buy: TSide::Sell;
+			const auto msg = MakeMessage(STrade{TS::FormatStr<0>(id), TS::FormatStr<0>('u', rnd() % Users), symbol, side,
+				price * (1 + gauss(rnd)), TQty(1 + rnd() % 10), tm});
+			batch.Put<STrade>(msg);
+			seq.Put<STrade>(msg);
+			continue;
+		}
+
+		//Пачка заявок по немногим инструментам и инвесторам: отказ в начале пачки ставит мораторий для следующих
+		std::vector<TMessagePtr> msgs(1 + rnd() % MaxBatch);
+		for (auto &msg: msgs)
+		{
+			const auto type = rnd() % 3? TOrderType::Limit: TOrderType::Market;
+			const auto side = rnd() % 2? TSide::Buy: TSide::Sell;
+			const auto n = rnd() % Symbols;
+			msg = MakeMessage(SOrder{TS::FormatStr<0>(++id), TS::FormatStr<0>('u', rnd() % Users), type,
+				TS::FormatStr<0>('S', n), side, prices[n] * (1 + 4 * gauss(rnd)), 1, tm});
+			tm += std::chrono::milliseconds(rnd() % 5);
+		}
+
+		const auto verdicts = batch.PutBatch(msgs);
+		seq.m_trans.m_replies.clear();
+		seq.PutSequential(msgs);
+
+		std::set<std::pair<TSymbol, TUserID>> rejected;
+		for (size_t i = 0; i < msgs.size(); ++i)
+		{
+			const auto order = Parse<SOrder>(*msgs[i]);
+			const auto &verdict = verdicts[i];
+			const auto &reply = seq.m_trans.m_replies[i];
+			if (verdict.m_reject != reply)
+			{
+				++errors;
+				std::cout << "MISMATCH " << order.m_order_id << " batch: " << verdict.m_reject << ", sequential: " << reply << std::endl;
+			}
+
+			++orders;
+			if (verdict)
+				continue;
+
+			++rejects;
+			const std::pair<TSymbol, TUserID> key(order.m_symbol, order.m_user_id);
+			if (verdict.m_reason != "Moratorium")
+				rejected.insert(key);
+			else if (rejected.count(key))
+				++moratoria;
+		}
+	}
+
+	if (batch.m_decisions != seq.m_decisions)
+	{
+		++errors;
+		std::cout << "MISMATCH decisions: " << batch.m_decisions.size() << ", sequential: " << seq.m_decisions.size() << std::endl;
+	}
+
+	std::cout << "orders " << orders << ", rejects " << rejects << ", moratoria in batch " << moratoria << ", errors " << errors << std::endl;
+	if (!moratoria)
+		std::cout << "no moratorium set inside a batch: increase steps" << std::endl;
+	return errors || !moratoria? 1: 0;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		size_t steps = 20000;
+		unsigned seed = 1;
+		if (argc > 1)
+			TS::Parse(argv[1], steps);
+		if (argc > 2)
+			TS::Parse(argv[2], seed);
+		return Check(steps, seed);
+	}
+	TS_CATCH;
+	return 1;
+}
@@ -0,0 +1,236 @@
+#include <string>
+#include "Common.h"
+#include "Common/MappedFile.h"
+#include "Common/Parser.h"
+#include "Journal.h"
+#include "Archive.h"
+
+#include <cstring>
+#include <experimental/filesystem>
+
+//Файлы двоичного журнала (.rm_jrnl) и архива (.rm_arch) в текстовом виде журнала:
+//  rm_dump FILE - все котировки, сделки и метки снимков
+//  rm_dump FILE from [to] - котировки и сделки со временем в [from, to], время как в сообщениях
+//  rm_dump --check FILE.rm_jrnl - архив файла собирается в памяти и сверяется с журналом:
+//  целиком и выборками Scan по интервалам времени
+namespace fs = std::experimental::filesystem;
+using namespace RM;
+
+namespace
+{
+#define TS_ITEM(name, type) TS::FormatVals<0>(out, "|" #name, '=', obj.m_##name);
+void Print(std::ostream &out, const SQuote &obj) {out << GetObjectName<SQuote>(); RM_QUOTE; out << '\n';}
+void Print(std::ostream &out, const STrade &obj) {out << GetObjectName<STrade>(); RM_TRADE; out << '\n';}
+#undef TS_ITEM
+
+void Print(std::ostream &out, const Journal::SSnapshotMark &mark)
+{
+	out << "Snapshot|id=" << mark.m_id << '\n';
+}
+
+template <typename T>
+bool Equal(const T &val1, const T &val2)
+{
+	return val1 == val2;
+}
+
+//Цена и количество сравниваются побитно: архив должен вернуть то же число
+bool Equal(const double &val1, const double &val2)
+{
+	return std::memcmp(&val1, &val2, sizeof(val1)) == 0;
+}
+
+#define TS_ITEM(name, type) && Equal(obj1.m_##name, obj2.m_##name)
+bool Equal(const SQuote &obj1, const SQuote &obj2) {return true RM_QUOTE;}
+bool Equal(const STrade &obj1, const STrade &obj2) {return true RM_TRADE;}
+#undef TS_ITEM
+
+bool Equal(const Journal::SSnapshotMark &obj1, const Journal::SSnapshotMark &obj2)
+{
+	return obj1.m_id == obj2.m_id;
+}
+
+template <typename T>
+bool Equal(const std::vector<T> &items1, const std::vector<T> &items2)
+{
+	return std::equal(items1.begin(), items1.end(), items2.begin(), items2.end(), [](const T &obj1, const T &obj2)
+	{
+		return Equal(obj1, obj2);
+	});
+}
+
+bool Equal(const Journal::SBatch &batch1, const Journal::SBatch &batch2)
+{
+	return batch1.m_order == batch2.m_order && Equal(batch1.m_quotes, batch2.m_quotes) &&
+		Equal(batch1.m_trades, batch2.m_trades) && Equal(batch1.m_marks, batch2.m_marks);
+}
+
+bool InRange(const TDateTime &tm, const TDateTime &from, const TDateTime &to)
+{
+	return !(tm < from) && !(to < tm);
+}
+
+//Объекты журнала в интервале; метки снимков - только при выводе всего файла
+template <typename T>
+void Print(const T &obj, const TDateTime &from, const TDateTime &to)
+{
+	if (InRange(obj.m_time, from, to))
+		Print(std::cout, obj);
+}
+
+void Print(const Journal::SSnapshotMark &mark, const TDateTime &from, const TDateTime &to)
+{
+	if (from == TDateTime::min() && to == TDateTime::max())
+		Print(std::cout, mark);
+}
+
+template <typename TReader>
+int Dump(TReader &&reader, size_t size, const TDateTime &from, const TDateTime &to)
+{
+	reader.ForEach([&from, &to](const auto &obj)
+	{
+		Print(obj, from, to);
+	});
+
+	if (!reader.IsComplete())
+	{
+		std::cerr << "Broken data at " << reader.GetSize() << " of " << size << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int Dump(const std::string &name, const TDateTime &from, const TDateTime &to)
+{
+	const TS::CMappedFile file(name);
+	if (!file.data())
+	{
+		std::cerr << "Can't open " << name << std::endl;
+		return 1;
+	}
+
+	if (fs::path(name).extension() != ".rm_arch")
+		return Dump(Journal::CReader(file.data(), file.size()), file.size(), from, to);
+
+	//Архив: блоки вне интервала не разбираются
+	Archive::CReader reader(file.data(), file.size());
+	if (from == TDateTime::min() && to == TDateTime::max())
+		return Dump(reader, file.size(), from, to);
+
+	reader.Scan(from, to, [](const auto &obj)
+	{
+		Print(std::cout, obj);
+	});
+	return 0;
+}
+
+Journal::SBatch ReadAll(auto &&reader)
+{
+	Journal::SBatch res;
+	reader.ForEach([&res](auto &obj)
+	{
+		res.Put(obj);
+	});
+	return res;
+}
+
+//Котировки и сделки batch в [from, to] в порядке журнала
+Journal::SBatch Select(const Journal::SBatch &batch, const TDateTime &from, const TDateTime &to)
+{
+	Journal::SBatch res;
+	batch.ForEach([&res, &from, &to](const auto &obj)
+	{
+		if constexpr (!std::is_same<std::decay_t<decltype(obj)>, Journal::SSnapshotMark>::value)
+		{
+			auto copy = obj;
+			if (InRange(copy.m_time, from, to))
+				res.Put(copy);
+		}
+	});
+	return res;
+}
+
+//Журнал -> архив в памяти -> разбор архива: целиком и выборками Scan по Intervals частям времени журнала
+int Check(const std::string &name)
+{
+	static constexpr int Intervals = 16;
+
+	const TS::CMappedFile file(name);
+	if (!file.data())
+	{
+		std::cerr << "Can't open " << name << std::endl;
+		return 1;
+	}
+
+	Journal::CReader reader(file.data(), file.size());
+	const auto journal = ReadAll(reader);
+	if (!reader.IsComplete())
+	{
+		std::cerr << "Broken journal at " << reader.GetSize() << " of " << file.size() << std::endl;
+		return 1;
+	}
+
+	Archive::CWriter out;
+	journal.ForEach([&out](const auto &obj)
+	{
+		out.Put(obj);
+	});
+	const auto body = out.Finish();
+
+	Archive::CReader archive(body.data(), body.size());
+	const auto all = ReadAll(archive);
+	bool res = archive.IsComplete() && Equal(journal, all);
+	std::cout << "ForEach: " << (res? "OK": "MISMATCH") << ", objects " << journal.m_order.size() << ", journal " << file.size() << ", archive " << body.size() << std::endl;
+
+	Journal::SSegmentInfo range;
+	for (auto &obj: journal.m_quotes)
+		range.Put(obj);
+	for (auto &obj: journal.m_trades)
+		range.Put(obj);
+
+	const auto first = range.m_first, last = range.m_last;
+
+	size_t scanned = 0, failed = 0;
+	for (int i = 0; first <= last && i < Intervals; ++i)
+	{
+		const auto from = first + (last - first) * i / Intervals;
+		const auto to = first + (last - first) * (i + 1) / Intervals;
+		Journal::SBatch batch;
+		const size_t n = Archive::CReader(body.data(), body.size()).Scan(from, to, [&batch](const auto &obj)
+		{
+			auto copy = obj;
+			batch.Put(copy);
+		});
+		scanned += n;
+		if (n != batch.m_quotes.size() + batch.m_trades.size() || !Equal(Select(journal, from, to), batch))
+			++failed;
+	}
+	std::cout << "Scan: " << (failed? "MISMATCH": "OK") << ", intervals " << Intervals << ", failed " << failed << ", objects " << scanned << std::endl;
+	return res && !failed? 0: 1;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (argc > 2 && !std::strcmp(argv[1], "--check"))
+			return Check(argv[2]);
+
+		if (argc < 2 || argv[1][0] == '-')
+		{
+			std::cerr << "usage: " << argv[0] << " FILE [from [to]]\n       " << argv[0] << " --check FILE.rm_jrnl" << std::endl;
+			return 1;
+		}
+
+		auto from = TDateTime::min(), to = TDateTime::max();
+		if (argc > 2)
+			TS::Parse(argv[2], from);
+		if (argc > 3)
+			TS::Parse(argv[3], to);
+		return Dump(argv[1], from, to);
+	}
+	TS_CATCH;
+	return 1;
+}
@@ -0,0 +1,13 @@
+#Просмотр и проверка файлов журнала: make -f Dump.mak, запуск build_bin/Release/rm_dump
+PROJECT_NAME = JournalDump
+TARGET = executable
+TARGET_NAME = rm_dump
+
+SRC = Dump.cpp
+LDFLAGS = -lstdc++fs
+
+INCLUDE = ..
+
+include ../mk/Common.mak
+SOLUTION_DIR := ..
+include $(BUILD_MAK)
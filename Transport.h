@@ -5,6 +5,7 @@
 #include "Common/Parser.h"
 #include "Common/SocketServer.h"
 #include "Common/Config.h"
+#include "Common/Span.h"
 
 #include <algorithm>
 
@@ -104,6 +105,12 @@ public:
 	virtual void SendMessage(const CMessage::TAttrs &attrs)
 	{
 	};
+
+	virtual void SendMessages(TS::span<const CMessage::TAttrs *const> msgs)
+	{
+		for (auto *attrs: msgs)
+			SendMessage(*attrs);
+	};
 protected:
 };
 
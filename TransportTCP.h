@@ -10,6 +10,7 @@ class CClientPeer
 public:
 	CClientPeer(Sys::CSocket &&sock, CRiskManager &rm)
 	: Sys::CSocketConnection(std::move(sock))
+	, m_rm(rm)
 	{
 		Log.Debug("Accept", sock);
 		m_parser.reserve(32);
@@ -17,6 +18,7 @@ public:
 #define TS_ITEM(name) m_cb##name = RegisterCallback(#name, &RM::CRiskManager::PutMessage<RM::S##name>, &rm);
 		RM_OBJECTS
 #undef TS_ITEM
+		m_cbStats = RegisterCallback("Stats", &RM::CRiskManager::ProcessStats, &rm);
 	}
 
 	~CClientPeer()
@@ -30,13 +32,31 @@ public:
 			return;
 
         std::stringstream stm;
-		TS::FormatVal(stm, attrs.front().first) << '\1';
-		for (auto it = attrs.begin() + 1, end = attrs.end(); it != end; ++it)
-			TS::FormatVals<0>(stm, it->first, '=', it->second) << '\1';
+		FormatMessage(stm, attrs);
 
 		Sys::CSocketConnection::Send(stm);
 	};
 
+	virtual void SendMessages(TS::span<const CMessage::TAttrs *const> msgs) override
+	{
+		std::stringstream stm;
+		for (auto *attrs: msgs)
+		{
+			if (attrs->empty())
+				continue;
+
+			FormatMessage(stm, *attrs) << '\0';
+		}
+
+		const auto s = stm.str();
+		if (s.empty())
+			return;
+
+		const size_t n = m_sock.Send(s.data(), s.size());
+		if (n < s.size())
+			SendData(s.data() + n, s.size() - n);
+	};
+
 
 
 protected:
@@ -45,24 +65,68 @@ protected:
 		TS_NOEXCEPT(m_sock.Send("\0", 1));
 	}
 
+	static std::ostream &FormatMessage(std::ostream &stm, const CMessage::TAttrs &attrs)
+	{
+		TS::FormatVal(stm, attrs.front().first) << '\1';
+		for (auto it = attrs.begin() + 1, end = attrs.end(); it != end; ++it)
+			TS::FormatVals<0>(stm, it->first, '=', it->second) << '\1';
+
+		return stm;
+	}
+
 	virtual bool ParseDataChunk(char *data, size_t sz) override
 	{
-		m_parser.DoParse(data, sz, [this](auto &&attrs)
 		{
-			if (attrs.size() < 2)
-				return;
+			TS_LATENCY_SCOPE(m_rm.m_latency.m_Parse);
+			m_parser.DoParse(data, sz, [this](auto &&attrs)
+			{
+				if (attrs.size() < 2)
+					return;
+
+				m_msgs.emplace_back(std::make_shared<RM::CMessage>(std::move(attrs)));
+			});
+		}
 
-			auto sp = std::make_shared<RM::CMessage>(std::move(attrs));
-			this->DispatchMessage(std::move(sp));
-		});
+		DispatchMessages();
 		return true;
 	}
 
+	//Подряд идущие заявки из одного блока данных проверяются одной пачкой
+	void DispatchMessages()
+	{
+		auto msgs = std::move(m_msgs);
+		m_msgs.clear();
+
+		std::vector<const CMessage *> orders;
+		for (size_t i = 0, sz = msgs.size(); i < sz; )
+		{
+			size_t n = i;
+			while (n < sz && msgs[n]->GetID().first == GetObjectName<SOrder>())
+				++n;
+
+			if (n - i < 2)
+			{
+				this->DispatchMessage(std::move(msgs[i++]));
+				continue;
+			}
+
+			orders.clear();
+			for (; i < n; ++i)
+				orders.emplace_back(msgs[i].get());
+
+			m_rm.ProcessOrders(*this, orders);
+		}
+	}
+
+	CRiskManager &m_rm;
+
 	TS::CKeyValueParser<CMessage::TAttrs, '\1', '\0'> m_parser;
+	std::vector<std::shared_ptr<const CMessage>> m_msgs;
 
 #define TS_ITEM(name) CTransport::TCallbackPtr m_cb##name;
 	RM_OBJECTS
 #undef TS_ITEM
+	CTransport::TCallbackPtr m_cbStats;
 
 	const std::chrono::steady_clock::time_point m_tm{std::chrono::steady_clock::now()};
 };
@@ -13,10 +13,13 @@
 namespace fs = std::experimental::filesystem;
 int main(int argc, char *argv[])
 {
+	//Параметры: порт, файл настроек
 	u_short port = 0;
 	if (argc > 1)
 		TS::Parse(argv[1], port);
 
+	const std::string cfg_file = argc > 2? argv[2]: "";
+
 	if (!port)
 		port = 11111;
 
@@ -28,7 +31,7 @@ int main(int argc, char *argv[])
 	const auto save_dir = TS::FormatStr<0>("./", program_invocation_short_name, ".data");
 	try
 	{
-		TS::CConfigFile cfg;
+		const auto cfg = cfg_file.empty()? TS::CConfigFile(): TS::CConfigFile(cfg_file);
 
 		RM::CRiskManager rm(cfg);
 
@@ -45,7 +48,25 @@ int main(int argc, char *argv[])
 
 		Log.Info(program_invocation_short_name, "started", std::chrono::system_clock::now() - tm);
 
-		WaitStop();
+		//SIGHUP - перечитать файл настроек, SIGINT, SIGTERM, SIGTSTP - остановка
+		WaitStop([&rm, &cfg_file]()
+		{
+			if (cfg_file.empty())
+				return Log.Warning("Reload config: no config file");
+
+			Log.Info("Reload config", cfg_file);
+			std::unique_ptr<TS::CConfigFile> cfg;
+			try
+			{
+				cfg = std::make_unique<TS::CConfigFile>(cfg_file);
+			}
+			catch (const std::exception &e)
+			{
+				return Log.Error("Config is not reloaded, the previous one is kept", cfg_file, e.what());
+			}
+
+			TS_NOEXCEPT(rm.Reload(*cfg));
+		});
 		trans.Stop();
 	}
 	TS_CATCH;